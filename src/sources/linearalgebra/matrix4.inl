@@ -320,17 +320,7 @@ namespace linearalgebra {
     }
     template<typename FPType>
     inline void Matrix4<FPType>::scale(const Vector3<FPType> &scalev) {
-        m00 *= scalev.x;
-        m01 *= scalev.y;
-        m02 *= scalev.z;
-        
-        m10 *= scalev.x;
-        m11 *= scalev.y;
-        m12 *= scalev.z;
-        
-        m20 *= scalev.x;
-        m21 *= scalev.y;
-        m22 *= scalev.z;
+        scale(scalev.x, scalev.y, scalev.z);
     }
 
     // 1 matrix operations
@@ -43,6 +43,14 @@ Vector3 AABB::size() const {
 	return max - min;
 }
 
+RTFloat AABB::surfaceArea() const {
+	Vector3 d = max - min;
+	if(d.x < 0.0 || d.y < 0.0 || d.z < 0.0) {
+		return 0.0;
+	}
+	return (d.x * d.y + d.y * d.z + d.z * d.x) * 2.0;
+}
+
 void AABB::expand(const Vector3 &p) {
 	if(p.x < min.x) min.x = p.x;
 	if(p.y < min.y) min.y = p.y;
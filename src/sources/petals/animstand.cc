@@ -5,81 +5,102 @@
 #include <random>
 #include <chrono>
 #include <cmath>
-
-#include <stb/stb_image.h>
-#include <stb/stb_image_write.h>
+#include <algorithm>
 
 #include "animstand.h"
 #include "texture.h"
 #include "camera.h"
 #include "framebuffer.h"
+#include "imagewriter.h"
+#include "jobsystem.h"
 
 using namespace Petals;
 
 namespace {
     constexpr RTFloat kCelThickness = 0.000125; // [m]
+    constexpr int kTileSize = 64; // [pixel] unit of parallel work in a frame
+    constexpr int kProbeTiles = 4; // tiles per cut timed by the sample budget probe
+    constexpr double kProbeMinSec = 0.05; // probe tiles are repeated until the timing is this long
+    constexpr int kProbeMaxRounds = 64;
+    constexpr double kBudgetUtilization = 0.8; // rest of the time limit is left for stalls and writes
+
+    double GetSeconds() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
 
-    bool writeFrameBufferToFile(const FrameBuffer& fb, std::string savepath, RTFloat exportGamma = 2.2) {
-        int w = fb.getWidth();
-        int h = fb.getHeight();
-
-        std::vector<unsigned char> rgb8buf;
-        rgb8buf.resize(w * h * 3);
-
-        auto encodeTo8byte = [](RTColorType c, double gamma) {
-            c = std::max(0.0, std::min(1.0, c));
-            c = pow(c, 1.0 / gamma);
-            return static_cast<unsigned char>(std::max(0.0, std::min(255.0, c * 256.0)));
-            };
-
-        for (int iy = 0; iy < h; iy++) {
-            for (int ix = 0; ix < w; ix++) {
-                int ipxl = (ix + (h - iy - 1) * w) * 3;
-                Color col = fb.getColor(ix, iy);
-                rgb8buf[ipxl + 0] = encodeTo8byte(col.r, exportGamma);
-                rgb8buf[ipxl + 1] = encodeTo8byte(col.g, exportGamma);
-                rgb8buf[ipxl + 2] = encodeTo8byte(col.b, exportGamma);
-            }
+    // sub pixel cells per sample
+    int StratifyCells(const AnimCamera::RenderSetting& rndconf, int* ocols, int* orows) {
+        //+++++ FIXME +++++
+        int sscol = 1;
+        int ssrow = 1;
+        if (rndconf.sampleStrategy == AnimCamera::SampleStrategy::kStratify) {
+            sscol = rndconf.sampleOption.stratify.cols;
+            ssrow = rndconf.sampleOption.stratify.rows;
         }
-
-        int saved = stbi_write_png(savepath.c_str(), w, h, 3, rgb8buf.data(), 0);
-        return saved != 0;
+        //+++++
+        if (ocols != nullptr) {
+            *ocols = sscol;
+        }
+        if (orows != nullptr) {
+            *orows = ssrow;
+        }
+        return sscol * ssrow;
     }
 }
 
 //================
-bool Cel::loadFile(const std::string srcpath, const std::filesystem::path curdir) {
+void Cel::setSource(const std::string srcpath, const std::filesystem::path curdir) {
     std::filesystem::path fpath(srcpath);
     if (fpath.is_relative()) {
         fpath = curdir / fpath;
     }
-
-    std::string pathstr = fpath.u8string();
-
-    int x, y, c;
-    stbi_uc* imgbuf = stbi_load(pathstr.c_str(), &x, &y, &c, 4);
-    if (imgbuf == nullptr) {
-        std::cerr << "stbi_load failed:" << pathstr << std::endl;
-        return false;
-    }
-
-    texptr = std::make_shared<ImageTexture>(x, y);
-    texptr->initWith8BPPImage(imgbuf, c, 2.2);
-    stbi_image_free(imgbuf);
-
-    // TODO
-    texptr->setWrap(ImageTexture::WrapType::kClamp, ImageTexture::WrapType::kClamp);
-
-    return true;
+    path = fpath.u8string();
 }
 
 //================
 //#define PETALS_WORK_SERIAL
 
+AnimationStand::AnimationStand() :
+    limitSec(-1.0),
+    limitMargin(1.0),
+    framebufferStockCount(3),
+    celCacheMB(2048),
+    prefetchFrames(2),
+    sampleScale(1.0),
+    cancelRequested(false),
+    frameCount(0),
+    renderedTileCount(0),
+    finishedFrameCount(0),
+    cancelledFrameCount(0),
+    writtenFrameCount(0),
+    allocatedFrameBuffers(0),
+    maxFrameBuffers(1)
+{
+    celCache = std::make_unique<CelCache>(static_cast<size_t>(celCacheMB) * 1024 * 1024);
+}
+
+AnimationStand::~AnimationStand() {
+}
+
 bool AnimationStand::render() {
     std::random_device rnd_dev;
     std::mt19937 mt(rnd_dev());
 
+    // encode and disk write are on the writer thread. framebuffers bound what waits for it
+    imageWriter = std::make_unique<ImageWriter>();
+    maxFrameBuffers = 1 + std::max(1, framebufferStockCount);
+    celCache->setBudget(static_cast<size_t>(std::max(0, celCacheMB)) * 1024 * 1024);
+    renderStartTime = GetSeconds();
+    // the first frames start with a warm cache, within the budget set above
+    preloadCels(prefetchFrames + 1);
+    cancelRequested = false;
+    sampleScale = 1.0;
+    frameCount = 0;
+    renderedTileCount = 0;
+    finishedFrameCount = 0;
+    cancelledFrameCount = 0;
+    writtenFrameCount = 0;
+
     int currentFrame = 0;
     for (const auto& cutname : sequence) {
         const auto cutptr = cutList[cutname];
@@ -98,7 +119,7 @@ bool AnimationStand::render() {
             renderOneFrame(cntx);
 #else
             // parallel job setup
-            auto& rndrinfo = renderJobQueue.emplace();
+            auto& rndrinfo = renderJobQueue.emplace_back();
             rndrinfo.cutName = cutname;
             rndrinfo.cutFrameIndex = ifrm;
             rndrinfo.serialFrameIndex = currentFrame;
@@ -107,6 +128,7 @@ bool AnimationStand::render() {
             currentFrame += 1;
         }
     }
+    frameCount = currentFrame;
 
 #ifndef PETALS_WORK_SERIAL
     // worker setup
@@ -115,6 +137,15 @@ bool AnimationStand::render() {
         std::cout << "hardware_concurrency: " << hwThreads << std::endl;
         maxThreads = (maxThreads <= 0) ? hwThreads : maxThreads;
         std::cout << "maxThreads: " << maxThreads << std::endl;
+        // a frame open per worker at most, and the stock waiting for the writer
+        maxFrameBuffers = maxThreads + std::max(1, framebufferStockCount);
+    }
+
+    // fit the samples in the time limit before starting
+    const int numframes = currentFrame;
+    std::cout << "time limit:" << limitSec << " [sec], margin:" << limitMargin << " [sec]" << std::endl;
+    if (limitSec > 0.0) {
+        planSampleBudget(mt());
     }
     
     workingCount = maxThreads;
@@ -124,66 +155,229 @@ bool AnimationStand::render() {
         // init context
         auto& cntx = renderCntx[i];
         cntx.rng.setSeed(mt());
-        // thread job
+        // thread job. tiles of all frames
         auto& thrd = workerPool.emplace_back([&] {
-            RenderInfo rndrinfo;
-            while(true) {
-                {
-                    std::lock_guard<std::mutex> lock(renderJobQueueMutex);
-                    if (renderJobQueue.empty()) {
-                        break;
-                    }
-                    rndrinfo = renderJobQueue.front();
-                    renderJobQueue.pop();
+            std::shared_ptr<FrameTask> task;
+            int tileIndex;
+            while (this->nextTileJob(&task, &tileIndex)) {
+                if (this->renderTile(task.get(), tileIndex, cntx.rng)) {
+                    renderedTileCount += 1;
+                } else {
+                    task->cancelledTiles += 1;
                 }
-
-                cntx.cutFrameIndex = rndrinfo.cutFrameIndex;
-                cntx.serialFrameIndex = rndrinfo.serialFrameIndex;
-                cntx.cutptr = this->cutList[rndrinfo.cutName];
-                this->renderOneFrame(cntx);
+                if (task->remainingTiles.fetch_sub(1) == 1) {
+                    this->finishFrame(task.get());
+                }
+                task.reset();
             }
             workingCount -= 1;
         });
     }
 
-    // wait to finish jobs
-    std::cout << "time limit:" << limitSec << " [sec]" << std::endl;
-    // FIXME
-    constexpr int kWaitMilliSec = 1000;
-    constexpr int kLogCount = 5;
-    int loopCount = 0;
+    // wait to finish jobs. workers stop at the next scanline once cancelled.
+    // the margin is left for the image writer to encode and flush the queued frames
+    constexpr int kWaitMilliSec = 100;
+    constexpr double kLogIntervalSec = 5.0;
+    const double deadline = limitSec - limitMargin;
+    double logedTime = renderStartTime;
     while (workingCount > 0) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(kWaitMilliSec));
-        if (loopCount % kLogCount == 0) {
-            std::cout << "working: " << workingCount << std::endl;
+        double curTime = GetSeconds();
+        if (limitSec > 0.0 && !cancelRequested && curTime - renderStartTime >= deadline) {
+            std::cout << "time limit reached. cancel rendering" << std::endl;
+            cancelRequested = true;
         }
-        loopCount += 1;
-        if (limitSec > 0.0) {
-            if (loopCount * kWaitMilliSec / 1000.0 >= limitSec) {
-                break;
-            }
+        if (curTime - logedTime >= kLogIntervalSec) {
+            std::cout << "working: " << workingCount << ", written: " << writtenFrameCount << "/" << numframes << std::endl;
+            logedTime = curTime;
         }
+        std::this_thread::sleep_for(std::chrono::milliseconds(kWaitMilliSec));
     }
     // cleanup
     for (auto& thrd : workerPool) {
         thrd.join();
     }
+    workerPool.clear();
+    // tiles not taken when cancelled never count down, so these frames are reported here
+    for (auto& task : openFrames) {
+        int untaken = task->remainingTiles;
+        if (untaken > 0) {
+            task->cancelledTiles += untaken;
+            finishFrame(task.get());
+        }
+    }
+    openFrames.clear();
+    renderJobQueue.clear();
+
 #endif
 
+    imageWriter->flush();
+    imageWriter.reset();
+
+    if (cancelRequested) {
+        // frames are written, dropped part way, or never started
+        int notstarted = frameCount - finishedFrameCount;
+        std::cout << "cancelled frames: " << cancelledFrameCount << " part way, " << notstarted << " not started, written: " << writtenFrameCount << "/" << frameCount << std::endl;
+    }
+
+    if (!framebufferPool.empty()) {
+        size_t fbbytes = framebufferPool[0]->getBufferBytes();
+        std::cout << "framebuffers allocated: " << allocatedFrameBuffers << " (" << fbbytes * allocatedFrameBuffers / (1024 * 1024) << " MB)" << std::endl;
+    }
+    framebufferPool.clear();
+    allocatedFrameBuffers = 0;
+
+    auto cachestats = celCache->getStats();
+    std::cout << "cel cache: decoded " << cachestats.decoded << ", hits " << cachestats.hits << ", evicted " << cachestats.evicted;
+    std::cout << ", peak " << cachestats.peakBytes / (1024 * 1024) << " MB" << std::endl;
+    celCache->clear();
+
     return true;
 }
 
+AnimationStand::RenderStats AnimationStand::getStats() const {
+    RenderStats stats;
+    stats.frames = frameCount;
+    stats.renderedTiles = renderedTileCount;
+    stats.finishedFrames = finishedFrameCount;
+    stats.cancelledFrames = cancelledFrameCount;
+    stats.writtenFrames = writtenFrameCount;
+    stats.sampleScale = sampleScale;
+    return stats;
+}
+
+bool AnimationStand::nextTileJob(std::shared_ptr<FrameTask>* otask, int* otile) {
+    while (true) {
+        RenderInfo rndrinfo;
+        std::vector<RenderInfo> upcoming;
+        {
+            std::lock_guard<std::mutex> lock(renderJobQueueMutex);
+            if (cancelRequested) {
+                return false;
+            }
+
+            // oldest frame first, so few frames are open at once
+            while (!openFrames.empty()) {
+                auto& front = openFrames.front();
+                if (front->nextTile < front->numTiles) {
+                    *otask = front;
+                    *otile = front->nextTile++;
+                    return true;
+                }
+                openFrames.pop_front();
+            }
+
+            if (renderJobQueue.empty()) {
+                return false;
+            }
+            rndrinfo = renderJobQueue.front();
+            renderJobQueue.pop_front();
+            int numupcoming = std::min(prefetchFrames, static_cast<int>(renderJobQueue.size()));
+            upcoming.assign(renderJobQueue.begin(), renderJobQueue.begin() + numupcoming);
+        }
+
+        // cels of the next frames are decoded while this one renders
+        for (const auto& info : upcoming) {
+            prefetchCels(info);
+        }
+
+        // open a new frame. other workers keep rendering meanwhile
+        auto task = std::make_shared<FrameTask>();
+        task->info = rndrinfo;
+        task->cutptr = cutList[rndrinfo.cutName];
+        if (!setupFrame(task.get())) {
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(renderJobQueueMutex);
+        openFrames.push_back(task);
+        *otask = task;
+        *otile = task->nextTile++;
+        return true;
+    }
+}
+
+void AnimationStand::prefetchCels(const RenderInfo& info) {
+    std::vector<std::string> paths;
+    collectCelPaths(info.cutName, info.cutFrameIndex, &paths);
+    for (const auto& path : paths) {
+        celCache->prefetch(path);
+    }
+}
+
+void AnimationStand::collectCelPaths(const std::string& cutname, int cutFrameIndex, std::vector<std::string>* opaths) const {
+    // same lookup as setupFrame
+    const auto cutite = cutList.find(cutname);
+    if (cutite == cutList.end()) {
+        return;
+    }
+    const auto* cut = cutite->second.get();
+    for (const auto& shot : cut->shots) {
+        for (const auto& pln : shot->stand.planes) {
+            const auto psfnd = cut->planeSetups.find(pln.itemName);
+            if (psfnd == cut->planeSetups.end()) {
+                continue;
+            }
+            for (const auto& pltptr : psfnd->second) {
+                const auto tsfnd = cut->timesheet.find(pltptr->itemName);
+                if (tsfnd == cut->timesheet.end() || tsfnd->second.empty()) {
+                    continue;
+                }
+                const auto& timesheet = tsfnd->second;
+                const auto& celname = (static_cast<int>(timesheet.size()) > cutFrameIndex) ? timesheet[cutFrameIndex] : timesheet.back();
+                const auto bnkfnd = cut->bank.find(celname);
+                if (bnkfnd != cut->bank.end()) {
+                    opaths->push_back(bnkfnd->second->path);
+                }
+            }
+        }
+    }
+}
+
+void AnimationStand::preloadCels(int numframes) {
+    std::vector<std::string> paths;
+    int frame = 0;
+    for (const auto& cutname : sequence) {
+        const auto cutite = cutList.find(cutname);
+        if (cutite == cutList.end()) {
+            continue;
+        }
+        for (int ifrm = 0; ifrm < cutite->second->lastFrame && frame < numframes; ifrm++, frame++) {
+            collectCelPaths(cutname, ifrm, &paths);
+        }
+        if (frame >= numframes) {
+            break;
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+
+    // failures stay in the cache and are reported by the frames that need them
+    JobSystem::shared().parallelFor(static_cast<int>(paths.size()), [&](int i) {
+        celCache->acquire(paths[i]);
+    });
+}
+
 bool AnimationStand::renderOneFrame(RenderContexts& cntx) {
-    // current cut
-    const auto* cut = cntx.cutptr.get();
+    FrameTask task;
+    task.info.cutName = cntx.cutptr->name;
+    task.info.cutFrameIndex = cntx.cutFrameIndex;
+    task.info.serialFrameIndex = cntx.serialFrameIndex;
+    task.cutptr = cntx.cutptr;
+    if (!setupFrame(&task)) {
+        return false;
+    }
 
-    // prepare framebuffer
-    FrameBuffer framebuffer(outconf.width, outconf.height, 4096);
-    framebuffer.clear();
-    int fbw = framebuffer.getWidth();
-    int fbh = framebuffer.getHeight();
+    for (int i = 0; i < task.numTiles; i++) {
+        renderedTileCount += renderTile(&task, i, cntx.rng) ? 1 : 0;
+    }
+    finishFrame(&task);
+    return true;
+}
 
-    FrameBuffer tmpfb(outconf.width, outconf.height, 4096);
+bool AnimationStand::setupFrame(FrameTask* task) {
+    // current cut
+    const auto* cut = task->cutptr.get();
+    const int cutFrameIndex = task->info.cutFrameIndex;
 
     RTFloat aspect = static_cast<RTFloat>(outconf.height) / outconf.width;
     Camera camera;
@@ -193,12 +387,19 @@ bool AnimationStand::renderOneFrame(RenderContexts& cntx) {
     camera.focusPlaneHeight = outconf.frameHeight;
     camera.initWithType(Camera::CameraType::kFocusPlanePerspectiveCamera);
 
-    StandLayout standLayout;
-
     size_t numshots = cut->shots.size();
+    task->shots.clear();
+    task->shots.reserve(numshots);
     for (size_t ishot = 0; ishot < numshots; ishot++) {
         // current shot
         const auto* shot = cut->shots[ishot].get();
+        auto& setup = task->shots.emplace_back();
+        setup.shot = shot;
+        setup.sampleCount = shot->camera.render.sampleCount;
+        if (sampleScale < 1.0) {
+            // budgeted. at least one sample per sub pixel cell
+            setup.sampleCount = std::max(1, static_cast<int>(setup.sampleCount * sampleScale));
+        }
 
         RTFloat baseDistance = shot->camera.height;
 
@@ -222,10 +423,12 @@ bool AnimationStand::renderOneFrame(RenderContexts& cntx) {
                 }
             }
             camera.focusDistance += shotcam.focusShift;
+            setup.camera = camera;
         }
 
         // stand layout
         {
+            auto& standLayout = setup.layout;
             standLayout.planes.clear();
 
             const auto& stand = shot->stand;
@@ -259,11 +462,11 @@ bool AnimationStand::renderOneFrame(RenderContexts& cntx) {
                     }
 
                     const auto& timesheet = tsfnd->second;
-                    const auto& celname = (timesheet.size() > cntx.cutFrameIndex) ? timesheet[cntx.cutFrameIndex] : timesheet.back();
+                    const auto& celname = (static_cast<int>(timesheet.size()) > cutFrameIndex) ? timesheet[cutFrameIndex] : timesheet.back();
 
                     const auto bnkfnd = cut->bank.find(celname);
                     if (bnkfnd == cut->bank.end()) {
-                        std::cerr << "timesheet item[" << cntx.cutFrameIndex << "] not found:" << celname << std::endl;
+                        std::cerr << "timesheet item[" << cutFrameIndex << "] not found:" << celname << std::endl;
                         return false;
                     }
 
@@ -274,117 +477,150 @@ bool AnimationStand::renderOneFrame(RenderContexts& cntx) {
                     plateRemain -= 1.0;
                 }
             }
+
+            setup.kernelPlanes.clear();
+            setup.celImages.clear();
+            for (const auto& lypln : standLayout.planes) {
+                const auto* celobj = lypln.celptr.get();
+                auto image = celCache->acquire(celobj->path);
+                if (image == nullptr) {
+                    std::cerr << "cel image decode failed:" << celobj->path << std::endl;
+                    return false;
+                }
+                auto& kpln = setup.kernelPlanes.emplace_back();
+                kpln.texels = &image->texels;
+                kpln.z = static_cast<float>(lypln.offset.z);
+                kpln.invWidth = static_cast<float>(1.0 / (celobj->width * 0.001));
+                kpln.invHeight = static_cast<float>(1.0 / (celobj->height * 0.001));
+                setup.celImages.push_back(std::move(image));
+            }
         }
 
-        // render shot
-        {
-            auto& rng = cntx.rng;
-            const auto& shotcam = shot->camera;
-            const auto& rndconf = shotcam.render;
-            tmpfb.clear();
+        // lights
+        setup.topLitColor.set(0.0, 0.0, 0.0);
+        if (shot->stand.toplight.enable) {
+            setup.topLitColor = shot->stand.toplight.color * shot->stand.toplight.power;
+        }
 
-            RGBColor topLitColor(0.0, 0.0, 0.0);
-            if (shot->stand.toplight.enable) {
-                topLitColor = shot->stand.toplight.color * shot->stand.toplight.power;
-            }
+        setup.backLitColor.set(0.0, 0.0, 0.0);
+        if (shot->stand.backlight.enable) {
+            setup.backLitColor = shot->stand.backlight.color * shot->stand.backlight.power;
+        }
+    } // shot
 
-            RGBColor backLitColor(0.0, 0.0, 0.0);
-            if (shot->stand.backlight.enable) {
-                backLitColor = shot->stand.backlight.color * shot->stand.backlight.power;
+    // prepare framebuffer
+    task->framebuffer = acquireFrameBuffer();
+    task->numTiles = task->framebuffer->getNumTiles();
+    task->nextTile = 0;
+    task->remainingTiles = task->numTiles;
+    task->cancelledTiles = 0;
+
+    return true;
+}
+
+bool AnimationStand::renderTile(FrameTask* task, int tileIndex, Random& rng) {
+    auto& framebuffer = *task->framebuffer;
+    const auto& tile = framebuffer.getTile(tileIndex);
+    int fbw = framebuffer.getWidth();
+    int fbh = framebuffer.getHeight();
+
+    for (auto& setup : task->shots) {
+        const auto* shot = setup.shot;
+        const auto& shotcam = shot->camera;
+        const auto& rndconf = shotcam.render;
+        auto& camera = setup.camera;
+
+        int sscol, ssrow;
+        int numsamples = std::max(1, setup.sampleCount * StratifyCells(rndconf, &sscol, &ssrow));
+
+        const auto* kplanes = setup.kernelPlanes.data();
+        int numkplanes = static_cast<int>(setup.kernelPlanes.size());
+        RTFloat scale = shotcam.exposure / numsamples;
+
+        // rays of a scanline go through the kernel in batches, samples of a pixel can span two
+        CelStackKernel::RayBatch batch;
+        CelStackKernel::Result result;
+        int batchPixel[CelStackKernel::kBatchSize];
+        std::vector<RGBColor> rowcolor(tile.endx - tile.startx);
+        auto flushBatch = [&]() {
+            CelStackKernel::composite(kplanes, numkplanes, batch, &result);
+            for (int i = 0; i < batch.count; i++) {
+                RGBColor tmpcolor(result.r[i], result.g[i], result.b[i]);
+                tmpcolor = RGBColor::mul(setup.topLitColor, tmpcolor) + setup.backLitColor * result.alpha[i];
+                rowcolor[batchPixel[i]] += tmpcolor;
             }
+            batch.count = 0;
+        };
 
-            for (int iy = 0; iy < fbh; iy++) {
-                for (int ix = 0; ix < fbw; ix++) {
-                    //RTFloat tx = static_cast<RTFloat>(ix) / fbw;
-                    //RTFloat ty = static_cast<RTFloat>(iy) / fbh;
-
-                    //+++++ FIXME +++++
-                    int sscol = 1;
-                    int ssrow = 1;
-                    if (rndconf.sampleStrategy == AnimCamera::SampleStrategy::kStratify) {
-                        sscol = rndconf.sampleOption.stratify.cols;
-                        ssrow = rndconf.sampleOption.stratify.rows;
-                    }
-                    //+++++
-
-                    for(int isp = 0; isp < rndconf.sampleCount; isp++) {
-                        for (int ssy = 0; ssy < ssrow; ssy++) {
-                            for (int ssx = 0; ssx < sscol; ssx++) {
-                                RTFloat stx = (ssx + rng.nextDoubleCO()) / sscol;
-                                RTFloat sty = (ssy + rng.nextDoubleCO()) / ssrow;
-
-                                // image origin is left top, world y up is positive
-                                RTFloat sx = (ix + stx) / fbw * 2.0 - 1.0;
-                                RTFloat sy = (iy + sty) / fbh * -2.0 + 1.0;
-
-                                // camera is (0,0,0)
-                                Ray ray = camera.getRay(sx, sy, &rng);
-
-                                // TODO
-                                // filter
-                                //for(const auto& fltr : shotcam.filters)
-                                //{
-                                //    switch (fltr.type) {
-                                //        case AnimCamera::FilterType::kSoft:
-                                //            break;
-                                //        case AnimCamera::FilterType::kCross:
-                                //            break;
-                                //        default:
-                                //    }
-                                //}
-
-                                RGBColor tmpcolor(0.0, 0.0, 0.0);
-                                RTFloat alpha = 1.0;
-                                for (const auto& lypln : standLayout.planes) {
-                                    RTFloat t = lypln.offset.z / ray.direction.z;
-                                    Vector3 hit = ray.direction * t + ray.origin;
-                                    const auto* celobj = lypln.celptr.get();
-
-                                    RTFloat u = hit.x / (celobj->width * 0.001) + 0.5;
-                                    RTFloat v = hit.y / (celobj->height * 0.001) + 0.5;
-
-                                    const auto* celtex = celobj->texptr.get();
-                                    auto texel = celtex->sample(u, v, true);
-                                    tmpcolor = tmpcolor + texel.rgb * texel.a * alpha;
-                                    alpha *= 1.0 - texel.a;
-                                    if (alpha <= 0.0) break;
-                                }
-
-                                tmpcolor = RGBColor::mul(topLitColor, tmpcolor) + backLitColor * alpha;
-                                tmpfb.accumulate(ix, iy, tmpcolor);
-                            }
-                        } // ss
-                    } // sampleCount
-                }
-            } // iy
-        } //
+        for (int iy = tile.starty; iy < tile.endy; iy++) {
+            if (cancelRequested.load(std::memory_order_relaxed)) {
+                return false;
+            }
+            std::fill(rowcolor.begin(), rowcolor.end(), RGBColor(0.0, 0.0, 0.0));
 
-        // 
-        for (int iy = 0; iy < fbh; iy++) {
-            for (int ix = 0; ix < fbw; ix++) {
+            for (int ix = tile.startx; ix < tile.endx; ix++) {
                 // rendered image is 180 deg rotated
-                auto tmpcolor = tmpfb.getColor(fbw - ix - 1, fbh - iy - 1);
-                auto& pixel = framebuffer.getPixel(ix, iy);
-                pixel.accumulatedColor += tmpcolor * shot->camera.exposure;
-                pixel.sampleCount = 1;
+                int rx = fbw - ix - 1;
+                int ry = fbh - iy - 1;
+
+                for(int isp = 0; isp < setup.sampleCount; isp++) {
+                    for (int ssy = 0; ssy < ssrow; ssy++) {
+                        for (int ssx = 0; ssx < sscol; ssx++) {
+                            RTFloat stx = (ssx + rng.nextDoubleCO()) / sscol;
+                            RTFloat sty = (ssy + rng.nextDoubleCO()) / ssrow;
+
+                            // image origin is left top, world y up is positive
+                            RTFloat sx = (rx + stx) / fbw * 2.0 - 1.0;
+                            RTFloat sy = (ry + sty) / fbh * -2.0 + 1.0;
+
+                            // camera is (0,0,0)
+                            Ray ray = camera.getRay(sx, sy, &rng);
+
+                            // TODO
+                            // filter
+                            //for(const auto& fltr : shotcam.filters)
+                            //{
+                            //    switch (fltr.type) {
+                            //        case AnimCamera::FilterType::kSoft:
+                            //            break;
+                            //        case AnimCamera::FilterType::kCross:
+                            //            break;
+                            //        default:
+                            //    }
+                            //}
+
+                            batchPixel[batch.count] = ix - tile.startx;
+                            batch.set(batch.count, ray);
+                            batch.count += 1;
+                            if (batch.count == CelStackKernel::kBatchSize) {
+                                flushBatch();
+                            }
+                        }
+                    } // ss
+                } // sampleCount
+            }
+            if (batch.count > 0) {
+                flushBatch();
             }
-        }
-
-        ////+++++
-        //{
-        //    const auto* cel = cut->bank.at("1").get();
-        //    for (int iy = 0; iy < fbh; iy++) {
-        //        for (int ix = 0; ix < fbw; ix++) {
-        //            RTFloat tx = static_cast<RTFloat>(ix) / fbw;
-        //            RTFloat ty = static_cast<RTFloat>(iy) / fbh;
-        //            auto tmpcolor = cel->texptr->sample(tx, ty, true);
-        //            framebuffer.setColor(ix, iy, tmpcolor.rgb);
-        //        }
-        //    }
-        //}
-        ////+++++
 
+            for (int ix = tile.startx; ix < tile.endx; ix++) {
+                framebuffer.accumulate(ix, iy, rowcolor[ix - tile.startx] * scale);
+            }
+        } // iy
     } // shot
+    return true;
+}
+
+void AnimationStand::finishFrame(FrameTask* task) {
+    finishedFrameCount += 1;
+    if (task->cancelledTiles > 0) {
+        // partial frames are not written
+        int donetiles = task->numTiles - task->cancelledTiles;
+        std::cout << "frame " << task->info.serialFrameIndex << " cancelled: " << donetiles << "/" << task->numTiles << " tiles" << std::endl;
+        cancelledFrameCount += 1;
+        releaseFrameBuffer(std::move(task->framebuffer));
+        return;
+    }
 
     // save frame
     std::stringstream ss;
@@ -395,12 +631,104 @@ bool AnimationStand::renderOneFrame(RenderContexts& cntx) {
         ss << outconf.baseName;
     }
     ss << std::setfill('0') << std::right << std::setw(3);
-    ss << cntx.serialFrameIndex << ".png";
+    ss << task->info.serialFrameIndex << ".png";
 
     const auto savepath = ss.str();
-    bool saveres = writeFrameBufferToFile(framebuffer, savepath);
+    ImageWriter::Request req;
+    req.path = savepath;
+    // encoded on the writer thread. a later frame can use the buffer after that
+    CompactFrameBuffer* framebuffer = task->framebuffer.release();
+    req.encode = [this, framebuffer](ImageWriter::Request* oreq) {
+        ImageWriter::encodeRGB8(*framebuffer, 2.2, oreq);
+        releaseFrameBuffer(std::unique_ptr<CompactFrameBuffer>(framebuffer));
+    };
+    req.onFinished = [this, savepath](bool saved) {
+        std::cout << savepath << " saved: " << saved << std::endl;
+        writtenFrameCount += saved ? 1 : 0;
+    };
+    imageWriter->submit(std::move(req));
+}
 
-    std::cout << savepath << " saved: " << saveres << std::endl;
+std::unique_ptr<CompactFrameBuffer> AnimationStand::acquireFrameBuffer() {
+    std::unique_ptr<CompactFrameBuffer> fb;
+    {
+        std::unique_lock<std::mutex> lock(framebufferPoolMutex);
+        framebufferPoolCondition.wait(lock, [this]{ return !framebufferPool.empty() || allocatedFrameBuffers < maxFrameBuffers; });
+        if (!framebufferPool.empty()) {
+            fb = std::move(framebufferPool.back());
+            framebufferPool.pop_back();
+        } else {
+            allocatedFrameBuffers += 1;
+        }
+    }
+
+    if (fb == nullptr || fb->getWidth() != outconf.width || fb->getHeight() != outconf.height) {
+        // constructed cleared
+        return std::make_unique<CompactFrameBuffer>(outconf.width, outconf.height, kTileSize);
+    }
+    fb->clear();
+    return fb;
+}
+
+void AnimationStand::releaseFrameBuffer(std::unique_ptr<CompactFrameBuffer> fb) {
+    {
+        std::lock_guard<std::mutex> lock(framebufferPoolMutex);
+        framebufferPool.push_back(std::move(fb));
+    }
+    framebufferPoolCondition.notify_one();
+}
+
+void AnimationStand::planSampleBudget(unsigned long seed) {
+    // timing probe. a few tiles of the first frame of each cut at one sample
+    Random rng;
+    rng.setSeed(seed);
+    double totalcost = 0.0; // [thread sec] of all frames at full samples
+    for (const auto& cutname : sequence) {
+        const auto cutptr = cutList[cutname];
+        FrameTask probe;
+        probe.info.cutName = cutname;
+        probe.info.cutFrameIndex = 0;
+        probe.info.serialFrameIndex = -1;
+        probe.cutptr = cutptr;
+        if (!setupFrame(&probe)) {
+            continue;
+        }
+
+        // per pixel sample evaluations
+        double fullsamples = 0.0;
+        double probesamples = 0.0;
+        for (auto& setup : probe.shots) {
+            int cells = StratifyCells(setup.shot->camera.render, nullptr, nullptr);
+            fullsamples += setup.sampleCount * cells;
+            probesamples += cells;
+            setup.sampleCount = 1;
+        }
+
+        // a few tiles take milliseconds. they are repeated so the timer noise does not decide the scale
+        int stride = std::max(1, probe.numTiles / kProbeTiles);
+        long probepixels = 0;
+        double starttime = GetSeconds();
+        double probetime = 0.0;
+        for (int round = 0; round < kProbeMaxRounds && probetime < kProbeMinSec; round++) {
+            for (int i = stride / 2; i < probe.numTiles; i += stride) {
+                renderTile(&probe, i, rng);
+                const auto& tile = probe.framebuffer->getTile(i);
+                probepixels += tile.width * tile.height;
+            }
+            probetime = GetSeconds() - starttime;
+        }
+        releaseFrameBuffer(std::move(probe.framebuffer));
+
+        if (probepixels > 0 && probesamples > 0.0) {
+            double secpersample = probetime / (probepixels * probesamples);
+            totalcost += secpersample * outconf.width * outconf.height * fullsamples * cutptr->lastFrame;
+        }
+    }
 
-    return saveres;
+    double remaining = limitSec - limitMargin - (GetSeconds() - renderStartTime);
+    // threads beyond the cores do not add time
+    int hwThreads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    double budget = std::max(0.0, remaining) * std::min(maxThreads, hwThreads) * kBudgetUtilization;
+    sampleScale = (totalcost > budget) ? budget / totalcost : 1.0;
+    std::cout << "sample budget. estimated:" << totalcost << ", budget:" << budget << " [thread sec], sample scale:" << sampleScale << std::endl;
 }
@@ -8,14 +8,20 @@
 #include <filesystem>
 #include <thread>
 #include <mutex>
-#include <queue>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
 
 #include "types.h"
 #include "random.h"
+#include "camera.h"
+#include "celcache.h"
 
 namespace Petals {
 
     class ImageTexture;
+    class ImageWriter;
+    class CompactFrameBuffer;
 
     //
     class AnimCamera {
@@ -128,10 +134,11 @@ namespace Petals {
         Cel(const std::string& nm) : name(nm), width(254.0), height(142.875) {};
         ~Cel() {}
 
-        bool loadFile(const std::string srcpath, const std::filesystem::path curdir);
+        // resolves the path. SceneLoader checks the image, CelCache decodes it on first use
+        void setSource(const std::string srcpath, const std::filesystem::path curdir);
 
         std::string name;
-        std::shared_ptr<ImageTexture> texptr;
+        std::string path; // resolved
         RTFloat width;  // [mm]
         RTFloat height; // [mm]
     };
@@ -193,10 +200,21 @@ namespace Petals {
         };
 
     public:
-        AnimationStand() {};
-        ~AnimationStand() {};
+        AnimationStand();
+        ~AnimationStand();
+
+        // counts of the last render
+        struct RenderStats {
+            int frames; // in the sequence
+            int renderedTiles; // complete, not cancelled
+            int finishedFrames;
+            int cancelledFrames; // finished part way by the time limit, not written
+            int writtenFrames;
+            RTFloat sampleScale; // below 1 when samples were cut to fit the time limit
+        };
 
         bool render();
+        RenderStats getStats() const;
 
 
     public:
@@ -208,6 +226,10 @@ namespace Petals {
 
         int maxThreads;
         RTFloat limitSec;
+        RTFloat limitMargin; // [sec] left for the image writer to flush
+        int framebufferStockCount; // frames waiting for the image writer
+        int celCacheMB; // decoded cels kept for later frames
+        int prefetchFrames; // queued frames whose cels are decoded ahead
 
     private:
         struct RenderContexts {
@@ -216,6 +238,7 @@ namespace Petals {
             int cutFrameIndex;
             int serialFrameIndex;
         };
+        // serial. all tiles of one frame
         bool renderOneFrame(RenderContexts& cntx);
 
         struct RenderInfo {
@@ -223,12 +246,73 @@ namespace Petals {
             int cutFrameIndex;
             int serialFrameIndex;
         };
+
+        // camera and cel layout of a shot. shared by the tiles of a frame
+        struct ShotSetup {
+            const Shot* shot;
+            int sampleCount; // scaled by the sample budget
+            Camera camera;
+            StandLayout layout;
+            std::vector<CelStackKernel::Plane> kernelPlanes; // layout planes, front first
+            std::vector<std::shared_ptr<const CelImage> > celImages; // held until the frame is done
+            RGBColor topLitColor;
+            RGBColor backLitColor;
+        };
+
+        // frame in flight. workers take its tiles, the last one saves it
+        struct FrameTask {
+            RenderInfo info;
+            std::shared_ptr<Cut> cutptr;
+            std::vector<ShotSetup> shots;
+            std::unique_ptr<CompactFrameBuffer> framebuffer;
+            int numTiles;
+            int nextTile; // guarded by renderJobQueueMutex
+            std::atomic<int> remainingTiles;
+            std::atomic<int> cancelledTiles;
+        };
+        bool setupFrame(FrameTask* task);
+        // false when cancelled before the tile is complete
+        bool renderTile(FrameTask* task, int tileIndex, Random& rng);
+        void finishFrame(FrameTask* task);
+        // next tile of the open frames, or of a newly opened frame. false when all are taken
+        bool nextTileJob(std::shared_ptr<FrameTask>* otask, int* otile);
+        void prefetchCels(const RenderInfo& info);
+        // decodes the cels of the first frames of the sequence on the shared job system
+        void preloadCels(int numframes);
+        // cel image paths a frame samples. missing items are skipped, setupFrame reports them
+        void collectCelPaths(const std::string& cutname, int cutFrameIndex, std::vector<std::string>* opaths) const;
+
         std::vector<std::thread> workerPool;
-        std::queue<RenderInfo> renderJobQueue;
+        std::deque<RenderInfo> renderJobQueue;
+        std::deque<std::shared_ptr<FrameTask> > openFrames; // oldest first
         std::mutex renderJobQueueMutex;
+
+        // time limit. samples are scaled up front to fit it, cancel stops what is left
+        void planSampleBudget(unsigned long seed);
+        double renderStartTime;
+        RTFloat sampleScale;
+        std::atomic<bool> cancelRequested;
+
+        int frameCount;
+        std::atomic<int> renderedTileCount;
+        std::atomic<int> finishedFrameCount;
+        std::atomic<int> cancelledFrameCount;
+        std::atomic<int> writtenFrameCount;
+
+        // framebuffers of finished frames are reused once the writer has encoded them.
+        // opening a frame waits here when maxFrameBuffers are rendering or waiting for the writer
+        std::unique_ptr<CompactFrameBuffer> acquireFrameBuffer();
+        void releaseFrameBuffer(std::unique_ptr<CompactFrameBuffer> fb);
+        std::vector<std::unique_ptr<CompactFrameBuffer> > framebufferPool;
+        int allocatedFrameBuffers;
+        int maxFrameBuffers;
+        std::mutex framebufferPoolMutex;
+        std::condition_variable framebufferPoolCondition;
         std::atomic<int> workingCount;
 
         std::vector<RenderContexts> renderCntx;
+        std::unique_ptr<ImageWriter> imageWriter;
+        std::unique_ptr<CelCache> celCache;
     };
 
 }
@@ -1,19 +1,69 @@
+#include <iostream>
+#include <algorithm>
+#include <limits>
+#include <cmath>
 #include "bvh.h"
+#include "jobsystem.h"
 
 using namespace Petals;
 
+namespace {
+    constexpr int kMaxSAHBins = 64;
+    constexpr int kMinParallelChunk = 1024; // primitives per binning job
+
+    struct SAHBin {
+        AABB bounds;
+        int count;
+    };
+
+    // round outward when bounds are stored in lower precision
+    RTGeomFloat RoundDown(RTFloat v) {
+        RTGeomFloat g = static_cast<RTGeomFloat>(v);
+        return (g > v) ? std::nextafter(g, -std::numeric_limits<RTGeomFloat>::infinity()) : g;
+    }
+
+    RTGeomFloat RoundUp(RTFloat v) {
+        RTGeomFloat g = static_cast<RTGeomFloat>(v);
+        return (g < v) ? std::nextafter(g, std::numeric_limits<RTGeomFloat>::infinity()) : g;
+    }
+}
+
+/////
+BVH::BuildType BVH::BuildOption::parseBuildType(const std::string& name) {
+    if (name.compare("median") == 0) {
+        return BuildType::kMedian;
+    }
+    return BuildType::kSAH;
+}
+
+/////
+void BVH::Statistics::print(const std::string& label) const {
+    std::cout << "BVH [" << label << "]";
+    std::cout << " prims:" << primitiveCount << ", inner:" << innerCount << ", leaves:" << leafCount;
+    std::cout << ", depth max:" << maxDepth << " avg:" << averageLeafDepth;
+    std::cout << ", leaf size max:" << maxLeafSize << " avg:" << averageLeafSize;
+    std::cout << ", SAH cost:" << sahCost;
+    std::cout << ", wide nodes:" << wideNodeCount << " (" << memoryBytes / 1024 << " KB)" << std::endl;
+}
+
 /////
-void BVH::TreeNode::reset(const AABB* bnd) {
+void BVH::TreeNode::reset(const AABB* bnd, const AABB* slicebnd) {
     source = bnd;
+    sliceSource = slicebnd;
     bounds.clear();
     leftNode = nullptr;
     rightNode = nullptr;
+    primStart = 0;
+    primCount = 0;
 }
 
 /////
 BVH::BVH():
     rootNode(nullptr),
-    usedNodeCount(0)
+    usedNodeCount(0),
+    buildJobs(nullptr),
+    builtSAHCost(0.0),
+    motionSliceCount(1)
 {
 }
 
@@ -27,6 +77,12 @@ BVH::BVH(int capacity):
     }
 }
 
+BVH::BVH(int capacity, const BuildOption& opt):
+    BVH(capacity)
+{
+    buildOption = opt;
+}
+
 BVH::~BVH()
 {
 }
@@ -35,10 +91,17 @@ BVH::~BVH()
 void BVH::clear() {
     leafNodes.clear();
     usedNodeCount = 0;
+    rootNode = nullptr;
+    wideNodes.clear();
+    wideSlotNodes.clear();
+    linearPrimitives.clear();
+    motionBounds.clear();
+    linearSliceBounds.clear();
 }
 
-void BVH::appendLeaf(const AABB* bnd) {
+void BVH::appendLeaf(const AABB* bnd, const AABB* slicebnds) {
     auto node = allocateTreeNode(bnd);
+    node->sliceSource = slicebnds;
     node->bounds = *bnd;
     leafNodes.push_back(node);
 }
@@ -46,7 +109,7 @@ void BVH::appendLeaf(const AABB* bnd) {
 void BVH::updateAllLeafBounds() {
     for(auto ite = leafNodes.begin(); ite != leafNodes.end(); ++ite) {
         auto* node = *ite;
-        node->reset(node->source);
+        node->reset(node->source, node->sliceSource);
         node->bounds = *node->source;
     }
 }
@@ -54,27 +117,117 @@ void BVH::updateAllLeafBounds() {
 void BVH::build()
 {
     usedNodeCount = leafNodes.size();
-    rootNode = buildTree(leafNodes.data(), static_cast<int>(leafNodes.size()), 0);
+    if (leafNodes.empty()) {
+        rootNode = nullptr;
+        wideNodes.clear();
+        wideSlotNodes.clear();
+        linearPrimitives.clear();
+        motionBounds.clear();
+        linearSliceBounds.clear();
+        return;
+    }
+
+    // parallel build takes nodes from preallocated pool.
+    // inner nodes < N, multi primitive leaves <= N / 2
+    const size_t numleaves = leafNodes.size();
+    if (buildOption.parallelThreshold > 0 && numleaves > static_cast<size_t>(buildOption.parallelThreshold)) {
+        JobSystem& jobs = (buildOption.jobSystem != nullptr) ? *buildOption.jobSystem : JobSystem::shared();
+        if (jobs.workerCount() > 0) {
+            size_t required = numleaves * 2 + numleaves / 2;
+            nodePool.reserve(required);
+            while (nodePool.size() < required) {
+                nodePool.push_back(std::unique_ptr<TreeNode>(new TreeNode(nullptr)));
+            }
+            buildJobs = &jobs;
+        }
+    }
+
+    switch (buildOption.type) {
+        case BuildType::kMedian:
+            rootNode = buildTree(leafNodes.data(), static_cast<int>(leafNodes.size()), 0);
+            break;
+        case BuildType::kSAH:
+        default:
+            rootNode = buildTreeSAH(leafNodes.data(), static_cast<int>(leafNodes.size()), 0);
+            break;
+    }
+
+    flattenTree();
+    buildJobs = nullptr;
+    updateMotionBounds();
+
+    RTFloat rootarea = rootNode->bounds.surfaceArea();
+    builtSAHCost = (rootarea > 0.0) ? nodeSAHCost(rootNode) / rootarea : 0.0;
+}
+
+RTFloat BVH::refit() {
+    if (rootNode == nullptr) {
+        return 1.0;
+    }
+
+    RTFloat cost = refitNode(rootNode);
+    for (size_t i = 0; i < wideSlotNodes.size(); i++) {
+        const TreeNode* node = wideSlotNodes[i];
+        if (node != nullptr) {
+            setWideChildBounds(&wideNodes[i / kWideNodeWidth], static_cast<int>(i % kWideNodeWidth), node->bounds);
+        }
+    }
+    updateMotionBounds();
+
+    RTFloat rootarea = rootNode->bounds.surfaceArea();
+    cost = (rootarea > 0.0) ? cost / rootarea : 0.0;
+    return (builtSAHCost > 0.0) ? cost / builtSAHCost : 1.0;
+}
+
+bool BVH::update() {
+    if (rootNode != nullptr && buildOption.refitThreshold > 0.0) {
+        RTFloat growth = refit();
+        if (growth <= buildOption.refitThreshold) {
+            return false;
+        }
+    }
+
+    updateAllLeafBounds();
+    build();
+    return true;
 }
 
 BVH::TreeNode* BVH::allocateTreeNode(const AABB* bnd) {
     TreeNode* node;
-    if (usedNodeCount < nodePool.size()) {
-        node = nodePool[usedNodeCount].get();
-        node->reset(bnd);
+    size_t index = usedNodeCount.fetch_add(1);
+    if (index < nodePool.size()) {
+        node = nodePool[index].get();
+        node->reset(bnd, nullptr);
     } else {
+        // serial build only. parallel build reserves the pool beforehand
         node = new TreeNode(bnd);
         nodePool.push_back(std::unique_ptr<TreeNode>(node));
     }
-    usedNodeCount += 1;
     return node;
 }
 
+BVH::TreeNode* BVH::makeLeaf(TreeNode** childnodes, int numchild) {
+    int start = static_cast<int>(childnodes - leafNodes.data());
+    TreeNode* leaf;
+    if (numchild == 1) {
+        // primitive itself
+        leaf = childnodes[0];
+    } else {
+        leaf = allocateTreeNode(nullptr);
+        for (int i = 0; i < numchild; i++) {
+            leaf->bounds.expand(childnodes[i]->bounds);
+        }
+    }
+    leaf->primStart = start;
+    leaf->primCount = numchild;
+    return leaf;
+}
+
 BVH::TreeNode* BVH::buildTree(TreeNode** childnodes, int numchild, int depth)
 {
     if(numchild < 2) {
         // leaf
-        return childnodes[0];
+        return makeLeaf(childnodes, numchild);
     } else {
         auto curnode = allocateTreeNode(nullptr);
         
@@ -98,48 +251,421 @@ BVH::TreeNode* BVH::buildTree(TreeNode** childnodes, int numchild, int depth)
         int numleft = numchild / 2;
         int numright = numchild - numleft;
 
-        curnode->leftNode = buildTree(childnodes, numleft, depth + 1);
-        curnode->rightNode = buildTree(childnodes + numleft, numright, depth + 1);
+        if (buildJobs != nullptr && numchild > buildOption.parallelThreshold) {
+            JobSystem::TaskGroup group;
+            buildJobs->submit(&group, [=]() {
+                curnode->leftNode = buildTree(childnodes, numleft, depth + 1);
+            });
+            curnode->rightNode = buildTree(childnodes + numleft, numright, depth + 1);
+            buildJobs->wait(&group);
+        } else {
+            curnode->leftNode = buildTree(childnodes, numleft, depth + 1);
+            curnode->rightNode = buildTree(childnodes + numleft, numright, depth + 1);
+        }
 
         return curnode;
     }
 }
 
+BVH::TreeNode* BVH::buildTreeSAH(TreeNode** childnodes, int numchild, int depth)
+{
+    if (numchild < 2) {
+        return makeLeaf(childnodes, numchild);
+    }
+
+    // large nodes are bounded and binned by chunks in parallel
+    const bool isparallel = (buildJobs != nullptr && numchild > buildOption.parallelThreshold);
+    const int numchunks = isparallel ? std::max(1, std::min(buildJobs->workerCount() + 1, numchild / kMinParallelChunk)) : 1;
+    auto chunkrange = [numchild, numchunks](int ichunk, int* obegin, int* oend) {
+        *obegin = static_cast<int>(static_cast<long long>(numchild) * ichunk / numchunks);
+        *oend = static_cast<int>(static_cast<long long>(numchild) * (ichunk + 1) / numchunks);
+    };
+
+    AABB nodebnd;
+    AABB centbnd;
+    if (numchunks > 1) {
+        std::vector<AABB> chunkbnds(numchunks * 2);
+        buildJobs->parallelFor(numchunks, [&](int ichunk) {
+            int begin, end;
+            chunkrange(ichunk, &begin, &end);
+            for (int i = begin; i < end; i++) {
+                chunkbnds[ichunk * 2].expand(childnodes[i]->bounds);
+                chunkbnds[ichunk * 2 + 1].expand(childnodes[i]->bounds.centroid());
+            }
+        });
+        for (int ichunk = 0; ichunk < numchunks; ichunk++) {
+            nodebnd.expand(chunkbnds[ichunk * 2]);
+            centbnd.expand(chunkbnds[ichunk * 2 + 1]);
+        }
+    } else {
+        for (int i = 0; i < numchild; i++) {
+            nodebnd.expand(childnodes[i]->bounds);
+            centbnd.expand(childnodes[i]->bounds.centroid());
+        }
+    }
+
+    const int numbins = std::max(2, std::min(buildOption.binCount, kMaxSAHBins));
+    const int maxleaf = std::max(1, buildOption.maxLeafSize);
+    const RTFloat nodearea = nodebnd.surfaceArea();
+    const RTFloat invarea = (nodearea > 0.0) ? 1.0 / nodearea : 0.0;
+    const Vector3 centsize = centbnd.size();
+
+    SAHBin bins[kMaxSAHBins];
+    RTFloat rightcost[kMaxSAHBins];
+
+    int bestaxis = -1;
+    int bestbin = -1;
+    RTFloat bestcost = std::numeric_limits<RTFloat>::max();
+
+    auto binprims = [&](int axis, int begin, int end, SAHBin* obins) {
+        for (int ib = 0; ib < numbins; ib++) {
+            obins[ib].bounds.clear();
+            obins[ib].count = 0;
+        }
+
+        const RTFloat scale = numbins / centsize.v[axis];
+        for (int i = begin; i < end; i++) {
+            const AABB& cb = childnodes[i]->bounds;
+            int ib = static_cast<int>((cb.centroid().v[axis] - centbnd.min.v[axis]) * scale);
+            ib = std::min(ib, numbins - 1);
+            obins[ib].bounds.expand(cb);
+            obins[ib].count += 1;
+        }
+    };
+
+    // chunk bins of all axes. [chunk][axis][bin]
+    std::vector<SAHBin> chunkbins;
+    if (numchunks > 1) {
+        chunkbins.resize(numchunks * 3 * numbins);
+        buildJobs->parallelFor(numchunks, [&](int ichunk) {
+            int begin, end;
+            chunkrange(ichunk, &begin, &end);
+            for (int axis = 0; axis < 3; axis++) {
+                if (centsize.v[axis] <= 0.0) continue;
+                binprims(axis, begin, end, &chunkbins[(ichunk * 3 + axis) * numbins]);
+            }
+        });
+    }
+
+    for (int axis = 0; axis < 3; axis++) {
+        const RTFloat extent = centsize.v[axis];
+        if (extent <= 0.0) continue;
+
+        if (numchunks > 1) {
+            for (int ib = 0; ib < numbins; ib++) {
+                bins[ib].bounds.clear();
+                bins[ib].count = 0;
+                for (int ichunk = 0; ichunk < numchunks; ichunk++) {
+                    const SAHBin& cbin = chunkbins[(ichunk * 3 + axis) * numbins + ib];
+                    bins[ib].bounds.expand(cbin.bounds);
+                    bins[ib].count += cbin.count;
+                }
+            }
+        } else {
+            binprims(axis, 0, numchild, bins);
+        }
+
+        // sweep from right. rightcost[i]: bins (i, numbins)
+        {
+            AABB accbnd;
+            int acccount = 0;
+            for (int ib = numbins - 1; ib > 0; ib--) {
+                accbnd.expand(bins[ib].bounds);
+                acccount += bins[ib].count;
+                rightcost[ib - 1] = (acccount > 0) ? accbnd.surfaceArea() * buildOption.packetCount(acccount) : 0.0;
+            }
+        }
+
+        // sweep from left. split after bin ib
+        {
+            AABB accbnd;
+            int acccount = 0;
+            for (int ib = 0; ib < numbins - 1; ib++) {
+                accbnd.expand(bins[ib].bounds);
+                acccount += bins[ib].count;
+                if (acccount == 0 || acccount == numchild) continue;
+
+                RTFloat leftcost = accbnd.surfaceArea() * buildOption.packetCount(acccount);
+                RTFloat cost = buildOption.traversalCost + buildOption.intersectCost * (leftcost + rightcost[ib]) * invarea;
+                if (cost < bestcost) {
+                    bestcost = cost;
+                    bestaxis = axis;
+                    bestbin = ib;
+                }
+            }
+        }
+    }
+
+    const RTFloat leafcost = buildOption.intersectCost * buildOption.packetCount(numchild);
+    if (numchild <= maxleaf && (bestaxis < 0 || leafcost <= bestcost)) {
+        return makeLeaf(childnodes, numchild);
+    }
+
+    int numleft;
+    if (bestaxis < 0) {
+        // all centroids are same position
+        numleft = numchild / 2;
+    } else {
+        const RTFloat scale = numbins / centsize.v[bestaxis];
+        const RTFloat cmin = centbnd.min.v[bestaxis];
+        auto midite = std::partition(childnodes, childnodes + numchild, [=](const TreeNode* node) {
+            int ib = static_cast<int>((node->bounds.centroid().v[bestaxis] - cmin) * scale);
+            return std::min(ib, numbins - 1) <= bestbin;
+        });
+        numleft = static_cast<int>(midite - childnodes);
+        if (numleft == 0 || numleft == numchild) {
+            numleft = numchild / 2;
+        }
+    }
+
+    auto curnode = allocateTreeNode(nullptr);
+    curnode->bounds = nodebnd;
+    if (isparallel) {
+        // left half as a job, right half on this thread
+        JobSystem::TaskGroup group;
+        buildJobs->submit(&group, [=]() {
+            curnode->leftNode = buildTreeSAH(childnodes, numleft, depth + 1);
+        });
+        curnode->rightNode = buildTreeSAH(childnodes + numleft, numchild - numleft, depth + 1);
+        buildJobs->wait(&group);
+    } else {
+        curnode->leftNode = buildTreeSAH(childnodes, numleft, depth + 1);
+        curnode->rightNode = buildTreeSAH(childnodes + numleft, numchild - numleft, depth + 1);
+    }
+
+    return curnode;
+}
+
+BVH::Statistics BVH::computeStatistics() const {
+    Statistics stats;
+    stats.primitiveCount = static_cast<int>(leafNodes.size());
+    stats.innerCount = 0;
+    stats.leafCount = 0;
+    stats.maxDepth = 0;
+    stats.maxLeafSize = 0;
+    stats.averageLeafSize = 0.0;
+    stats.averageLeafDepth = 0.0;
+    stats.sahCost = 0.0;
+    stats.wideNodeCount = static_cast<int>(wideNodes.size());
+    stats.memoryBytes = wideNodes.size() * sizeof(WideNode) + linearPrimitives.size() * sizeof(linearPrimitives[0]);
+    stats.memoryBytes += motionBounds.size() * sizeof(MotionBounds) + linearSliceBounds.size() * sizeof(linearSliceBounds[0]);
+
+    if (rootNode == nullptr) {
+        return stats;
+    }
+
+    collectStatistics(rootNode, 0, &stats);
+
+    RTFloat rootarea = rootNode->bounds.surfaceArea();
+    stats.sahCost = (rootarea > 0.0) ? stats.sahCost / rootarea : 0.0;
+    if (stats.leafCount > 0) {
+        stats.averageLeafSize = static_cast<RTFloat>(stats.primitiveCount) / stats.leafCount;
+        stats.averageLeafDepth /= stats.leafCount;
+    }
+    return stats;
+}
+
+void BVH::collectStatistics(const TreeNode* node, int depth, Statistics* stats) const {
+    stats->maxDepth = std::max(stats->maxDepth, depth);
+    RTFloat area = node->bounds.surfaceArea();
+    if (node->primCount > 0) {
+        stats->leafCount += 1;
+        stats->maxLeafSize = std::max(stats->maxLeafSize, node->primCount);
+        stats->averageLeafDepth += depth;
+        stats->sahCost += area * buildOption.packetCount(node->primCount) * buildOption.intersectCost;
+    } else {
+        stats->innerCount += 1;
+        stats->sahCost += area * buildOption.traversalCost;
+        collectStatistics(node->leftNode, depth + 1, stats);
+        collectStatistics(node->rightNode, depth + 1, stats);
+    }
+}
+
+RTFloat BVH::nodeSAHCost(const TreeNode* node) const {
+    RTFloat area = node->bounds.surfaceArea();
+    if (node->primCount > 0) {
+        return area * buildOption.packetCount(node->primCount) * buildOption.intersectCost;
+    }
+    return area * buildOption.traversalCost + nodeSAHCost(node->leftNode) + nodeSAHCost(node->rightNode);
+}
+
+RTFloat BVH::refitNode(TreeNode* node) {
+    if (node->primCount > 0) {
+        if (node->source != nullptr) {
+            node->bounds = *node->source;
+        } else {
+            node->bounds.clear();
+            for (int i = 0; i < node->primCount; i++) {
+                node->bounds.expand(*leafNodes[node->primStart + i]->source);
+            }
+        }
+        return node->bounds.surfaceArea() * buildOption.packetCount(node->primCount) * buildOption.intersectCost;
+    }
+
+    RTFloat cost = refitNode(node->leftNode) + refitNode(node->rightNode);
+    node->bounds = node->leftNode->bounds;
+    node->bounds.expand(node->rightNode->bounds);
+    return cost + node->bounds.surfaceArea() * buildOption.traversalCost;
+}
+
 RTFloat BVH::intersect(const Ray& ray, RTFloat tnear, RTFloat tfar, HitCallback hitfunc) const {
-    if (!rootNode->bounds.isIntersect(ray, tnear, tfar)) {
-        return -1.0;
+    return intersect<HitCallback&>(ray, tnear, tfar, hitfunc);
+}
+
+bool BVH::occluded(const Ray& ray, RTFloat tnear, RTFloat tfar, AnyHitCallback hitfunc) const {
+    return occluded<AnyHitCallback&>(ray, tnear, tfar, hitfunc);
+}
+
+void BVH::flattenTree() {
+    wideNodes.clear();
+    wideSlotNodes.clear();
+    linearPrimitives.clear();
+    if (rootNode == nullptr) {
+        return;
+    }
+
+    wideNodes.reserve(usedNodeCount / 2 + 1);
+    linearPrimitives.reserve(leafNodes.size());
+    for (auto ite = leafNodes.begin(); ite != leafNodes.end(); ++ite) {
+        linearPrimitives.push_back((*ite)->source);
+    }
+    linearSliceBounds.clear();
+    if (motionSliceCount > 1) {
+        linearSliceBounds.reserve(leafNodes.size());
+        for (auto ite = leafNodes.begin(); ite != leafNodes.end(); ++ite) {
+            linearSliceBounds.push_back((*ite)->sliceSource);
+        }
+    }
+
+    int maxdepth = 0;
+    flattenNode(rootNode, 0, &maxdepth);
+
+    // each level pushes at most (width - 1) entries
+    if ((maxdepth + 1) * (kWideNodeWidth - 1) + 1 > kTraverseStackSize && buildOption.type != BuildType::kMedian) {
+        // too deep to traverse. rebuild balanced tree with median split
+        usedNodeCount = leafNodes.size();
+        rootNode = buildTree(leafNodes.data(), static_cast<int>(leafNodes.size()), 0);
+        flattenTree();
     }
-    return traverseIntersect(rootNode, ray, tnear, tfar, hitfunc);
 }
 
-RTFloat BVH::traverseIntersect(const TreeNode* node, const Ray& ray, RTFloat tnear, RTFloat tfar, HitCallback hitfunc) const {
-    if (node->source != nullptr) {
-        return hitfunc(ray, tnear, tfar, node->source);
+int BVH::flattenNode(const TreeNode* node, int depth, int* maxdepth) {
+    int index = static_cast<int>(wideNodes.size());
+    wideNodes.emplace_back();
+    wideSlotNodes.resize(wideNodes.size() * kWideNodeWidth, nullptr);
+    *maxdepth = std::max(*maxdepth, depth);
+
+    // collapse binary levels. open the largest inner child until the node is full
+    const TreeNode* children[kWideNodeWidth];
+    int numchild = 0;
+    if (node->primCount > 0) {
+        children[numchild++] = node;
+    } else {
+        children[numchild++] = node->leftNode;
+        children[numchild++] = node->rightNode;
     }
-    else {
-//        RTFloat t;
-        RTFloat rett = -1.0;
-        RTFloat tl = node->leftNode->bounds.mightIntersectContent(ray, tfar);
-        RTFloat tr = node->rightNode->bounds.mightIntersectContent(ray, tfar);
-        
-        if (tl >= 0.0) {
-            RTFloat t = traverseIntersect(node->leftNode, ray, tnear, tfar, hitfunc);
-            if (t >= tnear && t <= tfar) {
-                tfar = t;
-                rett = t;
+    while (numchild < kWideNodeWidth) {
+        int openi = -1;
+        RTFloat maxarea = -1.0;
+        for (int i = 0; i < numchild; i++) {
+            if (children[i]->primCount == 0 && children[i]->bounds.surfaceArea() > maxarea) {
+                openi = i;
+                maxarea = children[i]->bounds.surfaceArea();
             }
         }
-        
-        if (tr >= 0.0) {
-            RTFloat t = traverseIntersect(node->rightNode, ray, tnear, tfar, hitfunc);
-            if (t >= tnear && t <= tfar) {
-                rett = (rett < 0.0) ? t : std::min(rett, t);
+        if (openi < 0) {
+            break;
+        }
+        const TreeNode* opened = children[openi];
+        children[openi] = opened->leftNode;
+        children[numchild++] = opened->rightNode;
+    }
+
+    for (int i = 0; i < kWideNodeWidth; i++) {
+        wideSlotNodes[index * kWideNodeWidth + i] = (i < numchild) ? children[i] : nullptr;
+        if (i >= numchild) {
+            setWideChildEmpty(&wideNodes[index], i);
+        } else if (children[i]->primCount > 0) {
+            setWideChild(&wideNodes[index], i, children[i]->bounds, children[i]->primStart, children[i]->primCount);
+        } else {
+            // wideNodes may be reallocated
+            int ci = flattenNode(children[i], depth + 1, maxdepth);
+            setWideChild(&wideNodes[index], i, children[i]->bounds, ci, 0);
+        }
+    }
+    return index;
+}
+
+void BVH::updateMotionBounds() {
+    if (motionSliceCount <= 1 || wideNodes.empty()) {
+        motionBounds.clear();
+        return;
+    }
+
+    const int numslices = motionSliceCount;
+    motionBounds.resize(wideNodes.size() * numslices);
+
+    // children have larger index than parent. bottom up
+    for (int inode = static_cast<int>(wideNodes.size()) - 1; inode >= 0; inode--) {
+        const WideNode& node = wideNodes[inode];
+        for (int islc = 0; islc < numslices; islc++) {
+            MotionBounds& mb = motionBounds[inode * numslices + islc];
+            for (int i = 0; i < kWideNodeWidth; i++) {
+                AABB bnd;
+                if (node.count[i] > 0) {
+                    for (int ip = node.offset[i]; ip < node.offset[i] + node.count[i]; ip++) {
+                        const AABB* slcbnd = linearSliceBounds[ip];
+                        bnd.expand((slcbnd != nullptr) ? slcbnd[islc] : *linearPrimitives[ip]);
+                    }
+                } else if (node.offset[i] >= 0) {
+                    // inner. union of child node slots
+                    const MotionBounds& cmb = motionBounds[node.offset[i] * numslices + islc];
+                    for (int a = 0; a < 3; a++) {
+                        bnd.min.v[a] = *std::min_element(cmb.bounds[0][a], cmb.bounds[0][a] + kWideNodeWidth);
+                        bnd.max.v[a] = *std::max_element(cmb.bounds[1][a], cmb.bounds[1][a] + kWideNodeWidth);
+                    }
+                }
+
+                if (node.count[i] == 0 && node.offset[i] < 0) {
+                    // empty
+                    for (int a = 0; a < 3; a++) {
+                        mb.bounds[0][a][i] = std::numeric_limits<RTGeomFloat>::max();
+                        mb.bounds[1][a][i] = -std::numeric_limits<RTGeomFloat>::max();
+                    }
+                } else {
+                    for (int a = 0; a < 3; a++) {
+                        mb.bounds[0][a][i] = RoundDown(bnd.min.v[a]);
+                        mb.bounds[1][a][i] = RoundUp(bnd.max.v[a]);
+                    }
+                }
             }
         }
-        return rett;
     }
 }
 
+void BVH::setWideChild(WideNode* wnode, int slot, const AABB& bnd, int offset, int count) {
+    setWideChildBounds(wnode, slot, bnd);
+    wnode->offset[slot] = offset;
+    wnode->count[slot] = count;
+}
+
+void BVH::setWideChildBounds(WideNode* wnode, int slot, const AABB& bnd) {
+    for (int a = 0; a < 3; a++) {
+        wnode->bounds[0][a][slot] = RoundDown(bnd.min.v[a]);
+        wnode->bounds[1][a][slot] = RoundUp(bnd.max.v[a]);
+    }
+}
+
+void BVH::setWideChildEmpty(WideNode* wnode, int slot) {
+    // inverted bounds never hit
+    for (int a = 0; a < 3; a++) {
+        wnode->bounds[0][a][slot] = std::numeric_limits<RTGeomFloat>::max();
+        wnode->bounds[1][a][slot] = -std::numeric_limits<RTGeomFloat>::max();
+    }
+    wnode->offset[slot] = -1;
+    wnode->count[slot] = 0;
+}
+
 //RTFloat BVH::intersect(const Ray& ray, RTFloat tnear, RTFloat tfar, const TraverseInfo* tinfo) const {
 //    if (!rootNode->bounds.isIntersect(ray, tnear, tfar)) {
 //        return -1.0;
@@ -173,24 +699,24 @@ RTFloat BVH::traverseIntersect(const TreeNode* node, const Ray& ray, RTFloat tne
 //}
 
 int BVH::compareTreeNodeX(const void* p0, const void* p1) {
-    const TreeNode* n0 = reinterpret_cast<const TreeNode*>(p0);
-    const TreeNode* n1 = reinterpret_cast<const TreeNode*>(p1);
+    const TreeNode* n0 = *reinterpret_cast<const TreeNode* const*>(p0);
+    const TreeNode* n1 = *reinterpret_cast<const TreeNode* const*>(p1);
     RTFloat a = n0->bounds.centroid().x;
     RTFloat b = n1->bounds.centroid().x;
     return (a == b) ? 0 : ((a < b) ? -1 : 1);
 }
 
 int BVH::compareTreeNodeY(const void* p0, const void* p1) {
-    const TreeNode* n0 = reinterpret_cast<const TreeNode*>(p0);
-    const TreeNode* n1 = reinterpret_cast<const TreeNode*>(p1);
+    const TreeNode* n0 = *reinterpret_cast<const TreeNode* const*>(p0);
+    const TreeNode* n1 = *reinterpret_cast<const TreeNode* const*>(p1);
     RTFloat a = n0->bounds.centroid().y;
     RTFloat b = n1->bounds.centroid().y;
     return (a == b) ? 0 : ((a < b) ? -1 : 1);
 }
 
 int BVH::compareTreeNodeZ(const void* p0, const void* p1) {
-    const TreeNode* n0 = reinterpret_cast<const TreeNode*>(p0);
-    const TreeNode* n1 = reinterpret_cast<const TreeNode*>(p1);
+    const TreeNode* n0 = *reinterpret_cast<const TreeNode* const*>(p0);
+    const TreeNode* n1 = *reinterpret_cast<const TreeNode* const*>(p1);
     RTFloat a = n0->bounds.centroid().z;
     RTFloat b = n1->bounds.centroid().z;
     return (a == b) ? 0 : ((a < b) ? -1 : 1);
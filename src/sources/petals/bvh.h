@@ -4,29 +4,130 @@
 #include <vector>
 #include <memory>
 #include <functional>
+#include <string>
+#include <algorithm>
+#include <limits>
+#include <atomic>
+#include <cmath>
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
 #include "aabb.h"
 
 namespace Petals {
-    
+
+    class JobSystem;
+
     class BVH {
+    public:
+        enum class BuildType {
+            kMedian,    // longest axis, center split
+            kSAH        // binned surface area heuristic
+        };
+
+        struct BuildOption {
+            BuildType type;
+            int maxLeafSize;    // primitives per leaf (SAH)
+            int binCount;       // bins per axis (SAH)
+            RTFloat traversalCost;
+            RTFloat intersectCost;
+            int packetWidth;    // primitives tested at once in a leaf. intersectCost is per packet
+            RTFloat refitThreshold; // update() rebuilds when refit SAH cost grows over this ratio. <= 0: always rebuild
+            int parallelThreshold;  // nodes with more primitives are split into jobs. <= 0: serial
+            JobSystem* jobSystem;   // runs the build jobs. nullptr: JobSystem::shared()
+
+            BuildOption() :
+                type(BuildType::kSAH),
+                maxLeafSize(4),
+                binCount(16),
+                traversalCost(1.0),
+                intersectCost(1.0),
+                packetWidth(1),
+                refitThreshold(1.5),
+                parallelThreshold(4096),
+                jobSystem(nullptr)
+            {}
+
+            int packetCount(int numprims) const {
+                int w = std::max(1, packetWidth);
+                return (numprims + w - 1) / w;
+            }
+
+            static BuildType parseBuildType(const std::string& name);
+        };
+
+        struct Statistics {
+            int primitiveCount;
+            int innerCount;
+            int leafCount;
+            int maxDepth;
+            int maxLeafSize;
+            RTFloat averageLeafSize;
+            RTFloat averageLeafDepth;
+            RTFloat sahCost;    // expected cost per ray, relative to root bounds
+            int wideNodeCount;
+            size_t memoryBytes; // traversal data (wide nodes and primitive references)
+
+            void print(const std::string& label) const;
+        };
+
+        // children per node, bounds in SoA layout for the slab kernel. one 256bit register per axis,
+        // 4 children for double bounds, 8 for float. built by collapsing the binary tree.
+        static constexpr int kWideNodeWidth = 32 / sizeof(RTGeomFloat);
+
+        // widens slab exit distance to cover rounding error. 1 + 2 * gamma(3)
+        static constexpr RTGeomFloat kSlabRobustScale = 1 + 2 * (3 * std::numeric_limits<RTGeomFloat>::epsilon() * 0.5) / (1 - 3 * std::numeric_limits<RTGeomFloat>::epsilon() * 0.5);
+
+        struct alignas(32) WideNode {
+            RTGeomFloat bounds[2][3][kWideNodeWidth]; // [min/max][axis][child]. rounded outward
+            int offset[kWideNodeWidth]; // inner: node index, leaf: first index in linearPrimitives
+            int count[kWideNodeWidth];  // leaf: number of primitives, 0: inner node or empty
+        };
+        static_assert(sizeof(WideNode) % 32 == 0, "WideNode must be 32 byte aligned");
+
+        // WideNode bounds at one exposure slice. linearly interpolated between slices in traversal
+        struct alignas(32) MotionBounds {
+            RTGeomFloat bounds[2][3][kWideNodeWidth];
+        };
+
+        // returns bit mask of children hit within [tnear, tfar]. otmin receives entry distances.
+        static int intersectWideNode(const WideNode& node, const InvDirRay& ray, RTFloat tnear, RTFloat tfar, RTGeomFloat* otmin);
+        static int intersectWideNodeScalar(const WideNode& node, const InvDirRay& ray, RTFloat tnear, RTFloat tfar, RTGeomFloat* otmin);
+
     private:
         class TreeNode {
         public:
-            TreeNode(const AABB* src): source(src), leftNode(nullptr), rightNode(nullptr) {};
+            TreeNode(const AABB* src): source(src), sliceSource(nullptr), leftNode(nullptr), rightNode(nullptr), primStart(0), primCount(0) {};
 
-            const AABB* source; // source is null: leaf
+            const AABB* source; // not null: primitive
+            const AABB* sliceSource; // primitive bounds per motion slice. nullptr: source for all slices
             AABB bounds;
             TreeNode* leftNode;
             TreeNode* rightNode;
+            int primStart;  // leaf: first index in leafNodes
+            int primCount;  // leaf: number of primitives, 0: inner node
 
-            void reset(const AABB* bnd);
+            void reset(const AABB* bnd, const AABB* slicebnd);
         };
-        
+
+        static constexpr int kTraverseStackSize = 128;
+
         TreeNode* rootNode;
         std::vector<std::unique_ptr<TreeNode> > nodePool;
-        size_t usedNodeCount;
+        std::atomic<size_t> usedNodeCount;
+        JobSystem* buildJobs;   // not null while building in parallel
         std::vector<TreeNode*> leafNodes;
-        
+        BuildOption buildOption;
+
+        std::vector<WideNode> wideNodes;
+        std::vector<const TreeNode*> wideSlotNodes; // source of each wide node child for refit
+        RTFloat builtSAHCost;
+        std::vector<const AABB*> linearPrimitives;
+
+        int motionSliceCount;
+        std::vector<MotionBounds> motionBounds; // [wide node * motionSliceCount + slice]
+        std::vector<const AABB*> linearSliceBounds;
+
     public:
         //struct TraverseInfo {
         //    RTFloat(*leafHitCallback)(const Ray&, RTFloat, RTFloat, const AABB*, void*);
@@ -35,29 +136,350 @@ namespace Petals {
 
         BVH();
         BVH(int capacity);
+        BVH(int capacity, const BuildOption& opt);
         ~BVH();
-        
+
         void clear();
-        void appendLeaf(const AABB* bnd);
+        // bnd covers whole motion. slicebnds: bounds at each motion slice, or nullptr
+        void appendLeaf(const AABB* bnd, const AABB* slicebnds = nullptr);
         void updateAllLeafBounds();
         void build();
 
+        // keeps topology and recomputes bounds from leaf sources. returns SAH cost ratio to the last build
+        RTFloat refit();
+        // refit, or full rebuild when the refitted tree is degraded. returns true if rebuilt
+        bool update();
+
+        // exposure slices of primitive motion. > 1 stores node bounds per slice
+        void setMotionSliceCount(int n) { motionSliceCount = std::max(1, n); }
+        int getMotionSliceCount() const { return motionSliceCount; }
+
+        void setBuildOption(const BuildOption& opt) { buildOption = opt; }
+        const BuildOption& getBuildOption() const { return buildOption; }
+
+        Statistics computeStatistics() const;
+
         typedef std::function<RTFloat(const Ray&, RTFloat, RTFloat, const AABB*)> HitCallback;
 
         // RTFloat intersect(const Ray& ray, RTFloat tnear, RTFloat tfar, const TraverseInfo* tinfo) const;
         RTFloat intersect(const Ray& ray, RTFloat tnear, RTFloat tfar, HitCallback hitfunc) const;
- 
+
+        // hitfunc is inlined. signature: RTFloat(const Ray&, RTFloat tnear, RTFloat tfar, const AABB*)
+        template<typename HitFunc> RTFloat intersect(const Ray& ray, RTFloat tnear, RTFloat tfar, HitFunc&& hitfunc) const {
+            auto leaffunc = [this, &hitfunc](const Ray& ray, RTFloat tnear, RTFloat tfar, int primstart, int primcount) {
+                RTFloat rett = -1.0;
+                for (int i = 0; i < primcount; i++) {
+                    RTFloat t = hitfunc(ray, tnear, tfar, linearPrimitives[primstart + i]);
+                    if (t >= tnear && t <= tfar) {
+                        tfar = t;
+                        rett = t;
+                    }
+                }
+                return rett;
+            };
+            return traverseIntersect(ray, tnear, tfar, -1.0, leaffunc);
+        }
+
+        // motion blur. node bounds at timerate [0, 1]
+        template<typename HitFunc> RTFloat intersect(const Ray& ray, RTFloat tnear, RTFloat tfar, RTTimeType timerate, HitFunc&& hitfunc) const {
+            auto leaffunc = [this, &hitfunc](const Ray& ray, RTFloat tnear, RTFloat tfar, int primstart, int primcount) {
+                RTFloat rett = -1.0;
+                for (int i = 0; i < primcount; i++) {
+                    RTFloat t = hitfunc(ray, tnear, tfar, linearPrimitives[primstart + i]);
+                    if (t >= tnear && t <= tfar) {
+                        tfar = t;
+                        rett = t;
+                    }
+                }
+                return rett;
+            };
+            return traverseIntersect(ray, tnear, tfar, timerate, leaffunc);
+        }
+
+        // whole leaf at once. signature: RTFloat(const Ray&, RTFloat tnear, RTFloat tfar, int primStart, int primCount)
+        // primStart is the index of primitiveAt()
+        template<typename LeafFunc> RTFloat intersectLeaves(const Ray& ray, RTFloat tnear, RTFloat tfar, LeafFunc&& leaffunc) const {
+            return traverseIntersect(ray, tnear, tfar, -1.0, leaffunc);
+        }
+
+        // any hit query. stops at the first leaf that hitfunc reports as hit.
+        typedef std::function<bool(const Ray&, RTFloat, RTFloat, const AABB*)> AnyHitCallback;
+        bool occluded(const Ray& ray, RTFloat tnear, RTFloat tfar, AnyHitCallback hitfunc) const;
+
+        template<typename HitFunc> bool occluded(const Ray& ray, RTFloat tnear, RTFloat tfar, HitFunc&& hitfunc) const {
+            auto leaffunc = [this, &hitfunc](const Ray& ray, RTFloat tnear, RTFloat tfar, int primstart, int primcount) {
+                for (int i = 0; i < primcount; i++) {
+                    if (hitfunc(ray, tnear, tfar, linearPrimitives[primstart + i])) {
+                        return true;
+                    }
+                }
+                return false;
+            };
+            return traverseOccluded(ray, tnear, tfar, -1.0, leaffunc);
+        }
+
+        template<typename HitFunc> bool occluded(const Ray& ray, RTFloat tnear, RTFloat tfar, RTTimeType timerate, HitFunc&& hitfunc) const {
+            auto leaffunc = [this, &hitfunc](const Ray& ray, RTFloat tnear, RTFloat tfar, int primstart, int primcount) {
+                for (int i = 0; i < primcount; i++) {
+                    if (hitfunc(ray, tnear, tfar, linearPrimitives[primstart + i])) {
+                        return true;
+                    }
+                }
+                return false;
+            };
+            return traverseOccluded(ray, tnear, tfar, timerate, leaffunc);
+        }
+
+        // signature: bool(const Ray&, RTFloat tnear, RTFloat tfar, int primStart, int primCount)
+        template<typename LeafFunc> bool occludedLeaves(const Ray& ray, RTFloat tnear, RTFloat tfar, LeafFunc&& leaffunc) const {
+            return traverseOccluded(ray, tnear, tfar, -1.0, leaffunc);
+        }
+
+        // primitives in traversal order. leaves refer to contiguous ranges
+        int primitiveCount() const { return static_cast<int>(linearPrimitives.size()); }
+        const AABB* primitiveAt(int i) const { return linearPrimitives[i]; }
+
+        // func: void(int primStart, int primCount)
+        template<typename Func> void forEachLeaf(Func&& func) const {
+            for (const auto& node : wideNodes) {
+                for (int i = 0; i < kWideNodeWidth; i++) {
+                    if (node.count[i] > 0) {
+                        func(node.offset[i], node.count[i]);
+                    }
+                }
+            }
+        }
+
 
     private:
         TreeNode* allocateTreeNode(const AABB* bnd);
         TreeNode* buildTree(TreeNode** childnodes, int numchild, int depth);
+        TreeNode* buildTreeSAH(TreeNode** childnodes, int numchild, int depth);
+        TreeNode* makeLeaf(TreeNode** childnodes, int numchild);
         //RTFloat traverseIntersect(const TreeNode* node, const Ray& ray, RTFloat tnear, RTFloat tfar, const TraverseInfo* tinfo) const;
-        RTFloat traverseIntersect(const TreeNode* node, const Ray& ray, RTFloat tnear, RTFloat tfar, HitCallback hitfunc) const;
+        // timerate < 0: whole motion bounds
+        template<typename LeafFunc> RTFloat traverseIntersect(const Ray& ray, RTFloat tnear, RTFloat tfar, RTTimeType timerate, LeafFunc& leaffunc) const;
+        template<typename LeafFunc> bool traverseOccluded(const Ray& ray, RTFloat tnear, RTFloat tfar, RTTimeType timerate, LeafFunc& leaffunc) const;
+        bool motionSegment(RTTimeType timerate, int* oslice, RTGeomFloat* ofrac) const;
+        void lerpMotionBounds(int nodeindex, int slice, RTGeomFloat frac, WideNode* onode) const;
+        void updateMotionBounds();
+        void flattenTree();
+        int flattenNode(const TreeNode* node, int depth, int* maxdepth);
+        static void setWideChild(WideNode* wnode, int slot, const AABB& bnd, int offset, int count);
+        static void setWideChildBounds(WideNode* wnode, int slot, const AABB& bnd);
+        static void setWideChildEmpty(WideNode* wnode, int slot);
+        void collectStatistics(const TreeNode* node, int depth, Statistics* stats) const;
+        RTFloat nodeSAHCost(const TreeNode* node) const;
+        RTFloat refitNode(TreeNode* node);
 
         static int compareTreeNodeX(const void* a, const void* b);
         static int compareTreeNodeY(const void* a, const void* b);
         static int compareTreeNodeZ(const void* a, const void* b);
     };
+
+    /////
+    inline int BVH::intersectWideNodeScalar(const WideNode& node, const InvDirRay& ray, RTFloat tnear, RTFloat tfar, RTGeomFloat* otmin) {
+        int mask = 0;
+        for (int i = 0; i < kWideNodeWidth; i++) {
+            RTGeomFloat tmin = static_cast<RTGeomFloat>(tnear);
+            RTGeomFloat tmax = static_cast<RTGeomFloat>(tfar);
+            for (int a = 0; a < 3; a++) {
+                RTGeomFloat t0 = (node.bounds[ray.dirIsNeg[a]][a][i] - ray.origin[a]) * ray.invDirection[a];
+                RTGeomFloat t1 = (node.bounds[1 - ray.dirIsNeg[a]][a][i] - ray.origin[a]) * ray.invDirection[a];
+                // NaN (0 * inf) keeps current range
+                tmin = std::max(tmin, t0);
+                tmax = std::min(tmax, t1);
+            }
+            otmin[i] = tmin;
+            mask |= (tmin <= tmax * kSlabRobustScale) ? (1 << i) : 0;
+        }
+        return mask;
+    }
+
+    inline int BVH::intersectWideNode(const WideNode& node, const InvDirRay& ray, RTFloat tnear, RTFloat tfar, RTGeomFloat* otmin) {
+#if defined(__AVX__) && defined(PETALS_GEOMETRY_FLOAT)
+        __m256 tmin = _mm256_set1_ps(static_cast<float>(tnear));
+        __m256 tmax = _mm256_set1_ps(static_cast<float>(tfar));
+        for (int a = 0; a < 3; a++) {
+            __m256 org = _mm256_set1_ps(ray.origin[a]);
+            __m256 inv = _mm256_set1_ps(ray.invDirection[a]);
+            __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray.dirIsNeg[a]][a]), org), inv);
+            __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[1 - ray.dirIsNeg[a]][a]), org), inv);
+            // max/min return the second operand for NaN
+            tmin = _mm256_max_ps(t0, tmin);
+            tmax = _mm256_min_ps(t1, tmax);
+        }
+        tmax = _mm256_mul_ps(tmax, _mm256_set1_ps(kSlabRobustScale));
+        _mm256_storeu_ps(otmin, tmin);
+        return _mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ));
+#elif defined(__AVX__)
+        __m256d tmin = _mm256_set1_pd(tnear);
+        __m256d tmax = _mm256_set1_pd(tfar);
+        for (int a = 0; a < 3; a++) {
+            __m256d org = _mm256_set1_pd(ray.origin[a]);
+            __m256d inv = _mm256_set1_pd(ray.invDirection[a]);
+            __m256d t0 = _mm256_mul_pd(_mm256_sub_pd(_mm256_load_pd(node.bounds[ray.dirIsNeg[a]][a]), org), inv);
+            __m256d t1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_load_pd(node.bounds[1 - ray.dirIsNeg[a]][a]), org), inv);
+            // max/min return the second operand for NaN
+            tmin = _mm256_max_pd(t0, tmin);
+            tmax = _mm256_min_pd(t1, tmax);
+        }
+        tmax = _mm256_mul_pd(tmax, _mm256_set1_pd(kSlabRobustScale));
+        _mm256_storeu_pd(otmin, tmin);
+        return _mm256_movemask_pd(_mm256_cmp_pd(tmin, tmax, _CMP_LE_OQ));
+#else
+        return intersectWideNodeScalar(node, ray, tnear, tfar, otmin);
+#endif
+    }
+
+    inline bool BVH::motionSegment(RTTimeType timerate, int* oslice, RTGeomFloat* ofrac) const {
+        if (timerate < 0.0 || motionBounds.empty()) {
+            return false;
+        }
+        const int lastslice = motionSliceCount - 1;
+        RTTimeType ts = std::min(static_cast<RTTimeType>(1.0), timerate) * lastslice;
+        int i0 = std::min(static_cast<int>(ts), lastslice - 1);
+        *oslice = i0;
+        *ofrac = static_cast<RTGeomFloat>(ts - i0);
+        return true;
+    }
+
+    inline void BVH::lerpMotionBounds(int nodeindex, int slice, RTGeomFloat frac, WideNode* onode) const {
+        constexpr int kHalf = 3 * kWideNodeWidth;
+        // widened by rounding error of lerp. max instead of sum keeps empty slots finite
+        constexpr RTGeomFloat kPad = 8 * std::numeric_limits<RTGeomFloat>::epsilon();
+        const RTGeomFloat* b0 = &motionBounds[nodeindex * motionSliceCount + slice].bounds[0][0][0];
+        const RTGeomFloat* b1 = &motionBounds[nodeindex * motionSliceCount + slice + 1].bounds[0][0][0];
+        RTGeomFloat* ob = &onode->bounds[0][0][0];
+        for (int i = 0; i < kHalf; i++) {
+            RTGeomFloat v = b0[i] + (b1[i] - b0[i]) * frac;
+            ob[i] = v - std::max(std::abs(b0[i]), std::abs(b1[i])) * kPad;
+        }
+        for (int i = kHalf; i < kHalf * 2; i++) {
+            RTGeomFloat v = b0[i] + (b1[i] - b0[i]) * frac;
+            ob[i] = v + std::max(std::abs(b0[i]), std::abs(b1[i])) * kPad;
+        }
+    }
+
+    template<typename LeafFunc> RTFloat BVH::traverseIntersect(const Ray& ray, RTFloat tnear, RTFloat tfar, RTTimeType timerate, LeafFunc& leaffunc) const {
+        if (wideNodes.empty()) {
+            return -1.0;
+        }
+
+        // inner: offset is node index and count is 0
+        struct StackEntry {
+            int offset;
+            int count;
+            RTGeomFloat tmin;
+        };
+        StackEntry stack[kTraverseStackSize];
+        int stackCount = 0;
+        stack[0] = { 0, 0, static_cast<RTGeomFloat>(tnear) };
+        stackCount = 1;
+
+        const InvDirRay iray(ray);
+        int motionslice = 0;
+        RTGeomFloat motionfrac = 0;
+        const bool ismotion = motionSegment(timerate, &motionslice, &motionfrac);
+        alignas(32) WideNode motionnode;
+
+        RTFloat rett = -1.0;
+        while (stackCount > 0) {
+            stackCount -= 1;
+            const StackEntry entry = stack[stackCount];
+            // behind current nearest hit
+            if (entry.tmin > tfar * kSlabRobustScale) {
+                continue;
+            }
+
+            if (entry.count > 0) {
+                // leaf
+                RTFloat t = leaffunc(ray, tnear, tfar, entry.offset, entry.count);
+                if (t >= tnear && t <= tfar) {
+                    tfar = t;
+                    rett = t;
+                }
+                continue;
+            }
+
+            const WideNode& node = wideNodes[entry.offset];
+            alignas(32) RTGeomFloat tmins[kWideNodeWidth];
+            int mask;
+            if (ismotion) {
+                lerpMotionBounds(entry.offset, motionslice, motionfrac, &motionnode);
+                mask = intersectWideNode(motionnode, iray, tnear, tfar, tmins);
+            } else {
+                mask = intersectWideNode(node, iray, tnear, tfar, tmins);
+            }
+
+            // push far to near, so nearest child is popped first
+            int base = stackCount;
+            for (int i = 0; i < kWideNodeWidth; i++) {
+                if ((mask & (1 << i)) == 0) {
+                    continue;
+                }
+                StackEntry child = { node.offset[i], node.count[i], tmins[i] };
+                int j = stackCount;
+                while (j > base && stack[j - 1].tmin < child.tmin) {
+                    stack[j] = stack[j - 1];
+                    j -= 1;
+                }
+                stack[j] = child;
+                stackCount += 1;
+            }
+        }
+
+        return rett;
+    }
+
+    template<typename LeafFunc> bool BVH::traverseOccluded(const Ray& ray, RTFloat tnear, RTFloat tfar, RTTimeType timerate, LeafFunc& leaffunc) const {
+        if (wideNodes.empty()) {
+            return false;
+        }
+
+        int stack[kTraverseStackSize];
+        int stackCount = 0;
+        stack[0] = 0;
+        stackCount = 1;
+
+        const InvDirRay iray(ray);
+        int motionslice = 0;
+        RTGeomFloat motionfrac = 0;
+        const bool ismotion = motionSegment(timerate, &motionslice, &motionfrac);
+        alignas(32) WideNode motionnode;
+
+        while (stackCount > 0) {
+            stackCount -= 1;
+            const int nodeindex = stack[stackCount];
+            const WideNode& node = wideNodes[nodeindex];
+            alignas(32) RTGeomFloat tmins[kWideNodeWidth];
+            int mask;
+            if (ismotion) {
+                lerpMotionBounds(nodeindex, motionslice, motionfrac, &motionnode);
+                mask = intersectWideNode(motionnode, iray, tnear, tfar, tmins);
+            } else {
+                mask = intersectWideNode(node, iray, tnear, tfar, tmins);
+            }
+
+            // order does not matter
+            for (int i = 0; i < kWideNodeWidth; i++) {
+                if ((mask & (1 << i)) == 0) {
+                    continue;
+                }
+                if (node.count[i] > 0) {
+                    // leaf
+                    if (leaffunc(ray, tnear, tfar, node.offset[i], node.count[i])) {
+                        return true;
+                    }
+                } else {
+                    stack[stackCount] = node.offset[i];
+                    stackCount += 1;
+                }
+            }
+        }
+
+        return false;
+    }
 }
 
 
@@ -0,0 +1,204 @@
+#include <algorithm>
+
+#include <stb/stb_image.h>
+
+#include "celcache.h"
+#include "texture.h"
+
+using namespace Petals;
+
+CelCache::CelCache(size_t budgetbytes) :
+    budgetBytes(budgetbytes),
+    residentBytes(0),
+    stats({ 0, 0, 0, 0 }),
+    stopLoader(false)
+{
+    loaderThread = std::thread(&CelCache::loaderMain, this);
+}
+
+CelCache::~CelCache() {
+    {
+        std::unique_lock<std::mutex> lock(cacheMutex);
+        stopLoader = true;
+        prefetchQueue.clear();
+    }
+    loaderCondition.notify_all();
+    loaderThread.join();
+}
+
+std::shared_ptr<const CelImage> CelCache::acquire(const std::string& path) {
+    std::unique_lock<std::mutex> lock(cacheMutex);
+    while (true) {
+        auto ite = entries.find(path);
+        if (ite == entries.end()) {
+            break;
+        }
+        auto& entry = ite->second;
+        if (entry.loading) {
+            // the entry can be evicted while waiting, so look it up again
+            loadedCondition.wait(lock);
+            continue;
+        }
+        stats.hits += 1;
+        touch(entry);
+        return entry.image;
+    }
+
+    // miss. decoded on this thread, others wait for it
+    auto& entry = entries[path];
+    entry.loading = true;
+    entry.failed = false;
+    entry.bytes = 0;
+    lock.unlock();
+
+    auto image = decode(path);
+
+    lock.lock();
+    store(path, image);
+    lock.unlock();
+    loadedCondition.notify_all();
+    return image;
+}
+
+void CelCache::prefetch(const std::string& path) {
+    {
+        std::unique_lock<std::mutex> lock(cacheMutex);
+        auto ite = entries.find(path);
+        if (ite != entries.end()) {
+            if (!ite->second.loading) {
+                touch(ite->second);
+            }
+            return;
+        }
+        if (std::find(prefetchQueue.begin(), prefetchQueue.end(), path) != prefetchQueue.end()) {
+            return;
+        }
+        prefetchQueue.push_back(path);
+    }
+    loaderCondition.notify_one();
+}
+
+void CelCache::clear() {
+    std::unique_lock<std::mutex> lock(cacheMutex);
+    prefetchQueue.clear();
+    for (auto ite = entries.begin(); ite != entries.end();) {
+        auto& entry = ite->second;
+        if (entry.loading || entry.image.use_count() > 1) {
+            ++ite;
+            continue;
+        }
+        if (!entry.failed) {
+            lru.erase(entry.lruPos);
+        }
+        residentBytes -= entry.bytes;
+        ite = entries.erase(ite);
+    }
+}
+
+void CelCache::setBudget(size_t budgetbytes) {
+    std::unique_lock<std::mutex> lock(cacheMutex);
+    budgetBytes = budgetbytes;
+    evict();
+}
+
+size_t CelCache::getResidentBytes() {
+    std::unique_lock<std::mutex> lock(cacheMutex);
+    return residentBytes;
+}
+
+CelCache::Stats CelCache::getStats() {
+    std::unique_lock<std::mutex> lock(cacheMutex);
+    return stats;
+}
+
+std::shared_ptr<CelImage> CelCache::decode(const std::string& path) {
+    int x, y, c;
+    stbi_uc* imgbuf = stbi_load(path.c_str(), &x, &y, &c, 4);
+    if (imgbuf == nullptr) {
+        // reported by the caller, so the order of messages does not depend on threads
+        return nullptr;
+    }
+
+    auto image = std::make_shared<CelImage>();
+    image->texture = std::make_shared<ImageTexture>(x, y);
+    // stbi_load expands every image to RGBA
+    image->texture->initWith8BPPImage(imgbuf, 4, 2.2);
+    stbi_image_free(imgbuf);
+
+    // a cel is not tiled. rays past its edge see the border texels, same as CelStackKernel
+    image->texture->setWrap(ImageTexture::WrapType::kClamp, ImageTexture::WrapType::kClamp);
+    image->texels.initWithTexture(*image->texture);
+
+    return image;
+}
+
+void CelCache::loaderMain() {
+    std::unique_lock<std::mutex> lock(cacheMutex);
+    while (true) {
+        loaderCondition.wait(lock, [this]{ return stopLoader || !prefetchQueue.empty(); });
+        if (stopLoader) {
+            break;
+        }
+
+        std::string path = std::move(prefetchQueue.front());
+        prefetchQueue.pop_front();
+        // a full cache is not pushed over the budget ahead of time
+        if (entries.count(path) > 0 || residentBytes >= budgetBytes) {
+            continue;
+        }
+
+        auto& entry = entries[path];
+        entry.loading = true;
+        entry.failed = false;
+        entry.bytes = 0;
+        lock.unlock();
+
+        auto image = decode(path);
+
+        lock.lock();
+        store(path, image);
+        image.reset();
+        evict();
+        loadedCondition.notify_all();
+    }
+}
+
+void CelCache::touch(Entry& entry) {
+    if (!entry.failed) {
+        lru.splice(lru.begin(), lru, entry.lruPos);
+    }
+}
+
+void CelCache::store(const std::string& path, std::shared_ptr<CelImage> image) {
+    auto& entry = entries[path];
+    entry.loading = false;
+    entry.image = image;
+    entry.failed = (image == nullptr);
+    if (entry.failed) {
+        // kept, so the file is not decoded again
+        return;
+    }
+
+    entry.bytes = image->texture->getTexelBytes();
+    entry.lruPos = lru.insert(lru.begin(), path);
+    residentBytes += entry.bytes;
+    stats.decoded += 1;
+    stats.peakBytes = std::max(stats.peakBytes, residentBytes);
+    evict();
+}
+
+void CelCache::evict() {
+    // oldest first. images in use stay
+    auto ite = lru.end();
+    while (residentBytes > budgetBytes && ite != lru.begin()) {
+        --ite;
+        auto fnd = entries.find(*ite);
+        if (fnd->second.image.use_count() > 1) {
+            continue;
+        }
+        residentBytes -= fnd->second.bytes;
+        stats.evicted += 1;
+        entries.erase(fnd);
+        ite = lru.erase(ite);
+    }
+}
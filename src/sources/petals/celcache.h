@@ -0,0 +1,84 @@
+#ifndef PETALS_CELCACHE_H
+#define PETALS_CELCACHE_H
+
+#include <string>
+#include <memory>
+#include <map>
+#include <list>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "celstack.h"
+
+namespace Petals {
+
+    class ImageTexture;
+
+    // decoded cel image
+    struct CelImage {
+        std::shared_ptr<ImageTexture> texture;
+        CelTexels texels;
+    };
+
+    // cel images shared by all cuts, keyed by resolved path.
+    // images are decoded on first use or by prefetch, and evicted least recently used over the budget.
+    // callers hold shared_ptr, so an evicted image lives until its frames are done
+    class CelCache {
+    public:
+        struct Stats {
+            int decoded;
+            int hits;
+            int evicted;
+            size_t peakBytes;
+        };
+
+    public:
+        CelCache(size_t budgetbytes);
+        ~CelCache();
+
+        // decodes on a miss, waits when the loader is decoding it. nullptr when decode failed
+        std::shared_ptr<const CelImage> acquire(const std::string& path);
+        // decodes on the loader thread unless cached
+        void prefetch(const std::string& path);
+        // drops every image not in use
+        void clear();
+
+        void setBudget(size_t budgetbytes);
+        size_t getBudget() const { return budgetBytes; }
+        size_t getResidentBytes();
+        Stats getStats();
+
+        static std::shared_ptr<CelImage> decode(const std::string& path);
+
+    private:
+        struct Entry {
+            std::shared_ptr<CelImage> image;
+            size_t bytes;
+            bool loading;
+            bool failed;
+            std::list<std::string>::iterator lruPos;
+        };
+
+        size_t budgetBytes;
+        size_t residentBytes;
+        Stats stats;
+        std::map<std::string, Entry> entries;
+        std::list<std::string> lru; // most recent first
+        std::deque<std::string> prefetchQueue;
+        bool stopLoader;
+        std::mutex cacheMutex;
+        std::condition_variable loadedCondition;
+        std::condition_variable loaderCondition;
+        std::thread loaderThread;
+
+        void loaderMain();
+        // lock held
+        void touch(Entry& entry);
+        void store(const std::string& path, std::shared_ptr<CelImage> image);
+        void evict();
+    };
+}
+
+#endif
@@ -0,0 +1,326 @@
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+#include "celstack.h"
+#include "texture.h"
+
+using namespace Petals;
+
+namespace {
+    void DecodeTexel(const CelTexels& tex, uint32_t t, float* orgba) {
+        orgba[0] = tex.decodeTable[t & 0xff];
+        orgba[1] = tex.decodeTable[(t >> 8) & 0xff];
+        orgba[2] = tex.decodeTable[(t >> 16) & 0xff];
+        orgba[3] = (t >> 24) * (1.0f / 255.0f);
+    }
+
+    // bilinear at texel space (x, y), clamp to edge. same as the AVX paths
+    void SampleBilinear(const CelTexels& tex, float x, float y, float* orgba) {
+        x = std::min(std::max(x, -1.0f), static_cast<float>(tex.width));
+        y = std::min(std::max(y, -1.0f), static_cast<float>(tex.height));
+        float fx = std::floor(x);
+        float fy = std::floor(y);
+        float tx = x - fx;
+        float ty = y - fy;
+        int ix = static_cast<int>(fx);
+        int iy = static_cast<int>(fy);
+        int ix0 = std::min(std::max(ix, 0), tex.width - 1);
+        int ix1 = std::min(std::max(ix + 1, 0), tex.width - 1);
+        int iy0 = std::min(std::max(iy, 0), tex.height - 1);
+        int iy1 = std::min(std::max(iy + 1, 0), tex.height - 1);
+
+        float s00[4], s10[4], s01[4], s11[4];
+        DecodeTexel(tex, tex.texels[ix0 + iy0 * tex.width], s00);
+        DecodeTexel(tex, tex.texels[ix1 + iy0 * tex.width], s10);
+        DecodeTexel(tex, tex.texels[ix0 + iy1 * tex.width], s01);
+        DecodeTexel(tex, tex.texels[ix1 + iy1 * tex.width], s11);
+        for (int c = 0; c < 4; c++) {
+            float s0 = s00[c] + (s10[c] - s00[c]) * tx;
+            float s1 = s01[c] + (s11[c] - s01[c]) * tx;
+            orgba[c] = s0 + (s1 - s0) * ty;
+        }
+    }
+
+#if defined(__AVX2__)
+    inline void DecodeTexel8(const float* table, __m256i t, __m256* orgba) {
+        const __m256i mask = _mm256_set1_epi32(0xff);
+        orgba[0] = _mm256_i32gather_ps(table, _mm256_and_si256(t, mask), 4);
+        orgba[1] = _mm256_i32gather_ps(table, _mm256_and_si256(_mm256_srli_epi32(t, 8), mask), 4);
+        orgba[2] = _mm256_i32gather_ps(table, _mm256_and_si256(_mm256_srli_epi32(t, 16), mask), 4);
+        orgba[3] = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(t, 24)), _mm256_set1_ps(1.0f / 255.0f));
+    }
+#elif defined(__AVX__)
+    // AVX has no integer gather. texels are fetched one lane at a time, channel major
+    inline void GatherTexels8(const CelTexels& tex, const int* idx, __m256* orgba) {
+        alignas(32) float rgba[4][CelStackKernel::kBatchSize];
+        for (int i = 0; i < CelStackKernel::kBatchSize; i++) {
+            float texel[4];
+            DecodeTexel(tex, tex.texels[idx[i]], texel);
+            rgba[0][i] = texel[0];
+            rgba[1][i] = texel[1];
+            rgba[2][i] = texel[2];
+            rgba[3][i] = texel[3];
+        }
+        for (int c = 0; c < 4; c++) {
+            orgba[c] = _mm256_load_ps(rgba[c]);
+        }
+    }
+#endif
+}
+
+//================
+void CelTexels::initWithTexture(const ImageTexture& tex) {
+    width = tex.width;
+    height = tex.height;
+
+    if (tex.getFormat() == ImageTexture::kRGBA8) {
+        const auto* table = tex.getDecodeTable();
+        for (int i = 0; i < 256; i++) {
+            decodeTable[i] = static_cast<float>(tex.isLinear ? table[i] : std::pow(table[i], tex.gamma));
+        }
+        texels = tex.getRGBA8Data();
+        convertedTexels.clear();
+        return;
+    }
+
+    // wider formats are encoded back to 8bit with gamma 2.2
+    const double gamma = 2.2;
+    for (int i = 0; i < 256; i++) {
+        decodeTable[i] = static_cast<float>(std::pow(i / 255.0, gamma));
+    }
+    auto encode = [gamma](RTColorType c) {
+        c = std::max(0.0, std::min(1.0, c));
+        return static_cast<uint32_t>(std::pow(c, 1.0 / gamma) * 255.0 + 0.5);
+    };
+    convertedTexels.resize(static_cast<size_t>(width) * height);
+    for (int iy = 0; iy < height; iy++) {
+        for (int ix = 0; ix < width; ix++) {
+            auto texel = tex.getTexel(ix, iy);
+            if (!tex.isLinear) {
+                texel.powRGB(tex.gamma);
+            }
+            uint32_t a = static_cast<uint32_t>(std::max(0.0, std::min(1.0, texel.a)) * 255.0 + 0.5);
+            convertedTexels[ix + static_cast<size_t>(iy) * width] = encode(texel.rgb.r) | (encode(texel.rgb.g) << 8) | (encode(texel.rgb.b) << 16) | (a << 24);
+        }
+    }
+    texels = convertedTexels.data();
+}
+
+//================
+void CelStackKernel::compositeScalar(const Plane* planes, int numplanes, const RayBatch& rays, Result* oresult) {
+    for (int i = 0; i < kBatchSize; i++) {
+        float r = 0.0f;
+        float g = 0.0f;
+        float b = 0.0f;
+        float alpha = (i < rays.count) ? 1.0f : 0.0f;
+
+        for (int ipln = 0; ipln < numplanes && alpha > 0.0f; ipln++) {
+            const auto& pln = planes[ipln];
+            const float fw = static_cast<float>(pln.texels->width);
+            const float fh = static_cast<float>(pln.texels->height);
+            // u * width
+            float x = (rays.ox[i] + rays.sx[i] * pln.z) * (pln.invWidth * fw) + fw * 0.5f;
+            float y = (rays.oy[i] + rays.sy[i] * pln.z) * (pln.invHeight * fh) + fh * 0.5f;
+
+            float texel[4];
+            SampleBilinear(*pln.texels, x, y, texel);
+            float w = texel[3] * alpha;
+            r += texel[0] * w;
+            g += texel[1] * w;
+            b += texel[2] * w;
+            alpha *= 1.0f - texel[3];
+        }
+
+        oresult->r[i] = r;
+        oresult->g[i] = g;
+        oresult->b[i] = b;
+        oresult->alpha[i] = alpha;
+    }
+}
+
+void CelStackKernel::composite(const Plane* planes, int numplanes, const RayBatch& rays, Result* oresult) {
+#if defined(__AVX2__)
+    static_assert(kBatchSize == 8, "AVX2 kernel is 8 lanes");
+
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256i ione = _mm256_set1_epi32(1);
+    const __m256i izero = _mm256_setzero_si256();
+
+    __m256 ox = _mm256_load_ps(rays.ox);
+    __m256 oy = _mm256_load_ps(rays.oy);
+    __m256 sx = _mm256_load_ps(rays.sx);
+    __m256 sy = _mm256_load_ps(rays.sy);
+
+    // unused lanes start opaque
+    __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256 alpha = _mm256_and_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(rays.count), lane)), one);
+    __m256 r = zero;
+    __m256 g = zero;
+    __m256 b = zero;
+
+    for (int ipln = 0; ipln < numplanes; ipln++) {
+        const auto& pln = planes[ipln];
+        const auto& tex = *pln.texels;
+        const float fw = static_cast<float>(tex.width);
+        const float fh = static_cast<float>(tex.height);
+
+        // texel space position. u * width
+        __m256 z = _mm256_set1_ps(pln.z);
+        __m256 x = _mm256_add_ps(_mm256_mul_ps(_mm256_add_ps(ox, _mm256_mul_ps(sx, z)), _mm256_set1_ps(pln.invWidth * fw)), _mm256_set1_ps(fw * 0.5f));
+        __m256 y = _mm256_add_ps(_mm256_mul_ps(_mm256_add_ps(oy, _mm256_mul_ps(sy, z)), _mm256_set1_ps(pln.invHeight * fh)), _mm256_set1_ps(fh * 0.5f));
+        x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-1.0f)), _mm256_set1_ps(fw));
+        y = _mm256_min_ps(_mm256_max_ps(y, _mm256_set1_ps(-1.0f)), _mm256_set1_ps(fh));
+        __m256 fx = _mm256_floor_ps(x);
+        __m256 fy = _mm256_floor_ps(y);
+        __m256 tx = _mm256_sub_ps(x, fx);
+        __m256 ty = _mm256_sub_ps(y, fy);
+        __m256i ix = _mm256_cvttps_epi32(fx);
+        __m256i iy = _mm256_cvttps_epi32(fy);
+
+        __m256i xmax = _mm256_set1_epi32(tex.width - 1);
+        __m256i ymax = _mm256_set1_epi32(tex.height - 1);
+        __m256i ix0 = _mm256_min_epi32(_mm256_max_epi32(ix, izero), xmax);
+        __m256i ix1 = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(ix, ione), izero), xmax);
+        __m256i iy0 = _mm256_min_epi32(_mm256_max_epi32(iy, izero), ymax);
+        __m256i iy1 = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(iy, ione), izero), ymax);
+
+        // indices of the 4 texels
+        __m256i stride = _mm256_set1_epi32(tex.width);
+        __m256i row0 = _mm256_mullo_epi32(iy0, stride);
+        __m256i row1 = _mm256_mullo_epi32(iy1, stride);
+        const int* base = reinterpret_cast<const int*>(tex.texels);
+        __m256 s00[4], s10[4], s01[4], s11[4];
+        DecodeTexel8(tex.decodeTable, _mm256_i32gather_epi32(base, _mm256_add_epi32(row0, ix0), 4), s00);
+        DecodeTexel8(tex.decodeTable, _mm256_i32gather_epi32(base, _mm256_add_epi32(row0, ix1), 4), s10);
+        DecodeTexel8(tex.decodeTable, _mm256_i32gather_epi32(base, _mm256_add_epi32(row1, ix0), 4), s01);
+        DecodeTexel8(tex.decodeTable, _mm256_i32gather_epi32(base, _mm256_add_epi32(row1, ix1), 4), s11);
+
+        __m256 texel[4];
+        for (int c = 0; c < 4; c++) {
+            __m256 s0 = _mm256_add_ps(s00[c], _mm256_mul_ps(_mm256_sub_ps(s10[c], s00[c]), tx));
+            __m256 s1 = _mm256_add_ps(s01[c], _mm256_mul_ps(_mm256_sub_ps(s11[c], s01[c]), tx));
+            texel[c] = _mm256_add_ps(s0, _mm256_mul_ps(_mm256_sub_ps(s1, s0), ty));
+        }
+
+        // opaque lanes add nothing, alpha stays 0
+        __m256 w = _mm256_mul_ps(texel[3], alpha);
+        r = _mm256_add_ps(r, _mm256_mul_ps(texel[0], w));
+        g = _mm256_add_ps(g, _mm256_mul_ps(texel[1], w));
+        b = _mm256_add_ps(b, _mm256_mul_ps(texel[2], w));
+        alpha = _mm256_mul_ps(alpha, _mm256_sub_ps(one, texel[3]));
+
+        if (_mm256_movemask_ps(_mm256_cmp_ps(alpha, zero, _CMP_GT_OQ)) == 0) {
+            break;
+        }
+    }
+
+    _mm256_store_ps(oresult->r, r);
+    _mm256_store_ps(oresult->g, g);
+    _mm256_store_ps(oresult->b, b);
+    _mm256_store_ps(oresult->alpha, alpha);
+#elif defined(__AVX__)
+    static_assert(kBatchSize == 8, "AVX kernel is 8 lanes");
+
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+
+    __m256 ox = _mm256_load_ps(rays.ox);
+    __m256 oy = _mm256_load_ps(rays.oy);
+    __m256 sx = _mm256_load_ps(rays.sx);
+    __m256 sy = _mm256_load_ps(rays.sy);
+
+    // unused lanes start opaque
+    __m256 lane = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+    __m256 alpha = _mm256_and_ps(_mm256_cmp_ps(lane, _mm256_set1_ps(static_cast<float>(rays.count)), _CMP_LT_OQ), one);
+    __m256 r = zero;
+    __m256 g = zero;
+    __m256 b = zero;
+
+    for (int ipln = 0; ipln < numplanes; ipln++) {
+        const auto& pln = planes[ipln];
+        const auto& tex = *pln.texels;
+        const float fw = static_cast<float>(tex.width);
+        const float fh = static_cast<float>(tex.height);
+
+        // texel space position. u * width
+        __m256 z = _mm256_set1_ps(pln.z);
+        __m256 x = _mm256_add_ps(_mm256_mul_ps(_mm256_add_ps(ox, _mm256_mul_ps(sx, z)), _mm256_set1_ps(pln.invWidth * fw)), _mm256_set1_ps(fw * 0.5f));
+        __m256 y = _mm256_add_ps(_mm256_mul_ps(_mm256_add_ps(oy, _mm256_mul_ps(sy, z)), _mm256_set1_ps(pln.invHeight * fh)), _mm256_set1_ps(fh * 0.5f));
+        x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-1.0f)), _mm256_set1_ps(fw));
+        y = _mm256_min_ps(_mm256_max_ps(y, _mm256_set1_ps(-1.0f)), _mm256_set1_ps(fh));
+        __m256 fx = _mm256_floor_ps(x);
+        __m256 fy = _mm256_floor_ps(y);
+        __m256 tx = _mm256_sub_ps(x, fx);
+        __m256 ty = _mm256_sub_ps(y, fy);
+
+        // clamp to edge while still float, AVX has no 8 lane integer min/max
+        __m256 xmax = _mm256_set1_ps(fw - 1.0f);
+        __m256 ymax = _mm256_set1_ps(fh - 1.0f);
+        __m256i ix0 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(fx, zero), xmax));
+        __m256i ix1 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_add_ps(fx, one), zero), xmax));
+        __m256i iy0 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(fy, zero), ymax));
+        __m256i iy1 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_add_ps(fy, one), zero), ymax));
+
+        // indices of the 4 texels
+        alignas(32) int cx0[kBatchSize], cx1[kBatchSize], cy0[kBatchSize], cy1[kBatchSize];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(cx0), ix0);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(cx1), ix1);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(cy0), iy0);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(cy1), iy1);
+        alignas(32) int i00[kBatchSize], i10[kBatchSize], i01[kBatchSize], i11[kBatchSize];
+        for (int i = 0; i < kBatchSize; i++) {
+            int row0 = cy0[i] * tex.width;
+            int row1 = cy1[i] * tex.width;
+            i00[i] = row0 + cx0[i];
+            i10[i] = row0 + cx1[i];
+            i01[i] = row1 + cx0[i];
+            i11[i] = row1 + cx1[i];
+        }
+        __m256 s00[4], s10[4], s01[4], s11[4];
+        GatherTexels8(tex, i00, s00);
+        GatherTexels8(tex, i10, s10);
+        GatherTexels8(tex, i01, s01);
+        GatherTexels8(tex, i11, s11);
+
+        __m256 texel[4];
+        for (int c = 0; c < 4; c++) {
+            __m256 s0 = _mm256_add_ps(s00[c], _mm256_mul_ps(_mm256_sub_ps(s10[c], s00[c]), tx));
+            __m256 s1 = _mm256_add_ps(s01[c], _mm256_mul_ps(_mm256_sub_ps(s11[c], s01[c]), tx));
+            texel[c] = _mm256_add_ps(s0, _mm256_mul_ps(_mm256_sub_ps(s1, s0), ty));
+        }
+
+        // opaque lanes add nothing, alpha stays 0
+        __m256 w = _mm256_mul_ps(texel[3], alpha);
+        r = _mm256_add_ps(r, _mm256_mul_ps(texel[0], w));
+        g = _mm256_add_ps(g, _mm256_mul_ps(texel[1], w));
+        b = _mm256_add_ps(b, _mm256_mul_ps(texel[2], w));
+        alpha = _mm256_mul_ps(alpha, _mm256_sub_ps(one, texel[3]));
+
+        if (_mm256_movemask_ps(_mm256_cmp_ps(alpha, zero, _CMP_GT_OQ)) == 0) {
+            break;
+        }
+    }
+
+    _mm256_store_ps(oresult->r, r);
+    _mm256_store_ps(oresult->g, g);
+    _mm256_store_ps(oresult->b, b);
+    _mm256_store_ps(oresult->alpha, alpha);
+#else
+    compositeScalar(planes, numplanes, rays, oresult);
+#endif
+}
+
+CelStackKernel::Path CelStackKernel::getPath() {
+#if defined(__AVX2__)
+    return Path::kAVX2;
+#elif defined(__AVX__)
+    return Path::kAVX;
+#else
+    return Path::kScalar;
+#endif
+}
@@ -0,0 +1,85 @@
+#ifndef PETALS_CELSTACK_H
+#define PETALS_CELSTACK_H
+
+#include <vector>
+#include <cstdint>
+
+#include "types.h"
+#include "ray.h"
+
+namespace Petals {
+
+    class ImageTexture;
+
+    // 8bit RGBA texels of a cel for the compositing kernel.
+    // shares the kRGBA8 storage of the texture, other formats are converted
+    class CelTexels {
+    public:
+        CelTexels() : width(0), height(0), texels(nullptr) {}
+        CelTexels(const CelTexels&) = delete;
+        CelTexels& operator=(const CelTexels&) = delete;
+
+        void initWithTexture(const ImageTexture& tex);
+
+        int width;
+        int height;
+        const uint32_t* texels;   // r in the low byte, top row first
+        float decodeTable[256];   // linear rgb of an 8bit value
+
+    private:
+        std::vector<uint32_t> convertedTexels;
+    };
+
+    // front to back compositing of a cel stack for a batch of rays.
+    // texels are bilinear with clamp wrap. planes are parallel to the camera at z
+    class CelStackKernel {
+    public:
+        static constexpr int kBatchSize = 8;
+
+        // composite implementation picked at build time
+        enum class Path
+        {
+            kScalar,
+            kAVX,  // 8 lanes, texels fetched per lane
+            kAVX2  // 8 lanes with gathers
+        };
+
+        struct Plane {
+            const CelTexels* texels;
+            float z;         // plane distance along the ray z. same sign as the ray
+            float invWidth;  // 1 / cel width [1/m]
+            float invHeight;
+        };
+
+        // ray i hits plane z at (ox + sx * z, oy + sy * z)
+        struct RayBatch {
+            alignas(32) float ox[kBatchSize];
+            alignas(32) float oy[kBatchSize];
+            alignas(32) float sx[kBatchSize]; // direction x / direction z
+            alignas(32) float sy[kBatchSize];
+            int count;
+
+            RayBatch() : count(0) {}
+            void set(int i, const Ray& ray) {
+                ox[i] = static_cast<float>(ray.origin.x);
+                oy[i] = static_cast<float>(ray.origin.y);
+                sx[i] = static_cast<float>(ray.direction.x / ray.direction.z);
+                sy[i] = static_cast<float>(ray.direction.y / ray.direction.z);
+            }
+        };
+
+        struct Result {
+            alignas(32) float r[kBatchSize];
+            alignas(32) float g[kBatchSize];
+            alignas(32) float b[kBatchSize];
+            alignas(32) float alpha[kBatchSize]; // transmittance left behind the stack
+        };
+
+        // stops when every ray of the batch is opaque
+        static void composite(const Plane* planes, int numplanes, const RayBatch& rays, Result* oresult);
+        static void compositeScalar(const Plane* planes, int numplanes, const RayBatch& rays, Result* oresult);
+        static Path getPath();
+    };
+}
+
+#endif
@@ -44,6 +44,11 @@ bool Config::load(const std::string& path) {
     samplesPerPixel = GetConfigValue<int>(jsonRoot, "samplesPerPixel", samplesPerPixel);
     pixelSubSamples = GetConfigValue<int>(jsonRoot, "pixelSubSamples", pixelSubSamples);
     
+    adaptiveNoiseTarget = GetConfigValue<double>(jsonRoot, "adaptiveNoiseTarget", adaptiveNoiseTarget);
+    adaptiveMinSamples = GetConfigValue<int>(jsonRoot, "adaptiveMinSamples", adaptiveMinSamples);
+    adaptivePassSamples = GetConfigValue<int>(jsonRoot, "adaptivePassSamples", adaptivePassSamples);
+    adaptiveMaxSamples = GetConfigValue<int>(jsonRoot, "adaptiveMaxSamples", adaptiveMaxSamples);
+    
     minDepth = GetConfigValue<int>(jsonRoot, "minDepth", minDepth);
     maxDepth = GetConfigValue<int>(jsonRoot, "maxDepth", maxDepth);
     minRussianRouletteCutOff = GetConfigValue<float>(jsonRoot, "minRussianRouletteCutOff", minRussianRouletteCutOff);
@@ -51,14 +56,23 @@ bool Config::load(const std::string& path) {
     framebufferStockCount = GetConfigValue<int>(jsonRoot, "framebufferStockCount", framebufferStockCount);
     tileSize = GetConfigValue<int>(jsonRoot, "tileSize", tileSize);
     scrambleTile = GetConfigValue<bool>(jsonRoot, "scrambleTile", scrambleTile);
+    pipelineFrames = GetConfigValue<bool>(jsonRoot, "pipelineFrames", pipelineFrames);
+    celCacheMB = GetConfigValue<int>(jsonRoot, "celCacheMB", celCacheMB);
     
     limitSec = GetConfigValue<double>(jsonRoot, "limitSec", limitSec);
     progressIntervalSec = GetConfigValue<double>(jsonRoot, "progressIntervalSec", progressIntervalSec);
     maxThreads = GetConfigValue<int>(jsonRoot, "maxThreads", maxThreads);
+    pinThreads = GetConfigValue<bool>(jsonRoot, "pinThreads", pinThreads);
+    numaAware = GetConfigValue<bool>(jsonRoot, "numaAware", numaAware);
     
     quietProgress = GetConfigValue<bool>(jsonRoot, "quietProgress", quietProgress);
     waitUntilFinish = GetConfigValue<bool>(jsonRoot, "waitUntilFinish", waitUntilFinish);
     
+    bvhBuilder = GetConfigValue<std::string>(jsonRoot, "bvhBuilder", bvhBuilder);
+    bvhMaxLeafSize = GetConfigValue<int>(jsonRoot, "bvhMaxLeafSize", bvhMaxLeafSize);
+    bvhRefitThreshold = GetConfigValue<double>(jsonRoot, "bvhRefitThreshold", bvhRefitThreshold);
+    bvhReport = GetConfigValue<bool>(jsonRoot, "bvhReport", bvhReport);
+    
     inputFile = GetConfigValue<std::string>(jsonRoot, "inputFile", inputFile);
     outputDir = GetConfigValue<std::string>(jsonRoot, "outputDir", outputDir);
     outputName = GetConfigValue<std::string>(jsonRoot, "outputName", outputName);
@@ -87,6 +101,15 @@ void Config::parseOptions(int argc, char* argv[]) {
         } else if(strcmp(v, "-j") == 0 && hasnext) {
             maxThreads = std::atoi(argv[i + 1]);
             i += 1;
+        } else if(strcmp(v, "-pin") == 0) {
+            pinThreads = true;
+        } else if(strcmp(v, "-numa") == 0) {
+            numaAware = true;
+        } else if(strcmp(v, "-pipe") == 0) {
+            pipelineFrames = true;
+        } else if(strcmp(v, "-cache") == 0 && hasnext) {
+            celCacheMB = std::atoi(argv[i + 1]);
+            i += 1;
         } else if(strcmp(v, "-w") == 0 && hasnext) {
             width = std::atoi(argv[i + 1]);
             i += 1;
@@ -108,6 +131,9 @@ void Config::parseOptions(int argc, char* argv[]) {
         } else if(strcmp(v, "-ss") == 0 && hasnext) {
             pixelSubSamples = std::atoi(argv[i + 1]);
             i += 1;
+        } else if(strcmp(v, "-nt") == 0 && hasnext) {
+            adaptiveNoiseTarget = std::atof(argv[i + 1]);
+            i += 1;
         } else if(strcmp(v, "-es") == 0 && hasnext) {
             std::string vv(argv[i + 1]);
             auto divi = vv.find('/');
@@ -128,6 +154,11 @@ void Config::parseOptions(int argc, char* argv[]) {
         } else if(strcmp(v, "-pi") == 0 && hasnext) {
             progressIntervalSec = std::atof(argv[i + 1]);
             i += 1;
+        } else if(strcmp(v, "-bvh") == 0 && hasnext) {
+            bvhBuilder = argv[i + 1];
+            i += 1;
+        } else if(strcmp(v, "-bvhreport") == 0) {
+            bvhReport = true;
         }
     }
 }
@@ -135,12 +166,14 @@ void Config::parseOptions(int argc, char* argv[]) {
 void Config::print() const {
     std::cout << "--- config dump ---" << "\n";
     std::cout << "frames:" << frames << ", start:" << startFrame << ", fps:" << framesPerSecond << "\n";
-    std::cout << "maxThreads:" << maxThreads << "\n";
+    std::cout << "maxThreads:" << maxThreads << ", pin:" << pinThreads << ", numa:" << numaAware << ", pipeline:" << pipelineFrames << "\n";
     std::cout << "limitSec:" << limitSec << ", limitMargin:" << limitMargin << "\n";
     std::cout << "spp:" << samplesPerPixel << ", sub:" << pixelSubSamples << "\n";
-    std::cout << "size:(" << width << "," << height << "), tileSize:" << tileSize << "\n";
+    std::cout << "adaptive noise:" << adaptiveNoiseTarget << ", min:" << adaptiveMinSamples << ", pass:" << adaptivePassSamples << ", max:" << adaptiveMaxSamples << "\n";
+    std::cout << "size:(" << width << "," << height << "), tileSize:" << tileSize << ", celCacheMB:" << celCacheMB << "\n";
     std::cout << "exposureSec:" << exposureSecond << ", slice:" << exposureSlice << "\n";
     std::cout << "depth min:" << minDepth << ", max:" << maxDepth << ", cutoff:" << minRussianRouletteCutOff << "\n";
+    std::cout << "bvh:" << bvhBuilder << ", maxLeafSize:" << bvhMaxLeafSize << ", refitThreshold:" << bvhRefitThreshold << "\n";
     std::cout << "input:" << inputFile << "\n";
     std::cout << "outputDir:" << outputDir << "\n";
     std::cout << "outputName:" << outputName << "*." << outputExt << "\n";
@@ -20,6 +20,12 @@ namespace Petals {
         int samplesPerPixel;
         int pixelSubSamples;
         
+        // adaptive sampling. enabled when noise target is positive
+        double adaptiveNoiseTarget; // relative standard error per pixel
+        int adaptiveMinSamples;
+        int adaptivePassSamples;
+        int adaptiveMaxSamples;     // pixels stop here even above the noise target
+        
         int minDepth;
         int maxDepth;
         float minRussianRouletteCutOff;
@@ -27,15 +33,24 @@ namespace Petals {
         int framebufferStockCount;
         int tileSize;
         bool scrambleTile;
+        bool pipelineFrames; // set up the next frame while rendering. doubles scene stores
+        int celCacheMB;      // decoded animstand cels kept for later frames
         
         double limitSec;
         double limitMargin;
         double progressIntervalSec;
         int maxThreads;
+        bool pinThreads;    // bind each worker to one CPU
+        bool numaAware;     // place tiles on NUMA nodes and prefer local tiles
         
         bool quietProgress;
         bool waitUntilFinish;
         
+        std::string bvhBuilder;
+        int bvhMaxLeafSize;
+        double bvhRefitThreshold;
+        bool bvhReport;
+        
         std::string inputFile;
         std::string outputDir;
         std::string outputName;
@@ -52,18 +67,30 @@ namespace Petals {
             exposureSlice(1),
             samplesPerPixel(4),
             pixelSubSamples(2),
+            adaptiveNoiseTarget(-1.0),
+            adaptiveMinSamples(16),
+            adaptivePassSamples(4),
+            adaptiveMaxSamples(1024),
             minDepth(1),
             maxDepth(4),
             minRussianRouletteCutOff(0.005f),
             framebufferStockCount(3),
             tileSize(64),
             scrambleTile(true),
+            pipelineFrames(false),
+            celCacheMB(2048),
             limitSec(-1.0),
             limitMargin(1.0),
             progressIntervalSec(-1.0),
             maxThreads(0),
+            pinThreads(false),
+            numaAware(false),
             quietProgress(false),
             waitUntilFinish(true),
+            bvhBuilder("sah"),
+            bvhMaxLeafSize(4),
+            bvhRefitThreshold(1.5),
+            bvhReport(false),
             inputFile(""),
             outputDir("output"),
             outputName("output"),
@@ -0,0 +1,98 @@
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <cstdlib>
+#include "cputopology.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace Petals;
+
+CpuTopology::CpuTopology() {
+    detect();
+}
+
+void CpuTopology::detect() {
+    nodeCpus.clear();
+
+#ifdef __linux__
+    for(int inode = 0; ; inode++) {
+        std::stringstream ss;
+        ss << "/sys/devices/system/node/node" << inode << "/cpulist";
+        std::ifstream fs(ss.str());
+        if(!fs.is_open()) {
+            break;
+        }
+        std::string line;
+        std::getline(fs, line);
+        auto cpus = parseCpuList(line);
+        if(!cpus.empty()) {
+            nodeCpus.push_back(cpus);
+        }
+    }
+#endif
+
+    if(nodeCpus.empty()) {
+        int numcpus = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        nodeCpus.resize(1);
+        for(int i = 0; i < numcpus; i++) {
+            nodeCpus[0].push_back(i);
+        }
+    }
+}
+
+int CpuTopology::getCpuCount() const {
+    int count = 0;
+    for(auto ite = nodeCpus.begin(); ite != nodeCpus.end(); ++ite) {
+        count += static_cast<int>(ite->size());
+    }
+    return count;
+}
+
+int CpuTopology::nodeForWorker(int workerid, int numworkers) const {
+    if(numworkers <= 0) {
+        return 0;
+    }
+    return static_cast<int>(static_cast<long>(workerid) * getNodeCount() / numworkers);
+}
+
+int CpuTopology::cpuForWorker(int workerid, int numworkers) const {
+    int node = nodeForWorker(workerid, numworkers);
+    // first worker of this node
+    int firstworker = (node * numworkers + getNodeCount() - 1) / getNodeCount();
+    const auto& cpus = nodeCpus[node];
+    return cpus[(workerid - firstworker) % cpus.size()];
+}
+
+std::vector<int> CpuTopology::parseCpuList(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while(std::getline(ss, range, ',')) {
+        if(range.empty() || range[0] < '0' || range[0] > '9') {
+            continue;
+        }
+        auto divi = range.find('-');
+        int first = std::atoi(range.c_str());
+        int last = (divi != std::string::npos) ? std::atoi(range.c_str() + divi + 1) : first;
+        for(int i = first; i <= last; i++) {
+            cpus.push_back(i);
+        }
+    }
+    return cpus;
+}
+
+bool CpuTopology::pinCurrentThread(int cpu) {
+#ifdef __linux__
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) == 0;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,33 @@
+#ifndef PETALS_CPUTOPOLOGY_H
+#define PETALS_CPUTOPOLOGY_H
+
+#include <vector>
+#include <string>
+
+namespace Petals {
+
+    // logical CPUs grouped by NUMA node. read from sysfs on Linux.
+    // other platforms (or no sysfs) report one node with hardware_concurrency CPUs.
+    class CpuTopology {
+    public:
+        std::vector<std::vector<int> > nodeCpus; // [node] -> cpu ids
+
+    public:
+        CpuTopology();
+
+        void detect();
+        int getNodeCount() const { return static_cast<int>(nodeCpus.size()); }
+        int getCpuCount() const;
+
+        // workers are split into contiguous blocks, one block per node
+        int cpuForWorker(int workerid, int numworkers) const;
+        int nodeForWorker(int workerid, int numworkers) const;
+
+        // "0-3,8,10-11" -> {0,1,2,3,8,10,11}
+        static std::vector<int> parseCpuList(const std::string& list);
+        // false when affinity is not supported
+        static bool pinCurrentThread(int cpu);
+    };
+}
+
+#endif
@@ -1,44 +1,49 @@
+#include <new>
+#include <type_traits>
 #include "framebuffer.h"
 using namespace Petals;
 
-FrameBuffer::FrameBuffer(int w, int h, int tsize):
+namespace {
+    // tile regions start on their own pages as much as possible
+    const size_t kBufferAlignment = 4096;
+}
+
+FrameBuffer::FrameBuffer(int w, int h, int tsize, bool deferinit):
     width(w),
     height(h),
     tileSize(tsize)
 {
-    buffer = new Pixel[width * height];
+    // raw storage. pixels are constructed by initializeTiles
+    buffer = static_cast<Pixel*>(::operator new(sizeof(Pixel) * width * height, std::align_val_t(kBufferAlignment)));
     
     tileCols = (width + tsize -1) / tsize;
     tileRows = (height + tsize -1) / tsize;
     
     tiles = new Tile[tileCols * tileRows];
-    int bufoffset = 0;
-    for(int ty = 0; ty < tileRows; ty++) {
-        for(int tx = 0; tx < tileCols; tx++) {
-            int ti = tx + ty * tileCols;
-            Tile *tile = &tiles[ti];
-            
-            tile->startx = tx * tileSize;
-            tile->endx = std::min(width, tile->startx + tileSize);
-            tile->starty = ty * tileSize;
-            tile->endy = std::min(height, tile->starty + tileSize);
-            
-            tile->width = tile->endx - tile->startx;
-            tile->height = tile->endy - tile->starty;
-            
-            tile->bufferStart = bufoffset;
-            bufoffset += tile->width * tile->height;
-        }
-    }
+    layoutTiles(width, height, tileSize, tiles);
     
-    clear();
+    if(!deferinit) {
+        initializeTiles(0, tileCols * tileRows);
+    }
 }
 
 FrameBuffer::~FrameBuffer() {
-    delete [] buffer;
+    static_assert(std::is_trivially_destructible<Pixel>::value, "pixels are released without destructor");
+    ::operator delete(buffer, std::align_val_t(kBufferAlignment));
     delete [] tiles;
 }
 
+void FrameBuffer::initializeTiles(int starttile, int endtile) {
+    for(int it = starttile; it < endtile; it++) {
+        const Tile& tile = tiles[it];
+        int bufend = tile.bufferStart + tile.width * tile.height;
+        for(int i = tile.bufferStart; i < bufend; i++) {
+            new (&buffer[i]) Pixel();
+            buffer[i].clear();
+        }
+    }
+}
+
 void FrameBuffer::clear() {
     int buflen = width * height;
     for(int i = 0; i < buflen; i++) {
@@ -82,6 +87,29 @@ FrameBuffer::Pixel& FrameBuffer::getPixel(int x, int y) const {
     return buffer[i];
 }
 
+void FrameBuffer::layoutTiles(int w, int h, int tsize, Tile* otiles) {
+    int tilecols = (w + tsize -1) / tsize;
+    int tilerows = (h + tsize -1) / tsize;
+    int bufoffset = 0;
+    for(int ty = 0; ty < tilerows; ty++) {
+        for(int tx = 0; tx < tilecols; tx++) {
+            int ti = tx + ty * tilecols;
+            Tile *tile = &otiles[ti];
+            
+            tile->startx = tx * tsize;
+            tile->endx = std::min(w, tile->startx + tsize);
+            tile->starty = ty * tsize;
+            tile->endy = std::min(h, tile->starty + tsize);
+            
+            tile->width = tile->endx - tile->startx;
+            tile->height = tile->endy - tile->starty;
+            
+            tile->bufferStart = bufoffset;
+            bufoffset += tile->width * tile->height;
+        }
+    }
+}
+
 int FrameBuffer::positionToBufferIndex(int x, int y) const {
     int tilex = x / tileSize;
     int tiley = y / tileSize;
@@ -95,3 +123,19 @@ int FrameBuffer::positionToBufferIndex(int x, int y) const {
     
     return tile.bufferStart + subindex;
 }
+
+// CompactFrameBuffer
+CompactFrameBuffer::CompactFrameBuffer(int w, int h, int tsize):
+    buffer(w * h),
+    width(w),
+    height(h)
+{
+    int numtiles = ((w + tsize -1) / tsize) * ((h + tsize -1) / tsize);
+    tiles.resize(numtiles);
+    FrameBuffer::layoutTiles(width, height, tsize, tiles.data());
+    clear();
+}
+
+void CompactFrameBuffer::clear() {
+    std::fill(buffer.begin(), buffer.end(), Pixel{0.0f, 0.0f, 0.0f});
+}
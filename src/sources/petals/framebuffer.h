@@ -1,6 +1,9 @@
 #ifndef PETALS_FRAMEBUFFER_H
 #define PETALS_FRAMEBUFFER_H
 
+#include <cmath>
+#include <algorithm>
+#include <vector>
 #include "types.h"
 
 namespace Petals {
@@ -11,25 +14,53 @@ namespace Petals {
         struct Pixel {
             Color accumulatedColor;
             int sampleCount;
+            // luminance moments for adaptive sampling
+            RTFloat luminanceSum;
+            RTFloat luminanceSquaredSum;
             
             void clear() {
                 accumulatedColor.set(0.0, 0.0, 0.0);
                 sampleCount = 0;
+                luminanceSum = 0.0;
+                luminanceSquaredSum = 0.0;
             }
             
             void accumulate(const Color& c) {
                 accumulatedColor += c;
                 sampleCount += 1;
+                RTFloat l = luminance(c);
+                luminanceSum += l;
+                luminanceSquaredSum += l * l;
             }
             
             void setColor(const Color& c) {
                 accumulatedColor = c;
                 sampleCount = 1;
+                luminanceSum = luminance(c);
+                luminanceSquaredSum = luminanceSum * luminanceSum;
             }
             
             Color getColor() {
                 return accumulatedColor / sampleCount;
             }
+            
+            // standard error of the mean luminance relative to the mean.
+            // dark pixels are measured against kDarkLuminance to not chase noise nobody sees
+            RTFloat getRelativeError() const {
+                if(sampleCount < 2) {
+                    return kINF;
+                }
+                RTFloat n = static_cast<RTFloat>(sampleCount);
+                RTFloat mean = luminanceSum / n;
+                RTFloat variance = std::max(0.0, luminanceSquaredSum / n - mean * mean) * n / (n - 1.0);
+                return std::sqrt(variance / n) / std::max(mean, kDarkLuminance);
+            }
+            
+            static RTFloat luminance(const Color& c) {
+                return c.r * 0.2126 + c.g * 0.7152 + c.b * 0.0722;
+            }
+            
+            static constexpr RTFloat kDarkLuminance = 0.01;
         };
         
         struct LayeredPixel {
@@ -59,10 +90,14 @@ namespace Petals {
         };
         
     public:
-        FrameBuffer(int w, int h, int tsize);
+        // deferinit: pixels are left untouched until initializeTiles,
+        // so pages are placed on the NUMA node of the thread that first writes them
+        FrameBuffer(int w, int h, int tsize, bool deferinit = false);
         ~FrameBuffer();
         
         void clear();
+        // construct and clear tiles [starttile, endtile)
+        void initializeTiles(int starttile, int endtile);
         
         // buffer offset
         void accumulate(int i, const Color& col);
@@ -84,6 +119,9 @@ namespace Petals {
         int getNumTiles() const { return tileCols * tileRows; }
         const Tile& getTile(int i) const { return tiles[i]; }
         
+        // tile rects of w x h in tsize squares. otiles holds ceil(w/tsize) * ceil(h/tsize)
+        static void layoutTiles(int w, int h, int tsize, Tile* otiles);
+        
     private:
         Pixel *buffer;
         Tile *tiles;
@@ -96,6 +134,42 @@ namespace Petals {
         int positionToBufferIndex(int x, int y) const;
     };
     
+    // float RGB sums without sample statistics. 12 bytes per pixel against 48 of FrameBuffer::Pixel.
+    // row major. tiles are for splitting work
+    class CompactFrameBuffer {
+    public:
+        struct Pixel {
+            float r, g, b;
+        };
+        
+    public:
+        CompactFrameBuffer(int w, int h, int tsize);
+        
+        void clear();
+        void accumulate(int x, int y, const Color& col) {
+            Pixel& p = buffer[x + y * width];
+            p.r += static_cast<float>(col.r);
+            p.g += static_cast<float>(col.g);
+            p.b += static_cast<float>(col.b);
+        }
+        Color getColor(int x, int y) const {
+            const Pixel& p = buffer[x + y * width];
+            return Color(p.r, p.g, p.b);
+        }
+        
+        int getWidth() const { return width; }
+        int getHeight() const { return height; }
+        int getNumTiles() const { return static_cast<int>(tiles.size()); }
+        const FrameBuffer::Tile& getTile(int i) const { return tiles[i]; }
+        size_t getBufferBytes() const { return buffer.size() * sizeof(Pixel); }
+        
+    private:
+        std::vector<Pixel> buffer;
+        std::vector<FrameBuffer::Tile> tiles;
+        int width;
+        int height;
+    };
+    
     
 }
 
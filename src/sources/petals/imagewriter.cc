@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <cmath>
+#include <stb/stb_image_write.h>
+
+#include "imagewriter.h"
+#include "framebuffer.h"
+
+using namespace Petals;
+
+namespace {
+    template<typename BufferType>
+    void EncodeRGB8(const BufferType& fb, double gamma, ImageWriter::Request* oreq) {
+        int w = fb.getWidth();
+        int h = fb.getHeight();
+        oreq->width = w;
+        oreq->height = h;
+        oreq->rgb8.resize(w * h * 3);
+
+        auto encodeTo8byte = [](RTColorType c, double gamma) {
+            c = std::max(0.0, std::min(1.0, c));
+            c = pow(c, 1.0 / gamma);
+            return static_cast<unsigned char>(std::max(0.0, std::min(255.0, c * 256.0)));
+        };
+
+        for(int iy = 0; iy < h; iy++) {
+            for(int ix = 0; ix < w; ix++) {
+                int ipxl = (ix + (h - iy - 1) * w) * 3;
+                Color col = fb.getColor(ix, iy);
+                oreq->rgb8[ipxl + 0] = encodeTo8byte(col.r, gamma);
+                oreq->rgb8[ipxl + 1] = encodeTo8byte(col.g, gamma);
+                oreq->rgb8[ipxl + 2] = encodeTo8byte(col.b, gamma);
+            }
+        }
+    }
+}
+
+ImageWriter::ImageWriter() :
+    writingCount(0),
+    stopWriter(false)
+{
+    writerThread = std::thread(&ImageWriter::writerMain, this);
+}
+
+ImageWriter::~ImageWriter() {
+    flush();
+    {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        stopWriter = true;
+    }
+    writerCondition.notify_all();
+    writerThread.join();
+}
+
+void ImageWriter::submit(Request&& req) {
+    {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        requests.push_back(std::move(req));
+    }
+    writerCondition.notify_one();
+}
+
+void ImageWriter::flush() {
+    std::unique_lock<std::mutex> lock(queueMutex);
+    flushCondition.wait(lock, [this]{ return requests.empty() && writingCount == 0; });
+}
+
+void ImageWriter::writerMain() {
+    std::unique_lock<std::mutex> lock(queueMutex);
+    while(true) {
+        writerCondition.wait(lock, [this]{ return stopWriter || !requests.empty(); });
+        if(requests.empty()) {
+            // stopped
+            break;
+        }
+
+        Request req = std::move(requests.front());
+        requests.pop_front();
+        writingCount += 1;
+        lock.unlock();
+
+        if(req.encode) {
+            req.encode(&req);
+        }
+        bool saved = writeImage(req);
+        if(req.onFinished) {
+            req.onFinished(saved);
+        }
+
+        lock.lock();
+        writingCount -= 1;
+        flushCondition.notify_all();
+    }
+}
+
+void ImageWriter::encodeRGB8(const FrameBuffer& fb, double gamma, Request* oreq) {
+    EncodeRGB8(fb, gamma, oreq);
+}
+
+void ImageWriter::encodeRGB8(const CompactFrameBuffer& fb, double gamma, Request* oreq) {
+    EncodeRGB8(fb, gamma, oreq);
+}
+
+bool ImageWriter::writeImage(const Request& req) {
+    const auto& path = req.path;
+    auto l = path.length();
+    int saved = 0;
+    if(l > 4 && path[l-4] == '.' && path[l-3] == 'j' && path[l-2] == 'p' && path[l-1] == 'g') {
+        saved = stbi_write_jpg(path.c_str(), req.width, req.height, 3, req.rgb8.data(), 80);
+    } else {
+        saved = stbi_write_png(path.c_str(), req.width, req.height, 3, req.rgb8.data(), 0);
+    }
+    return saved != 0;
+}
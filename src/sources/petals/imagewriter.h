@@ -0,0 +1,57 @@
+#ifndef PETALS_IMAGEWRITER_H
+#define PETALS_IMAGEWRITER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+namespace Petals {
+
+    class FrameBuffer;
+    class CompactFrameBuffer;
+
+    // encodes, compresses and writes 8bit images on its own thread.
+    // submit never blocks. callers bound the queue by the framebuffers they hand over
+    class ImageWriter {
+    public:
+        struct Request {
+            std::string path; // .jpg or png
+            int width;
+            int height;
+            std::vector<unsigned char> rgb8; // top row first
+            std::function<void(Request*)> encode; // fills rgb8 on the writer thread. can be empty
+            std::function<void(bool)> onFinished; // called on the writer thread. can be empty
+        };
+
+    public:
+        ImageWriter();
+        ~ImageWriter();
+
+        void submit(Request&& req);
+        // waits until every submitted image is written
+        void flush();
+
+        // gamma encode. bottom row of fb becomes the first row
+        static void encodeRGB8(const FrameBuffer& fb, double gamma, Request* oreq);
+        static void encodeRGB8(const CompactFrameBuffer& fb, double gamma, Request* oreq);
+        // synchronous write on the calling thread
+        static bool writeImage(const Request& req);
+
+    private:
+        std::deque<Request> requests;
+        int writingCount;
+        bool stopWriter;
+        std::mutex queueMutex;
+        std::condition_variable writerCondition;
+        std::condition_variable flushCondition; // queue drained
+        std::thread writerThread;
+
+        void writerMain();
+    };
+}
+
+#endif
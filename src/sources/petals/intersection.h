@@ -23,6 +23,7 @@ namespace Petals {
     /////
     struct SceneIntersection {
         int tracableId;
+        int storeId; // scene store the ray was traced in
         MeshIntersection meshIntersect;
     };
 
@@ -0,0 +1,128 @@
+#include <algorithm>
+#include <memory>
+#include "jobsystem.h"
+
+using namespace Petals;
+
+namespace {
+    std::unique_ptr<JobSystem> sharedJobSystem;
+    std::mutex sharedMutex;
+
+    JobSystem* CreateJobSystem(int numthreads) {
+        if(numthreads <= 0) {
+            numthreads = std::thread::hardware_concurrency();
+        }
+        return new JobSystem(std::max(0, numthreads - 1));
+    }
+}
+
+JobSystem::JobSystem(int numworkers):
+    stopWorkers(false)
+{
+    workerPool.reserve(std::max(0, numworkers));
+    for(int i = 0; i < numworkers; i++) {
+        workerPool.emplace_back(&JobSystem::workerMain, this);
+    }
+}
+
+JobSystem::~JobSystem() {
+    {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        stopWorkers = true;
+    }
+    workerCondition.notify_all();
+
+    for(size_t i = 0; i < workerPool.size(); i++) {
+        workerPool[i].join();
+    }
+    workerPool.clear();
+}
+
+void JobSystem::submit(TaskGroup* group, Job job) {
+    group->pendingCount += 1;
+    if(workerPool.empty()) {
+        // serial execution
+        Entry entry = { group, std::move(job) };
+        runEntry(entry);
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        jobQueue.push_back({ group, std::move(job) });
+    }
+    workerCondition.notify_one();
+}
+
+void JobSystem::wait(TaskGroup* group) {
+    std::unique_lock<std::mutex> lock(queueMutex);
+    while(!group->isDone()) {
+        if(!jobQueue.empty()) {
+            // newest first. it is likely a part of the awaited work
+            Entry entry = std::move(jobQueue.back());
+            jobQueue.pop_back();
+            lock.unlock();
+            runEntry(entry);
+            lock.lock();
+        } else {
+            waiterCondition.wait(lock, [this, group]{ return group->isDone() || !jobQueue.empty(); });
+        }
+    }
+}
+
+void JobSystem::parallelFor(int count, const std::function<void(int)>& func) {
+    if(count <= 1 || workerPool.empty()) {
+        for(int i = 0; i < count; i++) {
+            func(i);
+        }
+        return;
+    }
+
+    TaskGroup group;
+    for(int i = 1; i < count; i++) {
+        submit(&group, [&func, i]{ func(i); });
+    }
+    func(0);
+    wait(&group);
+}
+
+void JobSystem::workerMain() {
+    std::unique_lock<std::mutex> lock(queueMutex);
+    while(true) {
+        workerCondition.wait(lock, [this]{ return stopWorkers || !jobQueue.empty(); });
+        if(stopWorkers) {
+            break;
+        }
+
+        Entry entry = std::move(jobQueue.front());
+        jobQueue.pop_front();
+        lock.unlock();
+        runEntry(entry);
+        lock.lock();
+    }
+}
+
+void JobSystem::runEntry(Entry& entry) {
+    entry.job();
+
+    // decrement under lock so a waiter can not miss the notification
+    {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        entry.group->pendingCount -= 1;
+    }
+    waiterCondition.notify_all();
+}
+
+void JobSystem::setupShared(int numthreads) {
+    std::unique_lock<std::mutex> lock(sharedMutex);
+    sharedJobSystem.reset();
+    sharedJobSystem = std::unique_ptr<JobSystem>(CreateJobSystem(numthreads));
+}
+
+JobSystem& JobSystem::shared() {
+    std::unique_lock<std::mutex> lock(sharedMutex);
+    if(!sharedJobSystem) {
+        sharedJobSystem = std::unique_ptr<JobSystem>(CreateJobSystem(0));
+    }
+    return *sharedJobSystem;
+}
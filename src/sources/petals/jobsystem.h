@@ -0,0 +1,65 @@
+#ifndef PETALS_JOBSYSTEM_H
+#define PETALS_JOBSYSTEM_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+namespace Petals {
+
+    // shared worker threads for setup work (BVH builds, mesh preprocess).
+    // the waiting thread runs queued jobs too, so jobs may submit and wait nested jobs.
+    class JobSystem {
+    public:
+        typedef std::function<void()> Job;
+
+        class TaskGroup {
+        public:
+            TaskGroup(): pendingCount(0) {}
+            bool isDone() const { return pendingCount.load() == 0; }
+        private:
+            friend class JobSystem;
+            std::atomic<int> pendingCount;
+        };
+
+    public:
+        // numworkers: threads besides the caller. 0 runs everything on the caller
+        JobSystem(int numworkers);
+        ~JobSystem();
+
+        int workerCount() const { return static_cast<int>(workerPool.size()); }
+
+        void submit(TaskGroup* group, Job job);
+        // runs queued jobs until all jobs of group finished
+        void wait(TaskGroup* group);
+
+        // func(i) for i in [0, count). blocks until all done
+        void parallelFor(int count, const std::function<void(int)>& func);
+
+        // numthreads includes the caller. 0: hardware_concurrency
+        static void setupShared(int numthreads);
+        static JobSystem& shared();
+
+    private:
+        struct Entry {
+            TaskGroup* group;
+            Job job;
+        };
+
+        std::vector<std::thread> workerPool;
+        std::deque<Entry> jobQueue;
+        std::mutex queueMutex;
+        std::condition_variable workerCondition;
+        std::condition_variable waiterCondition;
+        bool stopWorkers;
+
+        void workerMain();
+        void runEntry(Entry& entry);
+    };
+}
+
+#endif
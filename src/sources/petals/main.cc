@@ -8,6 +8,7 @@
 #include <petals/config.h>
 #include <petals/postprocessor.h>
 #include <petals/animstand.h>
+#include <petals/jobsystem.h>
 
 #include "sceneloader.h"
 
@@ -23,6 +24,9 @@ int main(int argc, char* argv[])
     if(argc > 1) {
         config.parseOptions(argc, argv);
     }
+    
+    // setup jobs (BVH builds) share the same thread count
+    Petals::JobSystem::setupShared(config.maxThreads);
 
 #if 0
     config.print();
@@ -65,6 +69,9 @@ int main(int argc, char* argv[])
         // config
         animstand->maxThreads = config.maxThreads;
         animstand->limitSec = config.limitSec;
+        animstand->limitMargin = config.limitMargin;
+        animstand->framebufferStockCount = config.framebufferStockCount;
+        animstand->celCacheMB = config.celCacheMB;
 
         std::cout << "start rendering" << std::endl;
         animstand->render();
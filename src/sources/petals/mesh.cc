@@ -5,6 +5,8 @@
 //  Created by SatoruNAKAJIMA on 2019/08/16.
 //
 
+#include <cstdint>
+#include <type_traits>
 #include "node.h"
 #include "mesh.h"
 #include "bvh.h"
@@ -67,10 +69,7 @@ int Mesh::Cluster::attributeCount(AttributeId i) const {
 
 
 void Mesh::Triangle::initialize(const Vector3& va, const Vector3& vb, const Vector3& vc) {
-    pa = va;
-    edgeab = vb - va;
-    edgeac = vc - va;
-    Vector3 n = Vector3::cross(edgeab, edgeac);
+    Vector3 n = Vector3::cross(vb - va, vc - va);
     RTFloat nl = n.length();
     normal = n / std::max(1e-8, nl);
     area = nl;
@@ -80,24 +79,237 @@ void Mesh::Triangle::initialize(const Vector3& va, const Vector3& vb, const Vect
     bound.expand(vc);
 }
 
-RTFloat Mesh::Triangle::intersection(const Ray& ray, RTFloat nearhit, RTFloat farhit, RTFloat *obb, RTFloat *obc) const
+// watertight ray/triangle test (Woop et al. 2013). no gaps or double hits on shared edges
+Mesh::ShearedRay::ShearedRay(const Ray& ray) {
+    // permute so that z is the largest direction component
+    kz = 0;
+    RTFloat maxd = std::abs(ray.direction.x);
+    if(std::abs(ray.direction.y) > maxd) { kz = 1; maxd = std::abs(ray.direction.y); }
+    if(std::abs(ray.direction.z) > maxd) { kz = 2; }
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+    if(ray.direction.v[kz] < 0.0) {
+        std::swap(kx, ky);
+    }
+    
+    sz = static_cast<RTGeomFloat>(1.0 / ray.direction.v[kz]);
+    sx = static_cast<RTGeomFloat>(ray.direction.v[kx]) * sz;
+    sy = static_cast<RTGeomFloat>(ray.direction.v[ky]) * sz;
+    origin.set(static_cast<RTGeomFloat>(ray.origin.x), static_cast<RTGeomFloat>(ray.origin.y), static_cast<RTGeomFloat>(ray.origin.z));
+}
+
+namespace {
+    // a, b, c: vertices relative to ray origin
+    RTFloat WatertightHit(const Mesh::ShearedRay& sray, const GeomVector3& a, const GeomVector3& b, const GeomVector3& c, RTFloat nearhit, RTFloat farhit, RTFloat *obb, RTFloat *obc) {
+        const int kx = sray.kx;
+        const int ky = sray.ky;
+        const int kz = sray.kz;
+        
+        // sheared to ray space
+        const RTGeomFloat ax = a.v[kx] - sray.sx * a.v[kz];
+        const RTGeomFloat ay = a.v[ky] - sray.sy * a.v[kz];
+        const RTGeomFloat bx = b.v[kx] - sray.sx * b.v[kz];
+        const RTGeomFloat by = b.v[ky] - sray.sy * b.v[kz];
+        const RTGeomFloat cx = c.v[kx] - sray.sx * c.v[kz];
+        const RTGeomFloat cy = c.v[ky] - sray.sy * c.v[kz];
+        
+        // scaled barycentrics. recompute in double on edges
+        RTFloat u = cx * by - cy * bx;
+        RTFloat v = ax * cy - ay * cx;
+        RTFloat w = bx * ay - by * ax;
+        if(sizeof(RTGeomFloat) < sizeof(RTFloat) && (u == 0.0 || v == 0.0 || w == 0.0)) {
+            u = RTFloat(cx) * RTFloat(by) - RTFloat(cy) * RTFloat(bx);
+            v = RTFloat(ax) * RTFloat(cy) - RTFloat(ay) * RTFloat(cx);
+            w = RTFloat(bx) * RTFloat(ay) - RTFloat(by) * RTFloat(ax);
+        }
+        
+        if((u < 0.0 || v < 0.0 || w < 0.0) && (u > 0.0 || v > 0.0 || w > 0.0)) {
+            return -1.0;
+        }
+        RTFloat det = u + v + w;
+        if(det == 0.0) {
+            return -1.0;
+        }
+        
+        const RTFloat az = RTFloat(sray.sz) * RTFloat(a.v[kz]);
+        const RTFloat bz = RTFloat(sray.sz) * RTFloat(b.v[kz]);
+        const RTFloat cz = RTFloat(sray.sz) * RTFloat(c.v[kz]);
+        RTFloat rcpdet = 1.0 / det;
+        RTFloat t = (u * az + v * bz + w * cz) * rcpdet;
+        
+        if((t < nearhit) || (t > farhit)) {
+            return -1.0;
+        }
+        
+        if(obb != nullptr) { *obb = v * rcpdet; }
+        if(obc != nullptr) { *obc = w * rcpdet; }
+        return t;
+    }
+}
+
+//
+Mesh::TriangleVertices::TriangleVertices(const Vector3& va, const Vector3& vb, const Vector3& vc) {
+    pa.set(static_cast<RTGeomFloat>(va.x), static_cast<RTGeomFloat>(va.y), static_cast<RTGeomFloat>(va.z));
+    pb.set(static_cast<RTGeomFloat>(vb.x), static_cast<RTGeomFloat>(vb.y), static_cast<RTGeomFloat>(vb.z));
+    pc.set(static_cast<RTGeomFloat>(vc.x), static_cast<RTGeomFloat>(vc.y), static_cast<RTGeomFloat>(vc.z));
+}
+
+RTFloat Mesh::TriangleVertices::intersection(const Ray& ray, RTFloat nearhit, RTFloat farhit, RTFloat *obb, RTFloat *obc) const
+{
+    return intersection(ShearedRay(ray), nearhit, farhit, obb, obc);
+}
+
+RTFloat Mesh::TriangleVertices::intersection(const ShearedRay& sray, RTFloat nearhit, RTFloat farhit, RTFloat *obb, RTFloat *obc) const
 {
-    Vector3 r = ray.origin - pa;
-    Vector3 u = Vector3::cross(ray.direction, edgeac);
-    Vector3 v = Vector3::cross(r, edgeab);
+    return WatertightHit(sray, pa - sray.origin, pb - sray.origin, pc - sray.origin, nearhit, farhit, obb, obc);
+}
+
+//
+void Mesh::TrianglePacket::setTriangle(int lane, int clsid, int triid, const TriangleVertices& verts) {
+    const GeomVector3* p[3] = { &verts.pa, &verts.pb, &verts.pc };
+    for(int iv = 0; iv < 3; iv++) {
+        for(int a = 0; a < 3; a++) {
+            vertices[iv][a][lane] = p[iv]->v[a];
+        }
+    }
+    clusterId[lane] = clsid;
+    triangleId[lane] = triid;
+}
+
+namespace {
+    // edge functions and distance for all lanes. straight lane loops for the vectorizer
+    struct PacketHits {
+        alignas(32) RTGeomFloat u[Mesh::kTrianglePacketWidth];
+        alignas(32) RTGeomFloat v[Mesh::kTrianglePacketWidth];
+        alignas(32) RTGeomFloat w[Mesh::kTrianglePacketWidth];
+        alignas(32) RTGeomFloat t[Mesh::kTrianglePacketWidth]; // scaled by det
+        // same width as RTGeomFloat so that all lanes fit one register
+        alignas(32) std::conditional<sizeof(RTGeomFloat) == 8, int64_t, int32_t>::type valid[Mesh::kTrianglePacketWidth];
+    };
+    
+    void ComputePacketHits(const Mesh::TrianglePacket& pkt, const Mesh::ShearedRay& sray, RTFloat nearhit, RTFloat farhit, PacketHits* ohits) {
+        constexpr int W = Mesh::kTrianglePacketWidth;
+        const RTGeomFloat ox = sray.origin.v[sray.kx];
+        const RTGeomFloat oy = sray.origin.v[sray.ky];
+        const RTGeomFloat oz = sray.origin.v[sray.kz];
+        const RTGeomFloat sx = sray.sx;
+        const RTGeomFloat sy = sray.sy;
+        const RTGeomFloat sz = sray.sz;
+        const RTGeomFloat tnear = static_cast<RTGeomFloat>(nearhit);
+        const RTGeomFloat tfar = static_cast<RTGeomFloat>(farhit);
+        
+        const RTGeomFloat* pax = pkt.vertices[0][sray.kx];
+        const RTGeomFloat* pay = pkt.vertices[0][sray.ky];
+        const RTGeomFloat* paz = pkt.vertices[0][sray.kz];
+        const RTGeomFloat* pbx = pkt.vertices[1][sray.kx];
+        const RTGeomFloat* pby = pkt.vertices[1][sray.ky];
+        const RTGeomFloat* pbz = pkt.vertices[1][sray.kz];
+        const RTGeomFloat* pcx = pkt.vertices[2][sray.kx];
+        const RTGeomFloat* pcy = pkt.vertices[2][sray.ky];
+        const RTGeomFloat* pcz = pkt.vertices[2][sray.kz];
+        
+        for(int i = 0; i < W; i++) {
+            const RTGeomFloat az = paz[i] - oz;
+            const RTGeomFloat bz = pbz[i] - oz;
+            const RTGeomFloat cz = pcz[i] - oz;
+            const RTGeomFloat ax = (pax[i] - ox) - sx * az;
+            const RTGeomFloat ay = (pay[i] - oy) - sy * az;
+            const RTGeomFloat bx = (pbx[i] - ox) - sx * bz;
+            const RTGeomFloat by = (pby[i] - oy) - sy * bz;
+            const RTGeomFloat cx = (pcx[i] - ox) - sx * cz;
+            const RTGeomFloat cy = (pcy[i] - oy) - sy * cz;
+            
+            const RTGeomFloat u = cx * by - cy * bx;
+            const RTGeomFloat v = ax * cy - ay * cx;
+            const RTGeomFloat w = bx * ay - by * ax;
+            const RTGeomFloat det = u + v + w;
+            const RTGeomFloat tnum = (u * az + v * bz + w * cz) * sz;
+            
+            // range test without division. t = tnum / det
+            const RTGeomFloat absdet = std::abs(det);
+            const RTGeomFloat abstnum = (det < 0) ? -tnum : tnum;
+            
+            // bitwise ops keep the loop branch free
+            const RTGeomFloat minuvw = std::min(std::min(u, v), w);
+            const RTGeomFloat maxuvw = std::max(std::max(u, v), w);
+            typedef std::remove_reference<decltype(ohits->valid[0])>::type MaskInt;
+            const MaskInt inside = MaskInt(minuvw >= 0) | MaskInt(maxuvw <= 0);
+            ohits->u[i] = u;
+            ohits->v[i] = v;
+            ohits->w[i] = w;
+            ohits->t[i] = tnum;
+            ohits->valid[i] = inside & MaskInt(absdet != 0) & MaskInt(abstnum >= tnear * absdet) & MaskInt(abstnum <= tfar * absdet);
+        }
+    }
     
-    RTFloat div = 1.0 / Vector3::dot(u, edgeab);
-    RTFloat t = Vector3::dot(v, edgeac) * div;
-    RTFloat b = Vector3::dot(u, r) * div;
-    RTFloat c = Vector3::dot(v, ray.direction) * div;
+    // lanes on an edge are redone by the scalar test in double
+    bool IsPacketEdgeLane(const PacketHits& hits, int i) {
+        return sizeof(RTGeomFloat) < sizeof(RTFloat) && (hits.u[i] == 0 || hits.v[i] == 0 || hits.w[i] == 0);
+    }
+    
+    RTFloat PacketLaneHit(const Mesh::TrianglePacket& pkt, const Mesh::ShearedRay& sray, int i, RTFloat nearhit, RTFloat farhit, RTFloat *obb, RTFloat *obc) {
+        GeomVector3 p[3];
+        for(int iv = 0; iv < 3; iv++) {
+            p[iv].set(pkt.vertices[iv][0][i], pkt.vertices[iv][1][i], pkt.vertices[iv][2][i]);
+            p[iv] = p[iv] - sray.origin;
+        }
+        return WatertightHit(sray, p[0], p[1], p[2], nearhit, farhit, obb, obc);
+    }
+}
+
+RTFloat Mesh::TrianglePacket::intersection(const ShearedRay& sray, RTFloat nearhit, RTFloat farhit, int *olane, RTFloat *obb, RTFloat *obc) const {
+    PacketHits hits;
+    ComputePacketHits(*this, sray, nearhit, farhit, &hits);
     
-    if((b < 0.0) || (c < 0.0) || (b + c > 1.0) || (t < nearhit) || (t > farhit)) {
+    RTFloat mint = -1.0;
+    int hitlane = -1;
+    for(int i = 0; i < count; i++) {
+        if(IsPacketEdgeLane(hits, i)) {
+            RTFloat t = PacketLaneHit(*this, sray, i, nearhit, farhit, nullptr, nullptr);
+            if(t >= 0.0) {
+                mint = t;
+                farhit = t;
+                hitlane = i;
+            }
+        } else if(hits.valid[i]) {
+            RTFloat t = hits.t[i] / (hits.u[i] + hits.v[i] + hits.w[i]);
+            if(t <= farhit) {
+                mint = t;
+                farhit = t;
+                hitlane = i;
+            }
+        }
+    }
+    
+    if(hitlane < 0) {
         return -1.0;
     }
     
-    if(obb != nullptr) { *obb = b; }
-    if(obc != nullptr) { *obc = c; }
-    return t;
+    if(IsPacketEdgeLane(hits, hitlane)) {
+        PacketLaneHit(*this, sray, hitlane, nearhit, kINF, obb, obc);
+    } else {
+        RTFloat rcpdet = 1.0 / (RTFloat(hits.u[hitlane]) + RTFloat(hits.v[hitlane]) + RTFloat(hits.w[hitlane]));
+        if(obb != nullptr) { *obb = hits.v[hitlane] * rcpdet; }
+        if(obc != nullptr) { *obc = hits.w[hitlane] * rcpdet; }
+    }
+    if(olane != nullptr) { *olane = hitlane; }
+    return mint;
+}
+
+bool Mesh::TrianglePacket::occluded(const ShearedRay& sray, RTFloat nearhit, RTFloat farhit) const {
+    PacketHits hits;
+    ComputePacketHits(*this, sray, nearhit, farhit, &hits);
+    
+    for(int i = 0; i < count; i++) {
+        if(IsPacketEdgeLane(hits, i)) {
+            if(PacketLaneHit(*this, sray, i, nearhit, farhit, nullptr, nullptr) >= 0.0) {
+                return true;
+            }
+        } else if(hits.valid[i]) {
+            return true;
+        }
+    }
+    return false;
 }
 
 Mesh::Mesh()
@@ -114,10 +326,14 @@ void Mesh::setGlobalTransform(const Matrix4 &m) {
     invTransGlobalTransform.transpose();
 }
 
-void Mesh::preprocess() {
+void Mesh::preprocess(const BVH::BuildOption& bvhopt) {
     
     bounds.clear();
-    triangleBVH = std::unique_ptr<BVH>(new BVH(totalTriangles));
+    // leaves are tested by packets
+    BVH::BuildOption pktopt = bvhopt;
+    pktopt.packetWidth = kTrianglePacketWidth;
+    pktopt.maxLeafSize = std::max(bvhopt.maxLeafSize, kTrianglePacketWidth);
+    triangleBVH = std::unique_ptr<BVH>(new BVH(totalTriangles, pktopt));
     auto* bvh = triangleBVH.get();
     
     // int triangles
@@ -150,6 +366,25 @@ void Mesh::preprocess() {
     }
 
     bvh->build();
+    
+    // packets in BVH leaf order
+    trianglePackets.clear();
+    leafPacketStart.assign(bvh->primitiveCount(), -1);
+    bvh->forEachLeaf([this, bvh](int primstart, int primcount) {
+        leafPacketStart[primstart] = static_cast<int>(trianglePackets.size());
+        for(int ip = 0; ip < primcount; ip += kTrianglePacketWidth) {
+            TrianglePacket pkt;
+            memset(&pkt, 0, sizeof(pkt));
+            pkt.count = std::min(kTrianglePacketWidth, primcount - ip);
+            for(int i = 0; i < pkt.count; i++) {
+                const AABB* tribnd = bvh->primitiveAt(primstart + ip + i);
+                const auto* cls = clusters[tribnd->dataId].get();
+                const Triangle& tri = cls->triangles[tribnd->subDataId];
+                pkt.setTriangle(i, tribnd->dataId, tribnd->subDataId, TriangleVertices(cls->vertices[tri.a], cls->vertices[tri.b], cls->vertices[tri.c]));
+            }
+            trianglePackets.push_back(pkt);
+        }
+    });
 }
 
 RTFloat Mesh::intersection(const Ray& ray, RTFloat nearhit, RTFloat farhit, MeshIntersection* oisect) const
@@ -179,7 +414,8 @@ RTFloat Mesh::intersection(const Ray& ray, RTFloat nearhit, RTFloat farhit, Mesh
             const Triangle& tri = cls->triangles[itri];
             RTFloat tb = 0.0;
             RTFloat tc = 0.0;
-            RTFloat thit = tri.intersection(ray, nearhit, fart, &tb, &tc);
+            TriangleVertices verts(cls->vertices[tri.a], cls->vertices[tri.b], cls->vertices[tri.c]);
+            RTFloat thit = verts.intersection(ray, nearhit, fart, &tb, &tc);
             if(thit > 0.0) {
                 if(mint > thit || mint < 0.0) {
                     mint = thit;
@@ -203,23 +439,27 @@ RTFloat Mesh::intersection(const Ray& ray, RTFloat nearhit, RTFloat farhit, Mesh
 
     memset(&hitInfo, 0, sizeof(hitInfo));
     hitInfo.mint = -1.0;
-    RTFloat mintb = triangleBVH->intersect(ray, nearhit, farhit, [this, &hitInfo](const Ray& ray, RTFloat neart, RTFloat fart, const AABB* tribnd) {
-        const int clsId = tribnd->dataId;
-        const int triId = tribnd->subDataId;
-        const Triangle& tri = clusters[clsId]->triangles[triId];
-        RTFloat b;
-        RTFloat c;
-        RTFloat t = tri.intersection(ray, neart, fart, &b, &c);
-        if (t > 0.0) {
-            if (hitInfo.mint > t || hitInfo.mint < 0.0) {
+    const ShearedRay sray(ray);
+    RTFloat mintb = triangleBVH->intersectLeaves(ray, nearhit, farhit, [this, &hitInfo, &sray](const Ray&, RTFloat neart, RTFloat fart, int primstart, int primcount) {
+        const TrianglePacket* pkt = &trianglePackets[leafPacketStart[primstart]];
+        const int numpkt = (primcount + kTrianglePacketWidth - 1) / kTrianglePacketWidth;
+        RTFloat rett = -1.0;
+        for (int ip = 0; ip < numpkt; ip++) {
+            int lane;
+            RTFloat b;
+            RTFloat c;
+            RTFloat t = pkt[ip].intersection(sray, neart, fart, &lane, &b, &c);
+            if (t >= 0.0) {
+                fart = t;
+                rett = t;
                 hitInfo.mint = t;
-                hitInfo.triId = triId;
-                hitInfo.clusterId = clsId;
+                hitInfo.triId = pkt[ip].triangleId[lane];
+                hitInfo.clusterId = pkt[ip].clusterId[lane];
                 hitInfo.vb = b;
                 hitInfo.vc = c;
             }
         }
-        return t;
+        return rett;
     });
     
 //    if(mint != mintb) {
@@ -247,6 +487,25 @@ RTFloat Mesh::intersection(const Ray& ray, RTFloat nearhit, RTFloat farhit, Mesh
     return mint;
 }
 
+bool Mesh::occluded(const Ray& ray, RTFloat nearhit, RTFloat farhit) const
+{
+    if(!bounds.isIntersect(ray, nearhit, farhit)) {
+        return false;
+    }
+    
+    const ShearedRay sray(ray);
+    return triangleBVH->occludedLeaves(ray, nearhit, farhit, [this, &sray](const Ray&, RTFloat neart, RTFloat fart, int primstart, int primcount) {
+        const TrianglePacket* pkt = &trianglePackets[leafPacketStart[primstart]];
+        const int numpkt = (primcount + kTrianglePacketWidth - 1) / kTrianglePacketWidth;
+        for (int ip = 0; ip < numpkt; ip++) {
+            if (pkt[ip].occluded(sray, neart, fart)) {
+                return true;
+            }
+        }
+        return false;
+    });
+}
+
 //
 MeshCache::ClusterCache::ClusterCache(Mesh::Cluster* src, int numslice) :
 sourceCluster(src)
@@ -256,6 +515,7 @@ sourceCluster(src)
     cachedVertices.resize(numslice);
     
     wholeTriBounds.resize(sourceCluster->triangles.size());
+    sliceTriBounds.resize(sourceCluster->triangles.size() * numslice);
     for (size_t i = 0; i < wholeTriBounds.size(); i++) {
         const auto& tri = sourceCluster->triangles[i];
         wholeTriBounds[i] = tri.bound;
@@ -294,12 +554,14 @@ void MeshCache::ClusterCache::expandWholeTriangleBounds(int sliceid) {
     Mesh::Triangle tmptri;
     const auto& cachedvert = cachedVertices[sliceid];
     auto& area = sliceArea[sliceid];
+    const size_t numslice = cachedVertices.size();
 
     area = 0.0;
     for (size_t i = 0; i < sourceCluster->triangles.size(); i++) {
         auto& tri = sourceCluster->triangles[i];
         tmptri.initialize(cachedvert[tri.a].vertex, cachedvert[tri.b].vertex, cachedvert[tri.c].vertex);
         wholeTriBounds[i].expand(tmptri.bound);
+        sliceTriBounds[i * numslice + sliceid] = tmptri.bound;
         area += tmptri.area;
     }
 }
@@ -396,9 +658,11 @@ MeshCache::CachedAttribute MeshCache::ClusterCache::interpolatedCache(int vid, R
     return ret;
 }
 
-MeshCache::MeshCache(Mesh* m, int numslice) : mesh(m), sliceCount(numslice) {
-    skinedBVH = std::unique_ptr<BVH>(new BVH(mesh->totalTriangles));
+MeshCache::MeshCache(Mesh* m, int numslice, const BVH::BuildOption& bvhopt) : mesh(m), sliceCount(numslice) {
+    skinedBVH = std::unique_ptr<BVH>(new BVH(mesh->totalTriangles, bvhopt));
     auto* bvh = skinedBVH.get();
+    // vertices move linearly between slices, so interpolated slice bounds enclose triangles
+    bvh->setMotionSliceCount(numslice);
 
     size_t numclstr = mesh->clusters.size();
     clusterCaches.resize(numclstr);
@@ -407,15 +671,13 @@ MeshCache::MeshCache(Mesh* m, int numslice) : mesh(m), sliceCount(numslice) {
         clusterCaches[i] = std::unique_ptr<ClusterCache>(cc);
         
         for (size_t itr = 0; itr < cc->wholeTriBounds.size(); itr++) {
-            bvh->appendLeaf(&cc->wholeTriBounds[itr]);
+            bvh->appendLeaf(&cc->wholeTriBounds[itr], &cc->sliceTriBounds[itr * sliceCount]);
         }
     }
 }
 
 void MeshCache::updateBVH() {
-    auto* bvh = skinedBVH.get();
-    bvh->updateAllLeafBounds();
-    bvh->build();
+    skinedBVH->update();
 }
 
 RTFloat MeshCache::intersection(const Ray& ray, RTFloat nearhit, RTFloat farhit, RTTimeType timerate, MeshIntersection* oisect) const {
@@ -429,7 +691,6 @@ RTFloat MeshCache::intersection(const Ray& ray, RTFloat nearhit, RTFloat farhit,
 #if 0
     // blute force -----
     int numCls = static_cast<int>(clusterCaches.size());
-    Mesh::Triangle tmptri;
     RTFloat fatt = farhit;
     for(int icls = 0; icls < numCls; icls++) {
         const auto *ccache = clusterCaches[icls].get();
@@ -448,10 +709,10 @@ RTFloat MeshCache::intersection(const Ray& ray, RTFloat nearhit, RTFloat farhit,
             auto cvb = ccache->interpolatedCache(tri.b, timerate);
             auto cvc = ccache->interpolatedCache(tri.c, timerate);
             
-            tmptri.initialize(cva.vertex, cvb.vertex, cvc.vertex);
+            Mesh::TriangleVertices verts(cva.vertex, cvb.vertex, cvc.vertex);
             RTFloat b;
             RTFloat c;
-            RTFloat thit = tmptri.intersection(ray, nearhit, fatt, &b, &c);
+            RTFloat thit = verts.intersection(ray, nearhit, fatt, &b, &c);
             if(thit > 0.0) {
                 if(mint > thit || mint < 0.0) {
                     mint = thit;
@@ -476,7 +737,7 @@ RTFloat MeshCache::intersection(const Ray& ray, RTFloat nearhit, RTFloat farhit,
     } hitInfo;
 
     hitInfo.mint = -1.0;
-    mint = skinedBVH->intersect(ray, nearhit, farhit, [this, &hitInfo, timerate](const Ray& ray, RTFloat neart, RTFloat fart, const AABB* tribnd) {
+    mint = skinedBVH->intersect(ray, nearhit, farhit, timerate, [this, &hitInfo, timerate](const Ray& ray, RTFloat neart, RTFloat fart, const AABB* tribnd) {
         const int clsId = tribnd->dataId;
         const int triId = tribnd->subDataId;
         const auto* cls = mesh->clusters[clsId].get();
@@ -487,12 +748,11 @@ RTFloat MeshCache::intersection(const Ray& ray, RTFloat nearhit, RTFloat farhit,
         auto cvb = ccache->interpolatedCache(tri.b, timerate);
         auto cvc = ccache->interpolatedCache(tri.c, timerate);
 
-        Mesh::Triangle tmptri;
-        tmptri.initialize(cva.vertex, cvb.vertex, cvc.vertex);
+        Mesh::TriangleVertices verts(cva.vertex, cvb.vertex, cvc.vertex);
 
         RTFloat b;
         RTFloat c;
-        RTFloat t = tmptri.intersection(ray, neart, fart, &b, &c);
+        RTFloat t = verts.intersection(ray, neart, fart, &b, &c);
         if (t > 0.0) {
             if (hitInfo.mint > t || hitInfo.mint < 0.0) {
                 hitInfo.mint = t;
@@ -522,6 +782,21 @@ RTFloat MeshCache::intersection(const Ray& ray, RTFloat nearhit, RTFloat farhit,
     return mint;
 }
 
+bool MeshCache::occluded(const Ray& ray, RTFloat nearhit, RTFloat farhit, RTTimeType timerate) const {
+    return skinedBVH->occluded(ray, nearhit, farhit, timerate, [this, timerate](const Ray& ray, RTFloat neart, RTFloat fart, const AABB* tribnd) {
+        const int clsId = tribnd->dataId;
+        const auto& tri = mesh->clusters[clsId]->triangles[tribnd->subDataId];
+        const auto* ccache = clusterCaches[clsId].get();
+
+        auto cva = ccache->interpolatedCache(tri.a, timerate);
+        auto cvb = ccache->interpolatedCache(tri.b, timerate);
+        auto cvc = ccache->interpolatedCache(tri.c, timerate);
+
+        Mesh::TriangleVertices verts(cva.vertex, cvb.vertex, cvc.vertex);
+        return verts.intersection(ray, neart, fart, nullptr, nullptr) > 0.0;
+    });
+}
+
 void Mesh::triangleAttributes(int clusterId, int triangleId, Attributes* oattr3) const {
     auto* cls = clusters[clusterId].get();
     auto& tri = cls->triangles[triangleId];
@@ -9,13 +9,13 @@
 #include "ray.h"
 #include "intersection.h"
 #include "aabb.h"
+#include "bvh.h"
 #include "tracablestructure.h"
 
 namespace Petals {
     
     /////
     class Material;
-    class BVH;
     class MeshCache;
     
     /////
@@ -32,6 +32,16 @@ namespace Petals {
             kNumAttrs
         };
         
+        // ray sheared for watertight triangle tests. computed once per ray
+        struct ShearedRay {
+            int kx, ky, kz;
+            RTGeomFloat sx, sy, sz;
+            GeomVector3 origin;
+            
+            ShearedRay(const Ray& ray);
+        };
+        
+        // cold per triangle data for shading and sampling. positions are in the packets
         struct Triangle {
             int a;
             int b;
@@ -39,16 +49,38 @@ namespace Petals {
             
             int clusterId;
             
-            Vector3 pa;
-            Vector3 edgeab;
-            Vector3 edgeac;
             Vector3 normal;
             RTFloat area;
             RTFloat sampleBorder;
             AABB bound; // dataId: cluster index, subDataId: triangle index
             
             void initialize(const Vector3& va, const Vector3& vb, const Vector3& vc);
+        };
+        
+        // vertices of a single triangle in geometry precision for intersection
+        struct TriangleVertices {
+            GeomVector3 pa;
+            GeomVector3 pb;
+            GeomVector3 pc;
+            
+            TriangleVertices(const Vector3& va, const Vector3& vb, const Vector3& vc);
             RTFloat intersection(const Ray& ray, RTFloat nearhit, RTFloat farhit, RTFloat *obb, RTFloat *obc) const;
+            RTFloat intersection(const ShearedRay& sray, RTFloat nearhit, RTFloat farhit, RTFloat *obb, RTFloat *obc) const;
+        };
+        
+        // hot intersection data of one BVH leaf, SoA
+        static constexpr int kTrianglePacketWidth = 32 / sizeof(RTGeomFloat);
+        
+        struct alignas(32) TrianglePacket {
+            RTGeomFloat vertices[3][3][kTrianglePacketWidth]; // [vertex][axis][lane]
+            int clusterId[kTrianglePacketWidth];
+            int triangleId[kTrianglePacketWidth];
+            int count;
+            
+            void setTriangle(int lane, int clsid, int triid, const TriangleVertices& verts);
+            // closest hit in packet. olane receives hit lane
+            RTFloat intersection(const ShearedRay& sray, RTFloat nearhit, RTFloat farhit, int *olane, RTFloat *obb, RTFloat *obc) const;
+            bool occluded(const ShearedRay& sray, RTFloat nearhit, RTFloat farhit) const;
         };
         
         class Cluster {
@@ -91,12 +123,15 @@ namespace Petals {
         
         AABB bounds;
         std::unique_ptr<BVH> triangleBVH;
+        std::vector<TrianglePacket> trianglePackets;
+        std::vector<int> leafPacketStart; // by BVH primitive index of leaf start
         
         void setGlobalTransform(const Matrix4 &m);
         
-        void preprocess();
+        void preprocess(const BVH::BuildOption& bvhopt);
         
         RTFloat intersection(const Ray& ray, RTFloat nearhit, RTFloat farhit, MeshIntersection* oisect) const;
+        bool occluded(const Ray& ray, RTFloat nearhit, RTFloat farhit) const;
         void triangleAttributes(int clusterId, int triangleId, Attributes* oattr3) const;
     };
     
@@ -130,6 +165,7 @@ namespace Petals {
             // whole slice data
             AABB wholeBounds;
             std::vector<AABB> wholeTriBounds;
+            std::vector<AABB> sliceTriBounds; // [triangle * slices + slice] for motion BVH
         };
 
         Mesh* mesh;
@@ -137,7 +173,7 @@ namespace Petals {
         std::vector<std::unique_ptr<ClusterCache> > clusterCaches;
         int sliceCount;
 
-        MeshCache(Mesh* m, int numslice);
+        MeshCache(Mesh* m, int numslice, const BVH::BuildOption& bvhopt);
         ~MeshCache() {}
 
         void createSkinDeformed(int sliceid, const Matrix4& m, const std::vector<Matrix4>& mplt, const std::vector<Matrix4>& itmplt) {
@@ -148,6 +184,7 @@ namespace Petals {
 
         void updateBVH();
         RTFloat intersection(const Ray& ray, RTFloat nearhit, RTFloat farhit, RTTimeType timerate, MeshIntersection* oisect) const;
+        bool occluded(const Ray& ray, RTFloat nearhit, RTFloat farhit, RTTimeType timerate) const;
     };
 }
 
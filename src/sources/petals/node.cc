@@ -36,7 +36,7 @@ Node::~Node() {
     
 }
 
-Matrix4 Node::computeGlobalMatrix(RTTimeType tr) const {
+Matrix4 Node::computeGlobalMatrix(RTTimeType tr, int storeId) const {
     if(animatedFlag == 0) {
         return initialTransform.globalMatrix;
     } else {
@@ -44,18 +44,18 @@ Matrix4 Node::computeGlobalMatrix(RTTimeType tr) const {
         if(parent == nullptr) {
             pgm.setIdentity();
         } else {
-            pgm = parent->computeGlobalMatrix(tr);
+            pgm = parent->computeGlobalMatrix(tr, storeId);
         }
         
         if((animatedFlag & Node::kAnimatedDirect) == 0) {
             return pgm * initialTransform.matrix;
         } else {
-            int lastindex = static_cast<int>(transformCache.size() - 1);
-            RTFloat ti = tr * static_cast<float>(lastindex);
-            RTFloat t = std::floor(ti);
-            int i0 = static_cast<int>(ti - t);
+            const auto& cache = transformCache[storeId];
+            int lastindex = static_cast<int>(cache.size() - 1);
+            RTFloat ti = tr * static_cast<RTFloat>(lastindex);
+            int i0 = std::max(0, std::min(static_cast<int>(std::floor(ti)), lastindex));
             int i1 = std::min(i0 + 1, lastindex);
-            Transform tf = Transform::interpolate(transformCache[i0], transformCache[i1], t);
+            Transform tf = Transform::interpolate(cache[i0], cache[i1], ti - i0);
             tf.makeMatrix();
             return pgm * tf.matrix;
         }
@@ -44,7 +44,9 @@ namespace Petals {
         Node(int i);
         ~Node();
         
-        Matrix4 computeGlobalMatrix(RTTimeType tr) const;
+        // storeId: scene store of the cached slice transforms (see Scene::seekTime)
+        Matrix4 computeGlobalMatrix(RTTimeType tr, int storeId = 0) const;
+        TracableStructure* getTracable(int storeId) const { return tracableStores[storeId].get(); }
         
         std::string name;
         int index;
@@ -59,7 +61,7 @@ namespace Petals {
             };
             Light* light;
         } content;
-        std::unique_ptr<TracableStructure> tracable;
+        std::vector<std::unique_ptr<TracableStructure> > tracableStores; // per scene store
         int animatedFlag;
         
         Node* parent;
@@ -67,7 +69,7 @@ namespace Petals {
         Transform initialTransform;
         Transform currentTransform;
         Matrix4 currentInverseGlobal;
-        std::vector<Transform> transformCache;
+        std::vector<std::vector<Transform> > transformCache; // [store][exposure slice]
     };
 }
 
@@ -1,9 +1,9 @@
 #include <iostream>
 #include <vector>
-#include <stb/stb_image_write.h>
 
 #include "postprocessor.h"
 #include "framebuffer.h"
+#include "imagewriter.h"
 
 using namespace Petals;
 
@@ -47,40 +47,14 @@ int PostProcessor::process(int jobid) {
 }
 
 bool PostProcessor::writeToFile(bool printlog) {
-    auto pfb = processedBuffer.get();
-    int w = pfb->getWidth();
-    int h = pfb->getHeight();
-    
-    std::vector<unsigned char> rgb8buf;
-    rgb8buf.resize(w * h * 3);
-    
-    auto encodeTo8byte = [](RTColorType c, double gamma) {
-        c = std::max(0.0, std::min(1.0, c));
-        c = pow(c, 1.0 / gamma);
-        return static_cast<unsigned char>(std::max(0.0, std::min(255.0, c * 256.0)));
-    };
-    
-    for(int iy = 0; iy < h; iy++) {
-        for(int ix = 0; ix < w; ix++) {
-            int ipxl = (ix + (h - iy - 1) * w) * 3;
-            Color col = pfb->getColor(ix, iy);
-            rgb8buf[ipxl + 0] = encodeTo8byte(col.r, exportGamma);
-            rgb8buf[ipxl + 1] = encodeTo8byte(col.g, exportGamma);
-            rgb8buf[ipxl + 2] = encodeTo8byte(col.b, exportGamma);
-        }
-    }
-    
-    auto l = savePath.length();
-    int saved = 0;
-    if(savePath[l-4] == '.' && savePath[l-3] == 'j' && savePath[l-2] == 'p' && savePath[l-1] == 'g') {
-        saved = stbi_write_jpg(savePath.c_str(), w, h, 3, rgb8buf.data(), 80);
-    } else {
-        saved = stbi_write_png(savePath.c_str(), w, h, 3, rgb8buf.data(), 0);
-    }
+    ImageWriter::Request req;
+    req.path = savePath;
+    ImageWriter::encodeRGB8(*processedBuffer, exportGamma, &req);
+    bool saved = ImageWriter::writeImage(req);
 
     if(printlog) {
         std::cout << "saved:" << savePath << std::endl;
     }
     
-    return saved != 0;
+    return saved;
 }
@@ -32,5 +32,20 @@ namespace Petals {
             return direction * t + origin;
         }
     };
+    
+    // ray with reciprocal direction for slab tests, in geometry precision
+    struct InvDirRay {
+        RTGeomFloat origin[3];
+        RTGeomFloat invDirection[3];
+        int dirIsNeg[3];
+        
+        InvDirRay(const Ray& ray) {
+            for(int i = 0; i < 3; i++) {
+                origin[i] = static_cast<RTGeomFloat>(ray.origin.v[i]);
+                invDirection[i] = static_cast<RTGeomFloat>(1.0 / ray.direction.v[i]);
+                dirIsNeg[i] = (invDirection[i] < 0.0) ? 1 : 0;
+            }
+        };
+    };
 }
 #endif
@@ -11,6 +11,7 @@
 #include "random.h"
 #include "ray.h"
 #include "postprocessor.h"
+#include "imagewriter.h"
 #include "node.h"
 #include "texture.h"
 #include "material.h"
@@ -72,13 +73,32 @@ double getElapsedTimeInSeconds() {
 
 Renderer::Renderer(const Config& config, Scene* scn):
     scene(scn),
-    frameBufferIndex(0)
+    frameBufferIndex(0),
+    queuedCommandCount(0),
+    commandPushSerial(0),
+    nextQueueIndex(0),
+    renderingFrameId(0),
+    renderingStoreId(0),
+    numSceneStores(1),
+    frameDeadline(-1.0)
 {
+    for(int i = 0; i < kMaxSceneStores; i++) {
+        storeRenderCounts[i] = 0;
+    }
+    
+    // locality needs workers to stay on their node
+    numaAware = config.numaAware && topology.getNodeCount() > 1;
+    pinThreads = config.pinThreads || numaAware;
+    
     int numbuffers = config.framebufferStockCount;
+    // images waiting for the disk are bounded by the processed buffers
+    imageWriter = std::unique_ptr<ImageWriter>(new ImageWriter());
+    maxProcessedBuffers = std::max(1, numbuffers);
+    allocatedProcessedBuffers = 0;
     framebuffers.reserve(numbuffers);
     postprocessors.reserve(numbuffers);
     for(int i = 0; i < numbuffers; i++) {
-        auto fb = new FrameBuffer(config.width, config.height, config.tileSize);
+        auto fb = new FrameBuffer(config.width, config.height, config.tileSize, numaAware);
         framebuffers.push_back(std::unique_ptr<FrameBuffer>(fb));
         auto pp = new PostProcessor();
         postprocessors.push_back(std::unique_ptr<PostProcessor>(pp));
@@ -86,14 +106,23 @@ Renderer::Renderer(const Config& config, Scene* scn):
 
     int numTiles = framebuffers[0].get()->getNumTiles();
     tileInfos.resize(numTiles);
+    tileNodes.resize(numTiles);
     for(int i = 0; i < numTiles; i++) {
         tileInfos[i].processTime = 0.0;
         tileInfos[i].tileIndex = i;
+        tileInfos[i].noise = 0.0;
+        // contiguous blocks of tiles, so nodes do not share pages
+        tileNodes[i] = numaAware ? static_cast<int>(static_cast<long>(i) * topology.getNodeCount() / numTiles) : 0;
     }
     
     samplesPerPixel = config.samplesPerPixel;
     pixelSubSamples = config.pixelSubSamples;
     
+    adaptiveNoiseTarget = config.adaptiveNoiseTarget;
+    adaptiveMinSamples = std::max(2, config.adaptiveMinSamples);
+    adaptivePassSamples = std::max(1, config.adaptivePassSamples);
+    adaptiveMaxSamples = std::max(adaptiveMinSamples, config.adaptiveMaxSamples);
+    
     minDepth = config.minDepth;
     maxDepth = config.maxDepth;
     minRussianRouletteCutOff = config.minRussianRouletteCutOff;
@@ -124,30 +153,139 @@ Renderer::Renderer(const Config& config, Scene* scn):
 
 Renderer::~Renderer() {
     cleanupWorkers();
+    // pending encodes return their buffers to the pool
+    imageWriter.reset();
 }
 
 
-void Renderer::pushRenderCommands(FrameBuffer* fb, int frameID, int spp, int ss) {
-    int numTiles = fb->getNumTiles();
+int Renderer::commandQueueIndex(const JobCommand& cmd) {
+    const int numqueues = static_cast<int>(workerQueues.size());
+    if (numaAware && cmd.type == CommandType::kRender) {
+        // a worker on the node which owns the tile memory
+        int node = tileNodes[tileInfos[cmd.render.tileInfoIndex].tileIndex];
+        const auto& workers = nodeWorkers[node];
+        if (!workers.empty()) {
+            int& cursor = nodeQueueCursors[node];
+            cursor = (cursor + 1) % static_cast<int>(workers.size());
+            return workers[cursor];
+        }
+    }
+    nextQueueIndex = (nextQueueIndex + 1) % numqueues;
+    return nextQueueIndex;
+}
+
+void Renderer::pushCommands(const std::vector<JobCommand>& cmds) {
+    // round robin. commands keep their order in each deque
+    const int numqueues = static_cast<int>(workerQueues.size());
+    std::vector<std::vector<JobCommand> > queuecmds(numqueues);
+    for (size_t i = 0; i < cmds.size(); i++) {
+        queuecmds[commandQueueIndex(cmds[i])].push_back(cmds[i]);
+    }
+    for (int iq = 0; iq < numqueues; iq++) {
+        if (queuecmds[iq].empty()) {
+            continue;
+        }
+        auto* queue = workerQueues[iq].get();
+        std::unique_lock<std::mutex> lock(queue->mutex);
+        queue->commands.insert(queue->commands.end(), queuecmds[iq].begin(), queuecmds[iq].end());
+    }
+    queuedCommandCount.fetch_add(static_cast<int>(cmds.size()));
+    
+    // count is visible before sleeping workers recheck it
     {
         std::unique_lock<std::mutex> lock(commandQueueMutex);
-        for (int i = 0; i < numTiles; i++) {
-            JobCommand cmd;
-            cmd.type = CommandType::kRender;
-            cmd.render.tileInfoIndex = i;
-            cmd.render.samples = spp;
-            cmd.render.subSamples = ss;
-            cmd.render.frameId = frameID;
-            commandQueue.push(cmd);
-        }
+        commandPushSerial.fetch_add(1);
     }
     workerCondition.notify_all();
 }
 
-void Renderer::renderOneFrame(FrameBuffer* fb, PostProcessor* pp, RTTimeType opentime, RTTimeType closetime, int frameId) {
-    // scene setup
-    std::cout << "  scene [" << opentime << "," << closetime << "] setup (" << TimeUtils::getElapsedTimeInSeconds() << ")" << std::endl;
-    scene->seekTime(opentime, closetime, exposureSlice, 0);
+void Renderer::pushCommand(int queueindex, const JobCommand& cmd) {
+    {
+        auto* queue = workerQueues[queueindex].get();
+        std::unique_lock<std::mutex> lock(queue->mutex);
+        queue->commands.push_back(cmd);
+    }
+    queuedCommandCount.fetch_add(1);
+    {
+        std::unique_lock<std::mutex> lock(commandQueueMutex);
+        commandPushSerial.fetch_add(1);
+    }
+    workerCondition.notify_one();
+}
+
+bool Renderer::popCommand(int workerid, JobCommand* ocmd) {
+    if (queuedCommandCount.load() <= 0) {
+        return false;
+    }
+    
+    // own queue, then same node, then remote nodes.
+    // only the own queue is waited for. a thief skips a queue somebody else holds
+    const auto& victims = stealOrders[workerid];
+    for (size_t iq = 0; iq < victims.size(); iq++) {
+        auto* queue = workerQueues[victims[iq]].get();
+        std::unique_lock<std::mutex> lock(queue->mutex, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            workerInfos[workerid].contendedCount += 1;
+            if (iq > 0) {
+                continue;
+            }
+            lock.lock();
+        }
+        if (queue->commands.empty()) {
+            continue;
+        }
+        
+        // count as processing before leaving the queue, so waiters never see both empty
+        processingWorkerCount.fetch_add(1);
+        if (iq == 0) {
+            *ocmd = queue->commands.front();
+            queue->commands.pop_front();
+        } else {
+            *ocmd = queue->commands.back();
+            queue->commands.pop_back();
+            workerInfos[workerid].stealCount += 1;
+        }
+        queuedCommandCount.fetch_sub(1);
+        return true;
+    }
+    return false;
+}
+
+bool Renderer::isAllCommandsDone() const {
+    // queued first. popCommand increments processing count before decrementing it
+    return queuedCommandCount.load() == 0 && interruptQueue.empty() && processingWorkerCount.load() == 0;
+}
+
+void Renderer::pushRenderCommands(FrameBuffer* fb, int frameID, int spp, int ss) {
+    int numTiles = fb->getNumTiles();
+    std::vector<JobCommand> cmds(numTiles);
+    for (int i = 0; i < numTiles; i++) {
+        JobCommand& cmd = cmds[i];
+        cmd.type = CommandType::kRender;
+        cmd.render.tileInfoIndex = i;
+        cmd.render.samples = spp;
+        cmd.render.subSamples = ss;
+        cmd.render.frameId = frameID;
+        cmd.render.storeId = renderingStoreId;
+    }
+    pushCommands(cmds);
+}
+
+void Renderer::setupFrame(int frameId, int storeId) {
+    // late tiles of an expired frame may still trace this store
+    while(storeRenderCounts[storeId].load() > 0) {
+        std::this_thread::yield();
+    }
+    
+    RTTimeType opentime = (frameId - 1) / static_cast<RTTimeType>(fps); // from 0 to N-1
+    RTTimeType closetime = opentime + exposureSec;
+    std::cout << "  scene [" << opentime << "," << closetime << "] setup. store:" << storeId << " (" << TimeUtils::getElapsedTimeInSeconds() << ")" << std::endl;
+    scene->seekTime(opentime, closetime, exposureSlice, storeId);
+}
+
+void Renderer::beginFrame(FrameBuffer* fb, PostProcessor* pp, int frameId, int storeId) {
+    renderingStoreId = storeId;
+    renderingFrameId = frameId;
     
     // init contexts
     unsigned long seedbase = static_cast<unsigned long>(time(NULL)); // FIXME
@@ -158,9 +296,19 @@ void Renderer::renderOneFrame(FrameBuffer* fb, PostProcessor* pp, RTTimeType ope
         cntx.postprocessor = pp;
     }
 
+    // unrendered tiles are not converged
+    for(auto ite = tileInfos.begin(); ite != tileInfos.end(); ++ite) {
+        ite->noise = kINF;
+    }
+    
     // setup render jobs
     std::cout << "  submit render commands (" << TimeUtils::getElapsedTimeInSeconds() << ")" << std::endl;
-    pushRenderCommands(fb, frameId, samplesPerPixel, pixelSubSamples);
+    if(adaptiveNoiseTarget > 0.0) {
+        // first pass gives every pixel enough samples to estimate its variance
+        pushRenderCommands(fb, frameId, adaptiveMinSamples, pixelSubSamples);
+    } else {
+        pushRenderCommands(fb, frameId, samplesPerPixel, pixelSubSamples);
+    }
 }
 
 void Renderer::postProcessAndSave(FrameBuffer* fb, PostProcessor* pp, int frameid) {
@@ -170,18 +318,37 @@ void Renderer::postProcessAndSave(FrameBuffer* fb, PostProcessor* pp, int framei
     ss << frameid << "." << saveExt;
     auto savepath = ss.str();
     
+    pp->processedBuffer = acquireProcessedBuffer();
     int numjobs = pp->init(fb, savepath, 4096, 2.2, frameid);
+    std::vector<JobCommand> cmds(numjobs);
+    for(int i = 0; i < numjobs; i++) {
+        JobCommand& cmd = cmds[i];
+        cmd.type = CommandType::kPostprocess;
+        cmd.postprocess.processor = pp;
+        cmd.postprocess.jobIndex = i;
+    }
+    pushCommands(cmds);
+}
+
+std::unique_ptr<FrameBuffer> Renderer::acquireProcessedBuffer() {
+    std::unique_lock<std::mutex> lock(processedBufferMutex);
+    processedBufferCondition.wait(lock, [this]{ return !processedBufferPool.empty() || allocatedProcessedBuffers < maxProcessedBuffers; });
+    if(processedBufferPool.empty()) {
+        // PostProcessor::init allocates it
+        allocatedProcessedBuffers += 1;
+        return nullptr;
+    }
+    auto fb = std::move(processedBufferPool.back());
+    processedBufferPool.pop_back();
+    return fb;
+}
+
+void Renderer::releaseProcessedBuffer(std::unique_ptr<FrameBuffer> fb) {
     {
-        std::unique_lock<std::mutex> lock(commandQueueMutex);
-        for(int i = 0; i < numjobs; i++) {
-            JobCommand cmd;
-            cmd.type = CommandType::kPostprocess;
-            cmd.postprocess.processor = pp;
-            cmd.postprocess.jobIndex = i;
-            commandQueue.push(cmd);
-        }
+        std::unique_lock<std::mutex> lock(processedBufferMutex);
+        processedBufferPool.push_back(std::move(fb));
     }
-    workerCondition.notify_all();
+    processedBufferCondition.notify_one();
 }
 
 void Renderer::render() {
@@ -192,15 +359,31 @@ void Renderer::render() {
         std::cout << "maxJobs as hardware_concurrency: " << numMaxJobs << std::endl;
     }
     renderContexts.resize(numMaxJobs);
+    setupQueues();
+    placeFramebuffers();
+    if(pinThreads) {
+        std::cout << "pin threads. cpus:" << topology.getCpuCount() << ", numa nodes:" << topology.getNodeCount() << (numaAware ? " (tile locality)" : "") << std::endl;
+    }
     
     if(numMaxJobs > 1) {
         setupWorkers();
     }
     
+    // setup of the next frame overlaps rendering when workers run
+    numSceneStores = std::max(1, std::min(scene->getStoreCount(), static_cast<int>(kMaxSceneStores)));
+    const bool ispipelined = numMaxJobs > 1 && numSceneStores > 1;
+    int storeId = 0;
+    if(renderFrames > 0) {
+        setupFrame(startFrame + 1, storeId);
+    }
+    
     for(int i = 0; i < renderFrames; i++) {
         double frameStartTime = TimeUtils::getTimeInSeconds();
         int frameNumber = i + startFrame + 1; // from 1 to N
-        renderingFrameId = frameNumber;
+        int nextStoreId = (storeId + 1) % numSceneStores;
+        bool hasnext = (i + 1) < renderFrames;
+        // workers read it while the previous frame's commands drain
+        frameDeadline.store((limitSecPerFrame > 0.0) ? frameStartTime + limitSecPerFrame - limitSecMargin : -1.0);
 
         std::cout << "<" << i+1 << "/" << renderFrames << "> frame[" << frameNumber <<  "] start ("  << TimeUtils::getElapsedTimeInSeconds() << ")" << std::endl;
         
@@ -208,8 +391,10 @@ void Renderer::render() {
         fb->clear();
         auto pp = postprocessors[frameBufferIndex].get();
         
-        RTTimeType t = (frameNumber - 1) / static_cast<RTTimeType>(fps); // from 0 to N-1
-        renderOneFrame(fb, pp, t, t + exposureSec, frameNumber);
+        beginFrame(fb, pp, frameNumber, storeId);
+        if(ispipelined && hasnext) {
+            setupFrame(frameNumber + 1, nextStoreId);
+        }
         
         // wait
         if(numMaxJobs <= 1) {
@@ -224,19 +409,37 @@ void Renderer::render() {
             }
         }
         
+        if(adaptiveNoiseTarget > 0.0) {
+            int numconverged = 0;
+            for(auto ite = tileInfos.begin(); ite != tileInfos.end(); ++ite) {
+                numconverged += (ite->noise <= 0.0) ? 1 : 0;
+            }
+            long totalspp = 0;
+            int numpixels = fb->getWidth() * fb->getHeight();
+            for(int ip = 0; ip < numpixels; ip++) {
+                totalspp += fb->getPixel(ip).sampleCount;
+            }
+            std::cout << "  adaptive. converged tiles:" << numconverged << "/" << tileInfos.size() << ", average spp:" << static_cast<double>(totalspp) / numpixels << " (" << TimeUtils::getElapsedTimeInSeconds() << ")" << std::endl;
+        }
+        
         // post process and save
         postProcessAndSave(fb, pp, frameNumber);
         if(numMaxJobs <= 1) {
             processAllCommands();
         }
+        if(!ispipelined && hasnext) {
+            setupFrame(frameNumber + 1, nextStoreId);
+        }
         
         // next
+        storeId = nextStoreId;
         frameBufferIndex = (frameBufferIndex + 1) % framebuffers.size();
     }
     
     if(numMaxJobs > 1) {
         waitAllCommands();
     }
+    imageWriter->flush();
     cleanupWorkers();
 }
 
@@ -261,7 +464,7 @@ void Renderer::pathtrace(const Ray& iray, const Scene* scn, Context* cntx, Rende
     while(isloop) {
         SceneIntersection intersect;
         IntersectionDetail detail;
-        RTFloat hitt = scene->intersection(ray, kRayOffset, kFarAway, cntx->exposureTimeRate, &intersect);
+        RTFloat hitt = scene->intersection(ray, kRayOffset, kFarAway, cntx->exposureTimeRate, &intersect, cntx->storeId);
         if(hitt <= 0.0) {
             // background
             //radiance = Color::mul(throughput, Color(1.0, 1.0, 1.0));
@@ -319,8 +522,7 @@ void Renderer::pathtrace(const Ray& iray, const Scene* scn, Context* cntx, Rende
             auto smpl = Sampler::sampleCosineWeightedHemisphere(surfinfo.shadingNormal, rng);
             if (isValidIntersection(smpl.v, surfinfo)) {
                 Ray shdwray(surfinfo.position, smpl.v);
-                RTFloat shdwt = scene->intersection(shdwray, kRayOffset, kFarAway, cntx->exposureTimeRate, nullptr);
-                if (shdwt < 0.0) {
+                if (!scene->occluded(shdwray, kRayOffset, kFarAway, cntx->exposureTimeRate, cntx->storeId)) {
                     Material::EvalLog shadowlog;
                     RTFloat fbxdf = hitmaterial->evaluateBXDF(ray, shdwray, materiallog.selectedBxdfId, surfinfo, &shadowlog);
                     auto texel = scene->backgroundTexture->sampleEquirectangular(shdwray.direction, false);
@@ -414,6 +616,7 @@ void Renderer::renderJob(int workerid, JobCommand cmd) {
     auto* workerinfo = &workerInfos[workerid];
 
     Context *cntx = &renderContexts[workerid];
+    cntx->storeId = cmd.render.storeId;
     Random& rng = cntx->random;
     TileInfo& tileinfo = tileInfos[cmd.render.tileInfoIndex];
     int tileIndex = tileinfo.tileIndex;
@@ -421,6 +624,13 @@ void Renderer::renderJob(int workerid, JobCommand cmd) {
     const FrameBuffer::Tile& tile = cntx->framebuffer->getTile(tileIndex);
     int spp = cmd.render.samples;
     int subsp = cmd.render.subSamples;
+    
+    // adaptive: passes repeat until pixels reach the noise target
+    const bool isadaptive = adaptiveNoiseTarget > 0.0;
+    const int maxspp = adaptiveMaxSamples;
+    const double deadline = frameDeadline.load();
+    bool isconverged = true;
+    RTFloat tilenoise = 0.0;
 
     RTFloat subPixelSize = 1.0 / subsp;
     Node* cameraNode = scene->cameras[0];
@@ -446,7 +656,20 @@ void Renderer::renderJob(int workerid, JobCommand cmd) {
             
             workerinfo->infoValue1 = pixelId;
             
-            for(int ips = 0; ips < spp; ips++) {
+            int pixelspp = spp;
+            if (isadaptive) {
+                if (pixel.sampleCount >= adaptiveMinSamples) {
+                    RTFloat err = pixel.getRelativeError();
+                    if (err <= adaptiveNoiseTarget) {
+                        continue;
+                    }
+                    // noisier pixels take more of this pass
+                    pixelspp = static_cast<int>(spp * std::min(4.0, err / adaptiveNoiseTarget));
+                }
+                pixelspp = std::min(pixelspp, maxspp - pixel.sampleCount);
+            }
+            
+            for(int ips = 0; ips < pixelspp; ips++) {
                 if (cmd.render.frameId != renderingFrameId) { return; }
 
                 int spi = ips % numspi;
@@ -465,7 +688,7 @@ void Renderer::renderJob(int workerid, JobCommand cmd) {
                 Ray ray = camera->getRay(sx, sy, &rng);
 
                 cntx->exposureTimeRate = rng.nextDoubleCO();
-                Matrix4 camgm = cameraNode->computeGlobalMatrix(cntx->exposureTimeRate);
+                Matrix4 camgm = cameraNode->computeGlobalMatrix(cntx->exposureTimeRate, cntx->storeId);
 
                 ray = ray.transformed(camgm);
                 pathtrace(ray, scene, cntx, &result);
@@ -477,10 +700,27 @@ void Renderer::renderJob(int workerid, JobCommand cmd) {
                 //break;
                 //+++++
             }
+            
+            if (isadaptive && pixel.sampleCount < maxspp) {
+                RTFloat err = pixel.getRelativeError();
+                if (err > adaptiveNoiseTarget) {
+                    tilenoise = std::max(tilenoise, err);
+                    isconverged = false;
+                }
+            }
         }
     }
 
-    tileinfo.processTime = TimeUtils::getTimeInSeconds() - starttime;
+    double endtime = TimeUtils::getTimeInSeconds();
+    tileinfo.processTime = endtime - starttime;
+    tileinfo.noise = tilenoise;
+    
+    // next pass of this tile. converged tiles drop out
+    if (isadaptive && !isconverged && (deadline < 0.0 || endtime < deadline)) {
+        JobCommand nextcmd = cmd;
+        nextcmd.render.samples = adaptivePassSamples;
+        pushCommand(workerid, nextcmd);
+    }
 }
 
 void Renderer::postprocessJob(int workerid, JobCommand cmd) {
@@ -506,10 +746,24 @@ void Renderer::postprocessJob(int workerid, JobCommand cmd) {
 
 void Renderer::saveFileJob(int workerid, JobCommand cmd) {
     auto pp = cmd.save.processor;
-    bool saved = pp->writeToFile(false);
-    std::cout << "  frame [" << pp->frameId << "]";
-    std::cout << " " << pp->savePath << (saved ? " saved." : " save failed.");
-    std::cout << " (" << TimeUtils::getElapsedTimeInSeconds() << ")" << std::endl;
+    
+    // encode, compression and disk write are on the writer thread. it returns the buffer after the encode
+    ImageWriter::Request req;
+    req.path = pp->savePath;
+    FrameBuffer* processed = pp->processedBuffer.release();
+    double gamma = pp->exportGamma;
+    req.encode = [this, processed, gamma](ImageWriter::Request* oreq) {
+        ImageWriter::encodeRGB8(*processed, gamma, oreq);
+        releaseProcessedBuffer(std::unique_ptr<FrameBuffer>(processed));
+    };
+    int frameid = pp->frameId;
+    std::string savepath = pp->savePath;
+    req.onFinished = [frameid, savepath](bool saved) {
+        std::cout << "  frame [" << frameid << "]";
+        std::cout << " " << savepath << (saved ? " saved." : " save failed.");
+        std::cout << " (" << TimeUtils::getElapsedTimeInSeconds() << ")" << std::endl;
+    };
+    imageWriter->submit(std::move(req));
 }
 
 void Renderer::startWorker(int workerid, Renderer* rndr) {
@@ -519,6 +773,13 @@ void Renderer::startWorker(int workerid, Renderer* rndr) {
 void Renderer::wokerMain(int workerid) {
     auto* info = &workerInfos[workerid];
     
+    if(pinThreads) {
+        int cpu = topology.cpuForWorker(workerid, numMaxJobs);
+        if(!CpuTopology::pinCurrentThread(cpu)) {
+            std::cerr << "worker " << workerid << " couldn't pin to cpu " << cpu << std::endl;
+        }
+    }
+    
     auto changeInfoState = [this](WorkerInfo* info, WorkerStatus s) {
         // std::unique_lock<std::mutex> lock(workerInfoMutex);
         info->status = s;
@@ -531,25 +792,29 @@ void Renderer::wokerMain(int workerid) {
         // info->status = WorkerStatus::kWaiting;
         changeInfoState(info, WorkerStatus::kWaiting);
         info->commandType = CommandType::kNoop;
-        {
+        
+        // read before looking at the queues, so a push during the scan is not slept through
+        const int pushserial = commandPushSerial.load();
+        bool hascmd = popCommand(workerid, &cmd);
+        if(!hascmd) {
             std::unique_lock<std::mutex> lock(commandQueueMutex);
-            workerCondition.wait(lock, [this]{
-                return !commandQueue.empty() || !interruptQueue.empty() || stopWorkers;
-            });
-            
-            if(!stopWorkers) {
+            if(!interruptQueue.empty()) {
                 processingWorkerCount.fetch_add(1);
-                if(!interruptQueue.empty()) {
-                    cmd = interruptQueue.front();
-                    interruptQueue.pop();
-                } else {
-                    cmd = commandQueue.front();
-                    commandQueue.pop();
-                }
+                cmd = interruptQueue.front();
+                interruptQueue.pop();
+                hascmd = true;
+            } else if(!stopWorkers) {
+                // commands left in skipped queues are taken by the thread holding
+                // the queue, which scans again after its command
+                info->idleCount += 1;
+                workerCondition.wait(lock, [this, pushserial]{
+                    return commandPushSerial.load() != pushserial || !interruptQueue.empty() || stopWorkers;
+                });
             }
         }
         
         if(stopWorkers) break;
+        if(!hascmd) continue;
         
         //info->status = WorkerStatus::kProcessing;
         changeInfoState(info, WorkerStatus::kProcessing);
@@ -558,9 +823,14 @@ void Renderer::wokerMain(int workerid) {
 
         //info->status = WorkerStatus::kDone;
         changeInfoState(info, WorkerStatus::kDone);
-        processingWorkerCount.fetch_sub(1);
-
-        managerCondition.notify_all();
+        
+        // only the last running worker wakes the manager
+        if(processingWorkerCount.fetch_sub(1) == 1 && queuedCommandCount.load() == 0) {
+            {
+                std::unique_lock<std::mutex> lock(commandQueueMutex);
+            }
+            managerCondition.notify_all();
+        }
     }
     
     info->status = WorkerStatus::kStopped;
@@ -570,7 +840,10 @@ void Renderer::wokerMain(int workerid) {
 void Renderer::processCommand(int workerid, JobCommand cmd) {
     switch (cmd.type) {
         case kRender:
+            // holds the scene store. setupFrame waits for it
+            storeRenderCounts[cmd.render.storeId].fetch_add(1);
             renderJob(workerid, cmd);
+            storeRenderCounts[cmd.render.storeId].fetch_sub(1);
             break;
         case kPostprocess:
             postprocessJob(workerid, cmd);
@@ -598,7 +871,7 @@ void Renderer::waitAllCommands() {
             //    }
             //}
             //return isempty && isdone;
-            return commandQueue.empty() && interruptQueue.empty() && (processingWorkerCount.load() == 0);
+            return isAllCommandsDone();
             });
     } else {
         waitAllAndLog();
@@ -628,7 +901,7 @@ void Renderer::waitAllAndLog() {
                 break;
             }
         }
-        waiting = isprocessing || !commandQueue.empty() || !interruptQueue.empty();
+        waiting = isprocessing || !isAllCommandsDone();
         
         // log
         logedtime = checkPrintProcessLog(logedtime);
@@ -656,7 +929,12 @@ void Renderer::waitRenderUntil(FrameBuffer* fb, int frameId, double startTime, d
         logedtime = checkPrintProcessLog(logedtime);
 
         // command check
-        if(commandQueue.empty() && interruptQueue.empty() && (processingWorkerCount.load() == 0)) {
+        if(isAllCommandsDone() && adaptiveNoiseTarget > 0.0) {
+            // tiles requeue themselves until converged
+            waiting = false;
+            break;
+        }
+        if(isAllCommandsDone()) {
             // refill
             std::sort(tileInfos.begin(), tileInfos.end(), [](TileInfo& a, TileInfo& b) {
                 return a.processTime > b.processTime;
@@ -694,12 +972,17 @@ double Renderer::checkPrintProcessLog(double logedTime) {
         };
         std::stringstream ss;
         ss << "[" << numMaxJobs << "]:";
+        long steals = 0, contended = 0, idles = 0;
         for (auto ite = workerInfos.begin(); ite != workerInfos.end(); ++ite) {
             auto info = *ite;
             ss << " " << stattbl[info.status] << cmdtbl[info.commandType];
             ss << ":" << info.infoValue0 << "," << info.infoValue1;
+            steals += info.stealCount;
+            contended += info.contendedCount;
+            idles += info.idleCount;
         }
         std::cout << ss.str() << std::endl;
+        std::cout << "  queued:" << queuedCommandCount.load() << " steal:" << steals << " contended:" << contended << " idle:" << idles << std::endl;
 
         logedTime = curtime;
     }
@@ -708,28 +991,97 @@ double Renderer::checkPrintProcessLog(double logedTime) {
 
 void Renderer::processAllCommands() {
     // for serial exection
-    while(!interruptQueue.empty() || !commandQueue.empty()) {
+    JobCommand cmd;
+    while(true) {
         if(!interruptQueue.empty()) {
-            auto cmd = interruptQueue.front();
+            cmd = interruptQueue.front();
             interruptQueue.pop();
-            processCommand(0, cmd);
+        } else if(popCommand(0, &cmd)) {
+            processingWorkerCount.fetch_sub(1);
         } else {
-            auto cmd = commandQueue.front();
-            commandQueue.pop();
-            processCommand(0, cmd);
+            break;
         }
+        processCommand(0, cmd);
+    }
+}
+
+void Renderer::setupQueues() {
+    // serial execution uses queue and info 0 too
+    int numqueues = std::max(1, numMaxJobs);
+    processingWorkerCount = 0;
+    queuedCommandCount = 0;
+    nextQueueIndex = 0;
+    workerQueues.clear();
+    workerInfos.resize(numqueues);
+    
+    int numnodes = numaAware ? topology.getNodeCount() : 1;
+    std::vector<int> workernodes(numqueues, 0);
+    nodeWorkers.assign(numnodes, std::vector<int>());
+    nodeQueueCursors.assign(numnodes, 0);
+    for(int i = 0; i < numqueues; i++) {
+        workernodes[i] = numaAware ? topology.nodeForWorker(i, numqueues) : 0;
+        nodeWorkers[workernodes[i]].push_back(i);
+    }
+    stealOrders.resize(numqueues);
+    for(int i = 0; i < numqueues; i++) {
+        auto& order = stealOrders[i];
+        order.clear();
+        order.push_back(i);
+        for(int local = 1; local >= 0; local--) {
+            for(int k = 1; k < numqueues; k++) {
+                int victim = (i + k) % numqueues;
+                if((workernodes[victim] == workernodes[i]) == (local == 1)) {
+                    order.push_back(victim);
+                }
+            }
+        }
+    }
+    
+    for(int i = 0; i < numqueues; i++) {
+        workerQueues.push_back(std::unique_ptr<WorkerQueue>(new WorkerQueue()));
+        workerInfos[i].status = WorkerStatus::kStart;
+        workerInfos[i].commandType = CommandType::kNoop;
+        workerInfos[i].stealCount = 0;
+        workerInfos[i].contendedCount = 0;
+        workerInfos[i].idleCount = 0;
+    }
+}
+
+void Renderer::placeFramebuffers() {
+    if(!numaAware) {
+        return;
+    }
+    
+    // first touch from a thread on each node places the pages there
+    const int numnodes = topology.getNodeCount();
+    const int numtiles = static_cast<int>(tileNodes.size());
+    std::vector<std::thread> touchThreads;
+    for(int inode = 0; inode < numnodes; inode++) {
+        touchThreads.emplace_back([this, inode, numtiles] {
+            CpuTopology::pinCurrentThread(topology.nodeCpus[inode][0]);
+            int starttile = 0;
+            while(starttile < numtiles && tileNodes[starttile] < inode) {
+                starttile += 1;
+            }
+            int endtile = starttile;
+            while(endtile < numtiles && tileNodes[endtile] == inode) {
+                endtile += 1;
+            }
+            for(auto ite = framebuffers.begin(); ite != framebuffers.end(); ++ite) {
+                (*ite)->initializeTiles(starttile, endtile);
+            }
+        });
+    }
+    for(auto ite = touchThreads.begin(); ite != touchThreads.end(); ++ite) {
+        ite->join();
     }
 }
 
 void Renderer::setupWorkers() {
     if(numMaxJobs <= 1) return;
-    processingWorkerCount = 0;
-    workerInfos.resize(numMaxJobs);
     stopWorkers = false;
     workerPool.reserve(numMaxJobs);
     for(int i = 0; i < numMaxJobs; i++) {
-        workerInfos[i].status = WorkerStatus::kStart;
-        workerInfos[i].commandType = CommandType::kNoop;
         workerPool.emplace_back(startWorker, i, this);
     }
 }
@@ -7,9 +7,12 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
 #include <queue>
+#include <deque>
 #include "random.h"
 #include "ray.h"
+#include "cputopology.h"
 
 namespace Petals {
     
@@ -17,6 +20,7 @@ namespace Petals {
     class Config;
     class FrameBuffer;
     class PostProcessor;
+    class ImageWriter;
     
     class Renderer {
     private:
@@ -24,6 +28,11 @@ namespace Petals {
         int samplesPerPixel;
         int pixelSubSamples;
         
+        double adaptiveNoiseTarget;
+        int adaptiveMinSamples;
+        int adaptivePassSamples;
+        int adaptiveMaxSamples;
+        
         int minDepth;
         int maxDepth;
         RTFloat minRussianRouletteCutOff;
@@ -46,11 +55,16 @@ namespace Petals {
             FrameBuffer* framebuffer;
             PostProcessor* postprocessor;
             RTTimeType exposureTimeRate;
+            int storeId; // scene store of the tile being rendered
         };
         
         std::vector<Context> renderContexts;
         int numMaxJobs;
         
+        CpuTopology topology;
+        bool pinThreads;
+        bool numaAware;
+        
         struct RenderResult {
             Color radiance;
             
@@ -87,6 +101,7 @@ namespace Petals {
             union {
                 struct {
                     int frameId;
+                    int storeId;
                     int tileInfoIndex;
                     int samples;
                     int subSamples;
@@ -115,16 +130,29 @@ namespace Petals {
             WorkerStatus status;
             int infoValue0;
             int infoValue1;
+            
+            // contention counters. written by the owner worker only
+            int stealCount;     // commands taken from other workers
+            int contendedCount; // queue lock was held by another thread. skipped when stealing
+            int idleCount;      // slept on workerCondition
+        };
+        
+        // per worker command deque. owner pops front, thieves steal back
+        struct alignas(64) WorkerQueue {
+            std::mutex mutex;
+            std::deque<JobCommand> commands;
         };
 
         struct TileInfo {
             RTTimeType processTime;
             int tileIndex;
+            RTFloat noise; // max relative error of unconverged pixels. 0: converged
         };
         
     public:
         std::vector<std::unique_ptr<FrameBuffer> > framebuffers;
         std::vector<std::unique_ptr<PostProcessor> > postprocessors;
+        std::unique_ptr<ImageWriter> imageWriter;
         Scene *scene;
         
     public:
@@ -149,24 +177,58 @@ namespace Petals {
         std::vector<WorkerInfo> workerInfos;
         // std::mutex workerInfoMutex;
         std::atomic<int> processingWorkerCount;
-        std::queue<JobCommand> commandQueue;
+        std::vector<std::unique_ptr<WorkerQueue> > workerQueues;
+        std::atomic<int> queuedCommandCount;
+        std::atomic<int> commandPushSerial; // incremented on each push under commandQueueMutex
+        int nextQueueIndex;
+        std::vector<std::vector<int> > stealOrders;  // [worker] -> queues to visit. own queue first
+        std::vector<std::vector<int> > nodeWorkers;  // [numa node] -> workers
+        std::vector<int> nodeQueueCursors;
         std::queue<JobCommand> interruptQueue;
-        std::mutex commandQueueMutex;
+        std::mutex commandQueueMutex; // interruptQueue and sleeping workers
         std::condition_variable workerCondition;
         std::condition_variable managerCondition;
         bool stopWorkers;
-        int renderingFrameId;
+        std::atomic<int> renderingFrameId;
+        int renderingStoreId;
+        
+        // frame pipelining. the next frame is set up in another scene store
+        // while this frame renders. a store is rewritten after its renders leave
+        static const int kMaxSceneStores = 2;
+        int numSceneStores;
+        std::atomic<int> storeRenderCounts[kMaxSceneStores];
+        std::atomic<double> frameDeadline; // adaptive passes are not requeued after this. <0: no limit
 
         std::vector<TileInfo> tileInfos;
-        
+        std::vector<int> tileNodes; // [tile index] -> numa node of its pixels
+
+        // processed frames go to the image writer with their buffer, which comes back after the encode.
+        // the frame loop waits here when the writer falls behind, workers never wait for it
+        std::vector<std::unique_ptr<FrameBuffer> > processedBufferPool;
+        int maxProcessedBuffers;
+        int allocatedProcessedBuffers;
+        std::mutex processedBufferMutex;
+        std::condition_variable processedBufferCondition;
+        
+        int commandQueueIndex(const JobCommand& cmd);
+        void pushCommands(const std::vector<JobCommand>& cmds);
+        void pushCommand(int queueindex, const JobCommand& cmd);
+        bool popCommand(int workerid, JobCommand* ocmd);
+        bool isAllCommandsDone() const;
         void pushRenderCommands(FrameBuffer* fb, int frameID, int spp, int ss);
-        void renderOneFrame(FrameBuffer* fb, PostProcessor* pp, RTTimeType opentime, RTTimeType closetime, int frameId);
+        void setupFrame(int frameId, int storeId);
+        void beginFrame(FrameBuffer* fb, PostProcessor* pp, int frameId, int storeId);
         void postProcessAndSave(FrameBuffer* fb, PostProcessor* pp, int frameid);
+        // nullptr when a new buffer can be allocated
+        std::unique_ptr<FrameBuffer> acquireProcessedBuffer();
+        void releaseProcessedBuffer(std::unique_ptr<FrameBuffer> fb);
         void waitAllCommands();
         void waitAllAndLog();
         void waitRenderUntil(FrameBuffer* fb, int frameId, double startTime, double timeLimit);
         double checkPrintProcessLog(double logedTime);
         void processAllCommands();
+        void setupQueues();
+        void placeFramebuffers();
         void setupWorkers();
         void cleanupWorkers();
     };
@@ -1,5 +1,6 @@
 #include <cmath>
 #include <iostream>
+#include <algorithm>
 
 #include "assetlibrary.h"
 #include "scene.h"
@@ -13,11 +14,14 @@
 #include "animation.h"
 #include "keyframesampler.h"
 #include "config.h"
+#include "jobsystem.h"
 
 using namespace Petals;
 
 Scene::Scene(AssetLibrary* al) :
-    assetLib(al)
+    assetLib(al),
+    storeCount(1),
+    reportBVHStatistics(false)
 {
 }
 
@@ -26,6 +30,15 @@ Scene* Scene::buildDefaultScene() {
 }
 
 bool Scene::preprocess(Config* config) {
+    // BVH settings
+    bvhBuildOption.type = BVH::BuildOption::parseBuildType(config->bvhBuilder);
+    bvhBuildOption.maxLeafSize = config->bvhMaxLeafSize;
+    bvhBuildOption.refitThreshold = config->bvhRefitThreshold;
+    reportBVHStatistics = config->bvhReport;
+    
+    // double buffered when frames are pipelined
+    storeCount = config->pipelineFrames ? 2 : 1;
+    
     // collect nodes
     containsNodes.reserve(assetLib->nodes.size());
 
@@ -35,15 +48,36 @@ bool Scene::preprocess(Config* config) {
         preprocessTraverse(node, m, config);
     }
     
+    // build mesh BVHs concurrently. a mesh may be shared by nodes
+    meshes.clear();
+    meshes.reserve(tracables.size());
+    for(auto i = tracables.begin(); i != tracables.end(); i++) {
+        auto* mesh = (*i)->content.mesh;
+        if(std::find(meshes.begin(), meshes.end(), mesh) == meshes.end()) {
+            meshes.push_back(mesh);
+        }
+    }
+    auto& jobs = JobSystem::shared();
+    jobs.parallelFor(static_cast<int>(meshes.size()), [this](int i) {
+        meshes[i]->preprocess(bvhBuildOption);
+    });
+    int numtrac = static_cast<int>(tracables.size());
+    jobs.parallelFor(numtrac * storeCount, [this, numtrac, config](int i) {
+        tracables[i % numtrac]->getTracable(i / numtrac)->initialize(config->exposureSlice, bvhBuildOption);
+    });
+    
     backgroundTexture = assetLib->backgroundTex.get();
     
-    int numtrac = static_cast<int>(tracables.size());
-    objectBVH = std::unique_ptr<BVH>(new BVH(numtrac));
-    auto* bvh = objectBVH.get();
-    for(int i = 0; i < numtrac; i++) {
-        auto* trc = tracables[i]->tracable.get();
-        trc->globalBounds.dataId = i;
-        objectBVH->appendLeaf(&trc->globalBounds);
+    objectBVHs.clear();
+    for(int istore = 0; istore < storeCount; istore++) {
+        auto* bvh = new BVH(numtrac, bvhBuildOption);
+        bvh->setMotionSliceCount(config->exposureSlice);
+        for(int i = 0; i < numtrac; i++) {
+            auto* trc = tracables[i]->getTracable(istore);
+            trc->globalBounds.dataId = i;
+            bvh->appendLeaf(&trc->globalBounds, trc->sliceBounds.data());
+        }
+        objectBVHs.push_back(std::unique_ptr<BVH>(bvh));
     }
     
     return true;
@@ -53,24 +87,18 @@ void Scene::preprocessTraverse(Node *node, Matrix4 gm, Config* config) {
     Matrix4 m = gm * node->initialTransform.matrix;
     node->initialTransform.globalMatrix = m;
     node->currentTransform = node->initialTransform;
-    node->transformCache.resize(config->exposureSlice);
+    node->transformCache.assign(storeCount, std::vector<Node::Transform>(config->exposureSlice));
     containsNodes.push_back(node);
     
     switch (node->contentType) {
         case Node::kContentTypeMesh:
-            node->content.mesh->preprocess();
-            if(node->tracable != nullptr) {
+            // mesh preprocess and tracable initialize are done in preprocess() after traverse
+            if(!node->tracableStores.empty()) {
                 std::cerr << "WARNING node " << node->name << " already has tracable." << std::endl;
-                node->tracable.reset();
+                node->tracableStores.clear();
             }
-            if(node->content.skin != nullptr) {
-                auto* trc = new SkinMeshStructure(node, node->content.mesh, node->content.skin);
-                trc->initialize(config->exposureSlice);
-                node->tracable = std::unique_ptr<TracableStructure>(trc);
-            } else {
-                auto* trc = new StaticMeshStructure(node, node->content.mesh);
-                trc->initialize(config->exposureSlice);
-                node->tracable = std::unique_ptr<TracableStructure>(trc);
+            for(int istore = 0; istore < storeCount; istore++) {
+                node->tracableStores.push_back(std::unique_ptr<TracableStructure>(createTracable(node, istore)));
             }
             tracables.push_back(node);
             break;
@@ -94,8 +122,22 @@ void Scene::preprocessTraverse(Node *node, Matrix4 gm, Config* config) {
     }
 }
 
+TracableStructure* Scene::createTracable(Node* node, int storeId) const {
+    if(node->content.skin != nullptr) {
+        return new SkinMeshStructure(node, node->content.mesh, node->content.skin, storeId);
+    } else {
+        return new StaticMeshStructure(node, node->content.mesh, storeId);
+    }
+}
+
 void Scene::seekTime(RTTimeType opentime, RTTimeType closetime, int slice, int storeId) {
     RTTimeType tdiv = static_cast<RTTimeType>(std::max(1, slice - 1)); // [0,1]
+    
+    // bounds are remade for this exposure
+    for (auto ite = tracables.begin(); ite != tracables.end(); ++ite) {
+        (*ite)->getTracable(storeId)->clearSlice();
+    }
+    
     for(int islc = 0; islc < slice; islc++) {
         RTTimeType t = static_cast<RTTimeType>(islc) / tdiv;
         RTTimeType curtime = opentime * (1.0 - t) + closetime * t;
@@ -139,13 +181,13 @@ void Scene::seekTime(RTTimeType opentime, RTTimeType closetime, int slice, int s
                 node->currentTransform.globalMatrix = node->currentTransform.matrix;
             }
             node->currentInverseGlobal = Matrix4::inverted(node->currentTransform.globalMatrix, nullptr);
-            node->transformCache[islc] = node->currentTransform;
+            node->transformCache[storeId][islc] = node->currentTransform;
         }
 
         // update traceables
         for (auto ite = tracables.begin(); ite != tracables.end(); ++ite) {
             auto* nd = *ite;
-            auto* trc = nd->tracable.get();
+            auto* trc = nd->getTracable(storeId);
             trc->updateSlice(islc);
         }
     }
@@ -154,7 +196,7 @@ void Scene::seekTime(RTTimeType opentime, RTTimeType closetime, int slice, int s
     buildAccelerationStructure(storeId);
 }
 
-RTFloat Scene::intersection(const Ray& ray, RTFloat hitnear, RTFloat hitfar, RTTimeType timerate, SceneIntersection *oisect) const {
+RTFloat Scene::intersection(const Ray& ray, RTFloat hitnear, RTFloat hitfar, RTTimeType timerate, SceneIntersection *oisect, int storeId) const {
     MeshIntersection meshisect;
     int traceableid = -1;
     RTFloat mint = -1.0;
@@ -164,7 +206,7 @@ RTFloat Scene::intersection(const Ray& ray, RTFloat hitnear, RTFloat hitfar, RTT
     int numMeshes = static_cast<int>(tracables.size());
     for(int i = 0; i < numMeshes; i++) {
         MeshIntersection isect;
-        auto* trc = tracables[i]->tracable.get();
+        auto* trc = tracables[i]->getTracable(storeId);
         RTFloat t = trc->intersection(ray, hitnear, hitfar, timerate, &isect);
         if(t > 0.0) {
             if(mint > t || mint < 0.0) {
@@ -188,9 +230,9 @@ RTFloat Scene::intersection(const Ray& ray, RTFloat hitnear, RTFloat hitfar, RTT
     } hitinfo;
     
     hitinfo.mint = -1.0;
-    mint = objectBVH->intersect(ray, hitnear, hitfar, [this, &hitinfo, &timerate](const Ray& ray, RTFloat neart, RTFloat fart, const AABB* bnd) {
+    mint = objectBVHs[storeId]->intersect(ray, hitnear, hitfar, timerate, [this, &hitinfo, &timerate, storeId](const Ray& ray, RTFloat neart, RTFloat fart, const AABB* bnd) {
         MeshIntersection isect;
-        auto* trc = tracables[bnd->dataId]->tracable.get();
+        auto* trc = tracables[bnd->dataId]->getTracable(storeId);
         RTFloat t = trc->intersection(ray, neart, fart, timerate, &isect);
         if(t > 0.0) {
             if(hitinfo.mint > t || hitinfo.mint < 0.0) {
@@ -210,25 +252,70 @@ RTFloat Scene::intersection(const Ray& ray, RTFloat hitnear, RTFloat hitfar, RTT
     
     if(mint > 0.0 && oisect != nullptr) {
         oisect->tracableId = traceableid;
+        oisect->storeId = storeId;
         oisect->meshIntersect = meshisect;
     }
     
     return mint;
 }
 
+bool Scene::occluded(const Ray& ray, RTFloat hitnear, RTFloat hitfar, RTTimeType timerate, int storeId) const {
+    return objectBVHs[storeId]->occluded(ray, hitnear, hitfar, timerate, [this, timerate, storeId](const Ray& ray, RTFloat neart, RTFloat fart, const AABB* bnd) {
+        const auto* trc = tracables[bnd->dataId]->getTracable(storeId);
+        return trc->occluded(ray, neart, fart, timerate);
+    });
+}
+
 void Scene::computeIntersectionDetail(const Ray& ray, RTFloat hitt, RTTimeType timerate, const SceneIntersection& isect, IntersectionDetail* odetail) const {
-    auto* trc = tracables[isect.tracableId]->tracable.get();
+    auto* trc = tracables[isect.tracableId]->getTracable(isect.storeId);
     trc->intersectionDetail(ray, hitt, timerate, isect.meshIntersect, odetail);
 }
 
 void Scene::buildAccelerationStructure(int storeId) {
-    (void)storeId; // TODO? multi buffering
+    // per mesh BVHs are independent
+    JobSystem::shared().parallelFor(static_cast<int>(tracables.size()), [this, storeId](int i) {
+        tracables[i]->getTracable(storeId)->updateFinished();
+    });
     
-    for (auto ite = tracables.begin(); ite != tracables.end(); ++ite) {
-        (*ite)->tracable->updateFinished();
+    objectBVHs[storeId]->update();
+    
+    if (reportBVHStatistics) {
+        reportAccelerationStructure();
+        reportBVHStatistics = false;
     }
+}
+
+void Scene::reportAccelerationStructure() const {
+    // object BVHs and skinned meshes are built per store
+    auto storelabel = [this](const std::string& name, int istore) {
+        return (storeCount > 1) ? name + " [store " + std::to_string(istore) + "]" : name;
+    };
     
-    auto* bvh = objectBVH.get();
-    bvh->updateAllLeafBounds();
-    bvh->build();
+    for (int istore = 0; istore < storeCount; istore++) {
+        objectBVHs[istore]->computeStatistics().print(storelabel("object", istore));
+    }
+    std::cout << "  instances:" << tracables.size() << ", unique meshes:" << meshes.size() << ", stores:" << storeCount << std::endl;
+    
+    // shared mesh BVHs
+    for (auto ite = meshes.begin(); ite != meshes.end(); ++ite) {
+        const auto* mesh = *ite;
+        auto numinst = std::count_if(tracables.begin(), tracables.end(), [mesh](const Node* node) {
+            return node->content.mesh == mesh;
+        });
+        mesh->triangleBVH->computeStatistics().print(mesh->name);
+        std::cout << "  triangles:" << mesh->totalTriangles << " (" << mesh->totalTriangles * sizeof(Mesh::Triangle) / 1024 << " KB)";
+        std::cout << ", packets:" << mesh->trianglePackets.size() << " (" << mesh->trianglePackets.size() * sizeof(Mesh::TrianglePacket) / 1024 << " KB)";
+        std::cout << ", instances:" << numinst << std::endl;
+    }
+    
+    // skinned meshes are deformed per node
+    for (auto ite = tracables.begin(); ite != tracables.end(); ++ite) {
+        const auto* node = *ite;
+        for (int istore = 0; istore < storeCount; istore++) {
+            const auto* skintrc = dynamic_cast<const SkinMeshStructure*>(node->getTracable(istore));
+            if (skintrc != nullptr) {
+                skintrc->cache->skinedBVH->computeStatistics().print(storelabel(node->name + " (skin)", istore));
+            }
+        }
+    }
 }
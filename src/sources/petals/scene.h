@@ -7,6 +7,7 @@
 #include "types.h"
 #include "ray.h"
 #include "intersection.h"
+#include "bvh.h"
 
 namespace Petals {
     
@@ -19,7 +20,6 @@ namespace Petals {
     class TracableStructure;
     class Config;
     class Texture;
-    class BVH;
     
     /////
     class Scene {
@@ -31,11 +31,17 @@ namespace Petals {
         std::vector<Node*> topLevelNodes;
         std::vector<Node*> containsNodes;
         
-        std::unique_ptr<BVH> objectBVH;
+        // scene stores. seekTime of the next frame writes one store while
+        // the current frame is traced from another
+        int storeCount;
+        std::vector<std::unique_ptr<BVH> > objectBVHs; // per store
+        BVH::BuildOption bvhBuildOption;
+        bool reportBVHStatistics;
 
     public:
         // for trace
-        std::vector<Node*> tracables;
+        std::vector<Node*> tracables;   // instances. leaves of objectBVHs
+        std::vector<Mesh*> meshes;      // unique meshes referred by instances
         std::vector<Node*> lights;
         std::vector<Node*> cameras;
         
@@ -45,6 +51,7 @@ namespace Petals {
         Scene(AssetLibrary* al);
         
         bool preprocess(Config* config);
+        int getStoreCount() const { return storeCount; }
         
         // ### About open/clise time, timerate and slice. ###
         // opentime [t0]                                [t1]closetime
@@ -52,12 +59,18 @@ namespace Petals {
         // slice(4) [0]         [1]         [2]         [3]
         //           |-----------|-----------|-----------|
         //
+        // storeId: [0, getStoreCount()). only the store is written, other stores can be traced meanwhile.
         void seekTime(RTTimeType opentime, RTTimeType closetime, int slice, int storeId);
-        RTFloat intersection(const Ray& ray, RTFloat hitnear, RTFloat hitfar, RTTimeType timerate, SceneIntersection *oisect) const;
+        RTFloat intersection(const Ray& ray, RTFloat hitnear, RTFloat hitfar, RTTimeType timerate, SceneIntersection *oisect, int storeId = 0) const;
+        bool occluded(const Ray& ray, RTFloat hitnear, RTFloat hitfar, RTTimeType timerate, int storeId = 0) const;
         void computeIntersectionDetail(const Ray& ray, RTFloat hitt, RTTimeType timerate, const SceneIntersection& isect, IntersectionDetail* odetail) const;
         
+        // print BVH statistics of object and mesh BVHs
+        void reportAccelerationStructure() const;
+        
     private:
         void preprocessTraverse(Node *node, Matrix4 gm, Config* config);
+        TracableStructure* createTracable(Node* node, int storeId) const;
         void buildAccelerationStructure(int storeId);
     };
 }
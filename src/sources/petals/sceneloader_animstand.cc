@@ -16,6 +16,7 @@
 #include "texture.h"
 #include "camera.h"
 #include "keyframesampler.h"
+#include "jobsystem.h"
 
 using namespace Petals;
 
@@ -73,7 +74,7 @@ namespace {
                 return false;
             }
 
-            auto& empres = cutobj->planeSetups.emplace(name, std::vector<std::shared_ptr<Plate>>());
+            auto empres = cutobj->planeSetups.emplace(name, std::vector<std::shared_ptr<Plate>>());
             auto& pltarray = empres.first->second;
             for (const auto& plt : plates) {
                 auto pltptr = std::make_shared<Plate>();
@@ -329,7 +330,7 @@ namespace {
                 std::cerr << "timesheet format error. require key:[array]" << std::endl;
                 return false;
             }
-            auto& empres = cutobj->timesheet.emplace(key, std::vector<std::string>());
+            auto empres = cutobj->timesheet.emplace(key, std::vector<std::string>());
             if (!empres.second) {
                 std::cerr << "timesheet allocation failed. less memory?" << std::endl;
                 return false;
@@ -367,10 +368,8 @@ namespace {
             auto celptr = std::make_shared<Cel>(name);
             auto* celobj = celptr.get();
 
-            noerr |= celobj->loadFile(src, pathstack.back());
-            if (!noerr) {
-                return false;
-            }
+            // the image is checked by LoadCels after all cuts are parsed
+            celobj->setSource(src, pathstack.back());
 
             std::string size;
             if (CheckContaintValue(img, "size", &size)) {
@@ -465,6 +464,37 @@ namespace {
         return true;
     }
 
+    // image headers of all banks are read on the shared job system. each file once, even when cuts share it.
+    // failures are reported in cut and cel name order after the jobs, and do not fail the load, as before
+    bool LoadCels(AnimationStand* animstand) {
+        std::vector<std::string> paths;
+        std::map<std::string, int> pathIndex;
+        for (const auto& cutite : animstand->cutList) {
+            for (const auto& celite : cutite.second->bank) {
+                const auto& path = celite.second->path;
+                if (pathIndex.emplace(path, static_cast<int>(paths.size())).second) {
+                    paths.push_back(path);
+                }
+            }
+        }
+
+        std::vector<char> valid(paths.size(), 0);
+        JobSystem::shared().parallelFor(static_cast<int>(paths.size()), [&](int i) {
+            int x, y, c;
+            valid[i] = stbi_info(paths[i].c_str(), &x, &y, &c) ? 1 : 0;
+        });
+
+        for (const auto& cutite : animstand->cutList) {
+            for (const auto& celite : cutite.second->bank) {
+                const auto& path = celite.second->path;
+                if (!valid[pathIndex[path]]) {
+                    std::cerr << "cel image load failed:[" << cutite.first << "][" << celite.first << "] " << path << std::endl;
+                }
+            }
+        }
+        return true;
+    }
+
     bool ParseMovieOutput(const nlohmann::json& json, std::vector<std::filesystem::path>& pathstack, AnimationStand* animstand) {
         if (!json.contains("output")) {
             std::cerr << "output not found" << std::endl;
@@ -585,6 +615,9 @@ AnimationStand* SceneLoader::loadAnimStand(std::string filepath) {
     bool noerr = true;
     noerr &= ParseCutList(jsonRoot, pathstack, animstand);
     noerr &= ParseMovie(jsonRoot, pathstack, animstand);
+    if (noerr) {
+        noerr &= LoadCels(animstand);
+    }
 
     if (!noerr) {
         delete animstand;
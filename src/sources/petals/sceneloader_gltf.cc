@@ -5,6 +5,7 @@
 #include <vector>
 #include <memory>
 #include <map>
+#include <set>
 
 #include <nlohmann/json.hpp>
 #include <stb/stb_image.h>
@@ -283,6 +284,21 @@ namespace {
         }
         assetlib->textures.reserve(model.textures.size());
         
+        // textures sampled as data by materials stay non linear. base color is linearized at load
+        std::set<int> datatextures;
+        for(const auto& gltfmat : model.materials) {
+            auto ite = gltfmat.values.find("metallicRoughnessTexture");
+            if(ite != gltfmat.values.end()) {
+                datatextures.insert(ite->second.TextureIndex());
+            }
+            for(const char* key : { "normalTexture", "occlusionTexture", "emissiveTexture" }) {
+                auto adite = gltfmat.additionalValues.find(key);
+                if(adite != gltfmat.additionalValues.end()) {
+                    datatextures.insert(adite->second.TextureIndex());
+                }
+            }
+        }
+        
         for(auto ite = model.textures.begin(); ite != model.textures.end(); ++ite) {
             const tinygltf::Texture& gltftex = *ite;
             const tinygltf::Image& gltfimg = model.images.at(gltftex.source);
@@ -295,14 +311,15 @@ namespace {
             
             ImageTexture *imgtex = new ImageTexture(gltfimg.width, gltfimg.height);
             imgtex->name = gltfimg.name;
+            bool linearize = datatextures.count(static_cast<int>(ite - model.textures.begin())) == 0;
             
             // Bitmap
             switch (gltfimg.bits) {
                 case 8:
-                    imgtex->initWith8BPPImage(gltfimg.image.data(), gltfimg.component, gamma);
+                    imgtex->initWith8BPPImage(gltfimg.image.data(), gltfimg.component, gamma, linearize);
                     break;
                 case 16:
-                    imgtex->initWith16BPPImage((const unsigned short*)gltfimg.image.data(), gltfimg.component, gamma);
+                    imgtex->initWith16BPPImage((const unsigned short*)gltfimg.image.data(), gltfimg.component, gamma, linearize);
                     break;
                 default:
                     std::cerr << "texture:" << gltftex.name;
@@ -310,7 +327,7 @@ namespace {
                     std::cerr << " is unsupported bits per pixels value:" << gltfimg.bits;
                     std::cerr << std::endl;
                     
-                    imgtex->fillColor(Color(1.0, 0.0, 1.0), 1.0, gamma);
+                    imgtex->fillColor(Color(1.0, 0.0, 1.0), 1.0, gamma, linearize);
                     break;
             }
             
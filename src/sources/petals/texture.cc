@@ -5,6 +5,8 @@
 //  Created by SatoruNAKAJIMA on 2019/08/16.
 //
 #include <iostream>
+#include <algorithm>
+#include <cstring>
 #include <stb/stb_image.h>
 
 #include "texture.h"
@@ -12,6 +14,71 @@
 
 using namespace Petals;
 
+namespace {
+    // IEEE half. rounds to nearest even, overflows to inf
+    uint16_t FloatToHalf(float f) {
+        uint32_t x;
+        std::memcpy(&x, &f, sizeof(x));
+        uint32_t sign = (x >> 16) & 0x8000;
+        int32_t exp = static_cast<int32_t>((x >> 23) & 0xff) - 127 + 15;
+        uint32_t mant = x & 0x7fffff;
+
+        if (((x >> 23) & 0xff) == 0xff) {
+            // inf, nan
+            return static_cast<uint16_t>(sign | 0x7c00 | (mant ? 0x200 : 0));
+        }
+        if (exp >= 31) {
+            return static_cast<uint16_t>(sign | 0x7c00);
+        }
+        if (exp <= 0) {
+            // denormal or zero
+            if (exp < -10) {
+                return static_cast<uint16_t>(sign);
+            }
+            mant |= 0x800000;
+            uint32_t shift = static_cast<uint32_t>(14 - exp);
+            uint32_t h = mant >> shift;
+            uint32_t rem = mant & ((1u << shift) - 1);
+            uint32_t halfway = 1u << (shift - 1);
+            if (rem > halfway || (rem == halfway && (h & 1))) {
+                h += 1;
+            }
+            return static_cast<uint16_t>(sign | h);
+        }
+        uint32_t h = (static_cast<uint32_t>(exp) << 10) | (mant >> 13);
+        uint32_t rem = mant & 0x1fff;
+        if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) {
+            h += 1; // may carry into the exponent, up to inf
+        }
+        return static_cast<uint16_t>(sign | h);
+    }
+
+    float HalfToFloat(uint16_t h) {
+        uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+        uint32_t exp = (h >> 10) & 0x1f;
+        uint32_t mant = h & 0x3ff;
+        uint32_t x;
+        if (exp == 0) {
+            if (mant == 0) {
+                x = sign;
+            } else {
+                // denormal
+                float f = std::ldexp(static_cast<float>(mant), -24);
+                return (sign != 0) ? -f : f;
+            }
+        } else if (exp == 31) {
+            x = sign | 0x7f800000 | (mant << 13);
+        } else {
+            x = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+        }
+        float f;
+        std::memcpy(&f, &x, sizeof(f));
+        return f;
+    }
+
+    constexpr float kHalfMax = 65504.0f;
+}
+
 // ImageTexture methods
 
 ImageTexture::ImageTexture(int w, int h):
@@ -19,15 +86,89 @@ ImageTexture::ImageTexture(int w, int h):
     height(h),
     hasAlpha(false),
     gamma(2.2),
+    isLinear(false),
     sampleType(kLinear),
     wrapX(kRepeat),
     wrapY(kRepeat)
 {
-    image = new TexcelSample[w * h];
+    // opaque black until initialized
+    for(int i = 0; i < 256; i++) {
+        decodeTable[i] = i / 255.0;
+    }
+    allocate(kRGBA8);
+    std::fill(texelsRGBA8.begin(), texelsRGBA8.end(), 0xff000000u);
 }
 
 ImageTexture::~ImageTexture() {
-    delete [] image;
+}
+
+void ImageTexture::allocate(TexelFormat fmt) {
+    size_t numtexels = static_cast<size_t>(width) * height;
+    format = fmt;
+    texelsRGBA8.clear();
+    texelsRGBA16F.clear();
+    texelsRGBA32F.clear();
+    texelsRGBA8.shrink_to_fit();
+    texelsRGBA16F.shrink_to_fit();
+    texelsRGBA32F.shrink_to_fit();
+    switch (fmt) {
+        case kRGBA8:
+            texelsRGBA8.resize(numtexels);
+            break;
+        case kRGBA16F:
+            texelsRGBA16F.resize(numtexels * 4);
+            break;
+        case kRGBA32F:
+            texelsRGBA32F.resize(numtexels * 4);
+            break;
+    }
+}
+
+size_t ImageTexture::getTexelBytes() const {
+    return texelsRGBA8.size() * sizeof(uint32_t) + texelsRGBA16F.size() * sizeof(uint16_t) + texelsRGBA32F.size() * sizeof(float);
+}
+
+TexcelSample ImageTexture::getTexel(int x, int y) const {
+    TexcelSample ret;
+    size_t i = static_cast<size_t>(x) + static_cast<size_t>(y) * width;
+    switch (format) {
+        case kRGBA8:
+        {
+            uint32_t t = texelsRGBA8[i];
+            ret.rgb.r = decodeTable[t & 0xff];
+            ret.rgb.g = decodeTable[(t >> 8) & 0xff];
+            ret.rgb.b = decodeTable[(t >> 16) & 0xff];
+            ret.a = (t >> 24) / 255.0;
+        }
+            break;
+        case kRGBA16F:
+        {
+            const uint16_t* t = texelsRGBA16F.data() + i * 4;
+            ret.rgb.r = HalfToFloat(t[0]);
+            ret.rgb.g = HalfToFloat(t[1]);
+            ret.rgb.b = HalfToFloat(t[2]);
+            ret.a = HalfToFloat(t[3]);
+        }
+            break;
+        case kRGBA32F:
+        {
+            const float* t = texelsRGBA32F.data() + i * 4;
+            ret.rgb.r = t[0];
+            ret.rgb.g = t[1];
+            ret.rgb.b = t[2];
+            ret.a = t[3];
+        }
+            break;
+    }
+    return ret;
+}
+
+void ImageTexture::setTexel16F(size_t i, const TexcelSample& texel) {
+    uint16_t* t = texelsRGBA16F.data() + i * 4;
+    t[0] = FloatToHalf(static_cast<float>(texel.rgb.r));
+    t[1] = FloatToHalf(static_cast<float>(texel.rgb.g));
+    t[2] = FloatToHalf(static_cast<float>(texel.rgb.b));
+    t[3] = FloatToHalf(static_cast<float>(texel.a));
 }
 
 TexcelSample ImageTexture::sample(RTFloat x, RTFloat y, bool gammacorrect) const {
@@ -45,17 +186,17 @@ TexcelSample ImageTexture::sample(RTFloat x, RTFloat y, bool gammacorrect) const
     
     switch (sampleType) {
         case kNearest:
-            ret = image[ix + iy * width];
+            ret = getTexel(ix, iy);
             break;
         case kLinear:
         default:
         {
             int ix1 = wrapSampleX(ix + 1);
             int iy1 = wrapSampleY(iy + 1);
-            TexcelSample s00 = image[ix  + iy * width];
-            TexcelSample s10 = image[ix1 + iy * width];
-            TexcelSample s01 = image[ix  + iy1 * width];
-            TexcelSample s11 = image[ix1 + iy1 * width];
+            TexcelSample s00 = getTexel(ix, iy);
+            TexcelSample s10 = getTexel(ix1, iy);
+            TexcelSample s01 = getTexel(ix, iy1);
+            TexcelSample s11 = getTexel(ix1, iy1);
             
             RTColorType tx0 = 1.0 - tx;
             RTColorType tx1 = tx;
@@ -75,58 +216,121 @@ TexcelSample ImageTexture::sample(RTFloat x, RTFloat y, bool gammacorrect) const
             break;
     }
 
-    if (gammacorrect) { ret.powRGB(gamma); }
+    if (gammacorrect && !isLinear) { ret.powRGB(gamma); }
     
     return ret;
 }
 
-void ImageTexture::fillColor(const Color rgb, RTColorType a, double gamma) {
+void ImageTexture::fillColor(const Color rgb, RTColorType a, double gamma, bool linearize) {
     this->gamma = gamma;
-    for(int i = 0; i < width * height; i++) {
-        image[i].rgb = rgb;
-        image[i].a = a;
-        //image[i].powRGB(gamma);
+    isLinear = linearize;
+    TexcelSample fill;
+    fill.rgb = rgb;
+    fill.a = a;
+    if (linearize) {
+        fill.powRGB(gamma);
+    }
+    allocate(kRGBA32F);
+    for(size_t i = 0; i < texelsRGBA32F.size(); i += 4) {
+        texelsRGBA32F[i + 0] = static_cast<float>(fill.rgb.r);
+        texelsRGBA32F[i + 1] = static_cast<float>(fill.rgb.g);
+        texelsRGBA32F[i + 2] = static_cast<float>(fill.rgb.b);
+        texelsRGBA32F[i + 3] = static_cast<float>(fill.a);
     }
 }
 
-void ImageTexture::initWith8BPPImage(const unsigned char *src, int comps, double gamma) {
+void ImageTexture::initWith8BPPImage(const unsigned char *src, int comps, double gamma, bool linearize) {
     this->gamma = gamma;
+    isLinear = linearize;
+
+    // kept encoded, decoded by the table on fetch
+    for(int i = 0; i < 256; i++) {
+        decodeTable[i] = linearize ? std::pow(i / 255.0, gamma) : i / 255.0;
+    }
+
+    allocate(kRGBA8);
     for(int i = 0; i < width * height; i++) {
-        TexcelSample& texel = image[i];
         int isrc = i * comps;
-        texel.rgb.r = src[isrc] / 255.0;
-        texel.rgb.g = (comps < 2) ? texel.rgb.r : src[isrc + 1] / 255.0;
-        texel.rgb.b = (comps < 3) ? texel.rgb.r : src[isrc + 2] / 255.0;
-        texel.a = (comps < 4) ? 1.0 : src[isrc + 3] / 255.0;
-        //texel.powRGB(gamma);
+        uint32_t r = src[isrc];
+        uint32_t g = (comps < 2) ? r : src[isrc + 1];
+        uint32_t b = (comps < 3) ? r : src[isrc + 2];
+        uint32_t a = (comps < 4) ? 255 : src[isrc + 3];
+        texelsRGBA8[i] = r | (g << 8) | (b << 16) | (a << 24);
     }
     hasAlpha = (comps >= 4);
 }
 
-void ImageTexture::initWith16BPPImage(const unsigned short *src, int comps, double gamma) {
+void ImageTexture::initWith16BPPImage(const unsigned short *src, int comps, double gamma, bool linearize) {
     this->gamma = gamma;
+    isLinear = linearize;
+
+    // decode table. small images are cheaper to convert directly
+    std::vector<RTColorType> lut;
+    if (linearize && width * height * 3 > 65536) {
+        lut.resize(65536);
+        for(int i = 0; i < 65536; i++) {
+            lut[i] = std::pow(i / 65535.0, gamma);
+        }
+    }
+    auto decode = [&](unsigned short c) {
+        if (!lut.empty()) {
+            return lut[c];
+        }
+        RTColorType x = c / 65535.0;
+        return linearize ? std::pow(x, gamma) : x;
+    };
+
+    allocate(kRGBA16F);
     for(int i = 0; i < width * height; i++) {
-        TexcelSample& texel = image[i];
+        TexcelSample texel;
         int isrc = i * comps;
-        texel.rgb.r = src[isrc] / 65535.0;
-        texel.rgb.g = (comps < 2) ? texel.rgb.r : src[isrc + 1] / 65535.0;
-        texel.rgb.b = (comps < 3) ? texel.rgb.r : src[isrc + 2] / 65535.0;
+        texel.rgb.r = decode(src[isrc]);
+        texel.rgb.g = (comps < 2) ? texel.rgb.r : decode(src[isrc + 1]);
+        texel.rgb.b = (comps < 3) ? texel.rgb.r : decode(src[isrc + 2]);
         texel.a = (comps < 4) ? 1.0 : src[isrc + 3] / 65535.0;
-        //texel.powRGB(gamma);
+        setTexel16F(i, texel);
     }
     hasAlpha = (comps >= 4);
 }
 
-void ImageTexture::initWithFpImage(const float *src, int comps, double gamma) {
+void ImageTexture::initWithFpImage(const float *src, int comps, double gamma, bool linearize) {
     this->gamma = gamma;
-    for(int i = 0; i < width * height; i++) {
-        TexcelSample& texel = image[i];
+    isLinear = linearize;
+    bool decode = linearize && gamma != 1.0;
+
+    auto texelAt = [&](int i) {
+        TexcelSample texel;
         int isrc = i * comps;
         texel.rgb.r = src[isrc];
         texel.rgb.g = (comps < 2) ? texel.rgb.r : src[isrc + 1];
         texel.rgb.b = (comps < 3) ? texel.rgb.r : src[isrc + 2];
         texel.a = (comps < 4) ? 1.0 : src[isrc + 3];
-        //texel.powRGB(gamma);
+        if (decode) {
+            texel.powRGB(gamma);
+        }
+        return texel;
+    };
+
+    // half unless a value does not fit
+    bool fitsHalf = true;
+    for(int i = 0; i < width * height && fitsHalf; i++) {
+        auto texel = texelAt(i);
+        fitsHalf = std::abs(texel.rgb.r) <= kHalfMax && std::abs(texel.rgb.g) <= kHalfMax &&
+                   std::abs(texel.rgb.b) <= kHalfMax && std::abs(texel.a) <= kHalfMax;
+    }
+
+    allocate(fitsHalf ? kRGBA16F : kRGBA32F);
+    for(int i = 0; i < width * height; i++) {
+        auto texel = texelAt(i);
+        if (fitsHalf) {
+            setTexel16F(i, texel);
+        } else {
+            float* t = texelsRGBA32F.data() + static_cast<size_t>(i) * 4;
+            t[0] = static_cast<float>(texel.rgb.r);
+            t[1] = static_cast<float>(texel.rgb.g);
+            t[2] = static_cast<float>(texel.rgb.b);
+            t[3] = static_cast<float>(texel.a);
+        }
     }
     hasAlpha = (comps >= 4);
 }
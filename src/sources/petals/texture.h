@@ -5,6 +5,7 @@
 #include <vector>
 #include <memory>
 #include <cmath>
+#include <cstdint>
 
 #include <petals/types.h>
 
@@ -33,7 +34,7 @@ namespace Petals {
         Texture() {};
         virtual ~Texture() {};
         
-        // (0,0) to (1,1)
+        // (0,0) to (1,1). gammacorrect returns linear color, otherwise stored values
         virtual TexcelSample sample(RTFloat x, RTFloat y, bool gammacorrect) const = 0;
 
         TexcelSample sampleEquirectangular(const Vector3& v, bool gc) const {
@@ -56,6 +57,12 @@ namespace Petals {
             kClamp,
             kRepeat
         };
+        // texel storage, picked from the source by the init functions
+        enum TexelFormat {
+            kRGBA8,   // 8bit sources. rgb goes through decodeTable on fetch
+            kRGBA16F, // 16bit sources, float sources in half range
+            kRGBA32F  // float sources out of half range, fill color
+        };
         
     public:
         ImageTexture(int w, int h);
@@ -63,11 +70,13 @@ namespace Petals {
         
         virtual TexcelSample sample(RTFloat x, RTFloat y, bool gammacorrect) const;
         
-        void fillColor(const Color rgb, RTColorType a, double gamma);
+        // color images are decoded to linear space here, once.
+        // linearize = false keeps data textures (normal, roughness, ...) as they are
+        void fillColor(const Color rgb, RTColorType a, double gamma, bool linearize = true);
         
-        void initWith8BPPImage(const unsigned char *src, int comps, double gamma);
-        void initWith16BPPImage(const unsigned short *src, int comps, double gamma);
-        void initWithFpImage(const float *src, int comps, double gamma);
+        void initWith8BPPImage(const unsigned char *src, int comps, double gamma, bool linearize = true);
+        void initWith16BPPImage(const unsigned short *src, int comps, double gamma, bool linearize = true);
+        void initWithFpImage(const float *src, int comps, double gamma, bool linearize = true);
         
         static ImageTexture* loadImageFile(std::string path);
         
@@ -76,6 +85,7 @@ namespace Petals {
         int height;
         bool hasAlpha;
         RTFloat gamma;
+        bool isLinear; // fetched texels are gamma decoded
         
         SampleType sampleType;
         WrapType wrapX;
@@ -86,9 +96,25 @@ namespace Petals {
             wrapY = wy;
         }
         void setWrap(WrapType w) { setWrap(w, w); }
+
+        // stored texel. linear when isLinear
+        TexcelSample getTexel(int x, int y) const;
+
+        TexelFormat getFormat() const { return format; }
+        size_t getTexelBytes() const;
+        // kRGBA8 texels, r in the low byte. rgb is decoded with getDecodeTable
+        const uint32_t* getRGBA8Data() const { return texelsRGBA8.data(); }
+        const RTColorType* getDecodeTable() const { return decodeTable; }
         
     private:
-        TexcelSample *image;
+        TexelFormat format;
+        std::vector<uint32_t> texelsRGBA8;
+        std::vector<uint16_t> texelsRGBA16F;
+        std::vector<float> texelsRGBA32F;
+        RTColorType decodeTable[256];
+
+        void allocate(TexelFormat fmt);
+        void setTexel16F(size_t i, const TexcelSample& texel);
         
         int wrapSampleX(int x) const;
         int wrapSampleY(int y) const;
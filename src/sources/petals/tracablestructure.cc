@@ -5,6 +5,8 @@
 //  Created by SatoruNAKAJIMA on 2022/08/14.
 //
 
+#include <cmath>
+#include <algorithm>
 #include "tracablestructure.h"
 #include "mesh.h"
 #include "skin.h"
@@ -15,11 +17,167 @@
 
 using namespace Petals;
 
+namespace {
+    // rotation part of column basis m. Shepperd's method
+    Quaterion RotationFromBasis(const Vector3& c0, const Vector3& c1, const Vector3& c2) {
+        // r[row][col]
+        const RTFloat r00 = c0.x, r10 = c0.y, r20 = c0.z;
+        const RTFloat r01 = c1.x, r11 = c1.y, r21 = c1.z;
+        const RTFloat r02 = c2.x, r12 = c2.y, r22 = c2.z;
+        Quaterion q;
+        RTFloat trace = r00 + r11 + r22;
+        if (trace > 0.0) {
+            RTFloat s = std::sqrt(trace + 1.0) * 2.0;
+            q.set((r21 - r12) / s, (r02 - r20) / s, (r10 - r01) / s, 0.25 * s);
+        } else if (r00 > r11 && r00 > r22) {
+            RTFloat s = std::sqrt(1.0 + r00 - r11 - r22) * 2.0;
+            q.set(0.25 * s, (r01 + r10) / s, (r02 + r20) / s, (r21 - r12) / s);
+        } else if (r11 > r22) {
+            RTFloat s = std::sqrt(1.0 + r11 - r00 - r22) * 2.0;
+            q.set((r01 + r10) / s, 0.25 * s, (r12 + r21) / s, (r02 - r20) / s);
+        } else {
+            RTFloat s = std::sqrt(1.0 + r22 - r00 - r11) * 2.0;
+            q.set((r02 + r20) / s, (r12 + r21) / s, 0.25 * s, (r10 - r01) / s);
+        }
+        q.normalize();
+        return q;
+    }
+}
+
+// MeshInstance
+void MeshInstance::setMatrix(const Matrix4& gm, const Matrix4& igm) {
+    globalMatrix = gm;
+    invGlobalMatrix = igm;
+    
+    Vector3 c0(gm.m00, gm.m01, gm.m02);
+    Vector3 c1(gm.m10, gm.m11, gm.m12);
+    Vector3 c2(gm.m20, gm.m21, gm.m22);
+    translate.set(gm.m30, gm.m31, gm.m32);
+    scale.set(c0.length(), c1.length(), c2.length());
+    if (Vector3::dot(Vector3::cross(c0, c1), c2) < 0.0) {
+        scale.x = -scale.x;
+    }
+    
+    isDecomposed = (scale.x != 0.0 && scale.y != 0.0 && scale.z != 0.0);
+    if (!isDecomposed) {
+        return;
+    }
+    rotation = RotationFromBasis(c0 / scale.x, c1 / scale.y, c2 / scale.z);
+    
+    // reject shear. recomposed matrix must match
+    Matrix4 rm = rotation.getMatrix();
+    rm.scale(scale);
+    const RTFloat tol = 1e-6 * std::max(std::abs(scale.x), std::max(std::abs(scale.y), std::abs(scale.z)));
+    for (int col = 0; col < 3 && isDecomposed; col++) {
+        for (int row = 0; row < 3; row++) {
+            if (std::abs(rm.m[col * 4 + row] - gm.m[col * 4 + row]) > tol) {
+                isDecomposed = false;
+                break;
+            }
+        }
+    }
+}
+
+void MeshInstance::interpolate(const MeshInstance& inst0, const MeshInstance& inst1, RTFloat t, Matrix4* ogm, Matrix4* oigm) {
+    // normalized lerp. rotation between slices is small
+    Quaterion q1 = inst1.rotation;
+    RTFloat qdot = inst0.rotation.x * q1.x + inst0.rotation.y * q1.y + inst0.rotation.z * q1.z + inst0.rotation.w * q1.w;
+    if (qdot < 0.0) {
+        q1 = q1 * -1.0;
+    }
+    Quaterion q = Quaterion::lerp(inst0.rotation, q1, t);
+    q.normalize();
+    Vector3 s = Vector3::lerp(inst0.scale, inst1.scale, t);
+    Vector3 tr = Vector3::lerp(inst0.translate, inst1.translate, t);
+    
+    Matrix4 rm = q.getMatrix();
+    if (ogm != nullptr) {
+        // T * R * S
+        *ogm = rm;
+        ogm->scale(s);
+        ogm->m30 = tr.x;
+        ogm->m31 = tr.y;
+        ogm->m32 = tr.z;
+    }
+    if (oigm != nullptr) {
+        // S^-1 * R^T * T^-1
+        Matrix4& im = *oigm;
+        im = Matrix4::transposed(rm);
+        Vector3 is(1.0 / s.x, 1.0 / s.y, 1.0 / s.z);
+        for (int col = 0; col < 3; col++) {
+            im.m[col * 4 + 0] *= is.x;
+            im.m[col * 4 + 1] *= is.y;
+            im.m[col * 4 + 2] *= is.z;
+        }
+        Vector3 it = Matrix4::mulV3(im, tr);
+        im.m30 = -it.x;
+        im.m31 = -it.y;
+        im.m32 = -it.z;
+    }
+}
+
+// TracableStructure
+void TracableStructure::initializeInstance(int maxslice) {
+    const auto& gm = ownerNode->initialTransform.globalMatrix;
+    instance.setMatrix(gm, Matrix4::inverted(gm, nullptr));
+    instance.meshId = mesh->assetId;
+    sliceInstances.assign(std::max(1, maxslice), instance);
+    sliceBounds.assign(std::max(1, maxslice), AABB());
+}
+
+void TracableStructure::updateInstance(int sliceId) {
+    // global matrices of the slice are made by Scene::seekTime
+    sliceInstances[sliceId].setMatrix(ownerNode->currentTransform.globalMatrix, ownerNode->currentInverseGlobal);
+}
+
+void TracableStructure::instanceTransform(RTTimeType timerate, Matrix4* ogm, Matrix4* oigm) const {
+    const MeshInstance* inst = nullptr;
+    if (ownerNode->animatedFlag == 0) {
+        inst = &instance;
+    } else if (sliceInstances.size() == 1) {
+        // no motion in exposure
+        inst = &sliceInstances[0];
+    } else {
+        int lastindex = static_cast<int>(sliceInstances.size() - 1);
+        RTFloat ti = std::max(0.0, std::min(1.0, static_cast<RTFloat>(timerate))) * lastindex;
+        int i0 = std::min(static_cast<int>(ti), lastindex - 1);
+        RTFloat t = ti - i0;
+        const auto& inst0 = sliceInstances[i0];
+        const auto& inst1 = sliceInstances[i0 + 1];
+        if (t <= 0.0) {
+            inst = &inst0;
+        } else if (t >= 1.0) {
+            inst = &inst1;
+        } else if (inst0.isDecomposed && inst1.isDecomposed) {
+            MeshInstance::interpolate(inst0, inst1, t, ogm, oigm);
+            return;
+        } else {
+            // sheared. evaluate node animation
+            Matrix4 gm = ownerNode->computeGlobalMatrix(timerate, storeId);
+            if (oigm != nullptr) {
+                *oigm = Matrix4::inverted(gm, nullptr);
+            }
+            if (ogm != nullptr) {
+                *ogm = gm;
+            }
+            return;
+        }
+    }
+    
+    if (ogm != nullptr) {
+        *ogm = inst->globalMatrix;
+    }
+    if (oigm != nullptr) {
+        *oigm = inst->invGlobalMatrix;
+    }
+}
+
 // StaticMeshStructure
-void StaticMeshStructure::initialize(int maxslice) {
+// the triangle BVH is shared by instances and built in Mesh::preprocess
+void StaticMeshStructure::initialize(int maxslice, const BVH::BuildOption&) {
+    initializeInstance(maxslice);
     if (ownerNode->animatedFlag == 0) {
-        const auto& gm = ownerNode->initialTransform.globalMatrix;
-        invGlobalMatrix = Matrix4::inverted(gm, nullptr);
+        const auto& gm = instance.globalMatrix;
         
         // tight bounds
         globalBounds.clear();
@@ -30,6 +188,7 @@ void StaticMeshStructure::initialize(int maxslice) {
                 globalBounds.expand(v);
             }
         }
+        sliceBounds.assign(sliceBounds.size(), globalBounds);
     }
 }
 
@@ -40,15 +199,56 @@ void StaticMeshStructure::clearSlice() {
 }
 
 void StaticMeshStructure::updateSlice(int sliceId) {
+    updateInstance(sliceId);
+    
     // update AABB
     if (ownerNode->animatedFlag != 0) {
         const auto& gm = ownerNode->currentTransform.globalMatrix;
-        globalBounds.expand(AABB::transformed(mesh->bounds, gm));
+        sliceBounds[sliceId] = AABB::transformed(mesh->bounds, gm);
+        globalBounds.expand(sliceBounds[sliceId]);
     }
 }
 
 void StaticMeshStructure::updateFinished() {
-    // TODO
+    const int numslices = static_cast<int>(sliceBounds.size());
+    if (ownerNode->animatedFlag == 0 || numslices <= 1) {
+        return;
+    }
+    
+    // rotation between slices bulges out of interpolated slice bounds.
+    // a point at distance r deviates from the lerp by at most r * angle
+    std::vector<RTFloat> pads(numslices, 0.0);
+    RTFloat radius = 0.0;
+    for (int i = 0; i < 8; i++) {
+        Vector3 corner((i & 1) ? mesh->bounds.max.x : mesh->bounds.min.x,
+                       (i & 2) ? mesh->bounds.max.y : mesh->bounds.min.y,
+                       (i & 4) ? mesh->bounds.max.z : mesh->bounds.min.z);
+        radius = std::max(radius, corner.length());
+    }
+    for (int i = 0; i < numslices - 1; i++) {
+        const auto& inst0 = sliceInstances[i];
+        const auto& inst1 = sliceInstances[i + 1];
+        if (!inst0.isDecomposed || !inst1.isDecomposed) {
+            // interpolated by node animation. no guarantee
+            sliceBounds.assign(numslices, globalBounds);
+            return;
+        }
+        RTFloat qdot = std::abs(inst0.rotation.x * inst1.rotation.x + inst0.rotation.y * inst1.rotation.y + inst0.rotation.z * inst1.rotation.z + inst0.rotation.w * inst1.rotation.w);
+        RTFloat angle = 2.0 * std::acos(std::min(static_cast<RTFloat>(1.0), qdot));
+        RTFloat maxscale = 0.0;
+        for (int a = 0; a < 3; a++) {
+            maxscale = std::max(maxscale, std::max(std::abs(inst0.scale.v[a]), std::abs(inst1.scale.v[a])));
+        }
+        RTFloat pad = radius * maxscale * angle;
+        pads[i] = std::max(pads[i], pad);
+        pads[i + 1] = std::max(pads[i + 1], pad);
+    }
+    for (int i = 0; i < numslices; i++) {
+        Vector3 padv(pads[i], pads[i], pads[i]);
+        sliceBounds[i].min -= padv;
+        sliceBounds[i].max += padv;
+        globalBounds.expand(sliceBounds[i]);
+    }
 }
 
 RTFloat StaticMeshStructure::intersection(const Ray& ray, RTFloat nearhit, RTFloat farhit, RTTimeType timerate, MeshIntersection* oisect) const {
@@ -59,13 +259,7 @@ RTFloat StaticMeshStructure::intersection(const Ray& ray, RTFloat nearhit, RTFlo
         return -1.0;
     }
 
-    if (ownerNode->animatedFlag == 0) {
-        igm = invGlobalMatrix;
-        gm = ownerNode->initialTransform.globalMatrix;
-    } else {
-        gm = ownerNode->computeGlobalMatrix(timerate);
-        igm = Matrix4::inverted(gm, nullptr);
-    }
+    instanceTransform(timerate, &gm, &igm);
     
     Ray lray = ray.transformed(igm);
     Vector3 lnearp = Matrix4::transformV3(igm, ray.pointAt(nearhit));
@@ -84,18 +278,30 @@ RTFloat StaticMeshStructure::intersection(const Ray& ray, RTFloat nearhit, RTFlo
     return (ray.origin - ghp).length();
 }
 
+bool StaticMeshStructure::occluded(const Ray& ray, RTFloat nearhit, RTFloat farhit, RTTimeType timerate) const {
+    Matrix4 igm;
+    
+    if(!globalBounds.isIntersect(ray, nearhit, farhit)) {
+        return false;
+    }
+
+    instanceTransform(timerate, nullptr, &igm);
+    
+    Ray lray = ray.transformed(igm);
+    Vector3 lnearp = Matrix4::transformV3(igm, ray.pointAt(nearhit));
+    RTFloat lnearhit = (lnearp - lray.origin).length();
+    Vector3 lfarp = Matrix4::transformV3(igm, ray.pointAt(farhit));
+    RTFloat lfarhit = (lfarp - lray.origin).length();
+    
+    return mesh->occluded(lray, lnearhit, lfarhit);
+}
+
 void StaticMeshStructure::intersectionDetail(const Ray& ray, RTFloat hitt, RTTimeType timerate, const MeshIntersection& isect, IntersectionDetail* odetail) const {
     Matrix4 gm;
     Matrix4 igm;
     Matrix4 itgm;
 
-    if (ownerNode->animatedFlag == 0) {
-        gm = ownerNode->initialTransform.globalMatrix;
-        igm = invGlobalMatrix;
-    } else {
-        gm = ownerNode->computeGlobalMatrix(timerate);
-        igm = Matrix4::inverted(gm, nullptr);
-    }
+    instanceTransform(timerate, &gm, &igm);
 
     itgm = Matrix4::transposed(igm);
     
@@ -140,22 +346,25 @@ void StaticMeshStructure::intersectionDetail(const Ray& ray, RTFloat hitt, RTTim
 }
 
 // SkinMeshStructure
-void SkinMeshStructure::initialize(int maxslice) {
-    if (ownerNode->animatedFlag == 0) {
-        invGlobalMatrix = Matrix4::inverted(ownerNode->initialTransform.globalMatrix, nullptr);
-    }
+void SkinMeshStructure::initialize(int maxslice, const BVH::BuildOption& bvhopt) {
+    initializeInstance(maxslice);
     jointMatrices.resize(skin->jointNodes.size());
     jointInvTransMatrices.resize(skin->jointNodes.size());
     
-    auto* mc = new MeshCache(mesh, maxslice);
+    auto* mc = new MeshCache(mesh, maxslice, bvhopt);
     cache = std::unique_ptr<MeshCache>(mc);
 }
 
 void SkinMeshStructure::clearSlice() {
     globalBounds.clear();
+    for(auto ite = cache->clusterCaches.begin(); ite != cache->clusterCaches.end(); ++ite) {
+        ite->get()->clearWholeSliceData();
+    }
 }
 
 void SkinMeshStructure::updateSlice(int sliceId) {
+    updateInstance(sliceId);
+    
     // make joint matrix table
     for (size_t ijoint = 0; ijoint < skin->jointNodes.size(); ijoint++) {
         auto* jnode = skin->jointNodes[ijoint];
@@ -166,8 +375,10 @@ void SkinMeshStructure::updateSlice(int sliceId) {
 
     cache->createSkinDeformed(sliceId, ownerNode->currentTransform.globalMatrix, jointMatrices, jointInvTransMatrices);
     
+    sliceBounds[sliceId].clear();
     for(auto ite = cache->clusterCaches.begin(); ite != cache->clusterCaches.end(); ++ite) {
         auto* clstr = ite->get();
+        sliceBounds[sliceId].expand(clstr->sliceBounds[sliceId]);
         globalBounds.expand(clstr->wholeBounds);
     }
 }
@@ -187,6 +398,14 @@ RTFloat SkinMeshStructure::intersection(const Ray& ray, RTFloat nearhit, RTFloat
     return ret;
 }
 
+bool SkinMeshStructure::occluded(const Ray& ray, RTFloat nearhit, RTFloat farhit, RTTimeType timerate) const {
+    if(!globalBounds.isIntersect(ray, nearhit, farhit)) {
+        return false;
+    }
+    
+    return cache->occluded(ray, nearhit, farhit, timerate);
+}
+
 void SkinMeshStructure::intersectionDetail(const Ray& ray, RTFloat hitt, RTTimeType timerate, const MeshIntersection& isect, IntersectionDetail* odetail) const {
     auto* cls = mesh->clusters[isect.clusterId].get();
     auto* ccache = cache->clusterCaches[isect.clusterId].get();
@@ -6,6 +6,7 @@
 #include "types.h"
 #include "ray.h"
 #include "aabb.h"
+#include "bvh.h"
 #include "intersection.h"
 
 namespace Petals {
@@ -14,40 +15,64 @@ namespace Petals {
     class Skin;
     class Node;
     
+    // placement of a mesh in the scene. the object BVH (top level) holds one leaf per instance,
+    // the triangle BVH (bottom level) is owned by Mesh and shared by all its instances.
+    struct MeshInstance {
+        Matrix4 globalMatrix;
+        Matrix4 invGlobalMatrix;
+        int meshId;
+        
+        // globalMatrix = translate * rotation * scale. interpolated between exposure slices
+        Quaterion rotation;
+        Vector3 scale;
+        Vector3 translate;
+        bool isDecomposed; // false: globalMatrix has shear
+        
+        void setMatrix(const Matrix4& gm, const Matrix4& igm);
+        // placement between two slice instances at t. no matrix inversion
+        static void interpolate(const MeshInstance& inst0, const MeshInstance& inst1, RTFloat t, Matrix4* ogm, Matrix4* oigm);
+    };
+    
     //
     class TracableStructure {
     public:
         Mesh* mesh;
         Node* ownerNode;
-        Matrix4 invGlobalMatrix;
+        MeshInstance instance; // initial placement
+        std::vector<MeshInstance> sliceInstances; // per exposure slice. updated in seekTime
         AABB globalBounds; // dataId: index in scene
+        std::vector<AABB> sliceBounds; // per exposure slice. motion bounds in object BVH
+        int storeId; // scene store this structure belongs to
 
-        TracableStructure(Node* owner, Mesh* m) : ownerNode(owner), mesh(m) {};
+        TracableStructure(Node* owner, Mesh* m, int store = 0) : ownerNode(owner), mesh(m), storeId(store) {};
         virtual ~TracableStructure() {}
         
-        virtual void initialize(int maxslice) = 0;
+        void initializeInstance(int maxslice);
+        void updateInstance(int sliceId);
+        // placement at timerate from cached slice instances. ogm or oigm can be nullptr
+        void instanceTransform(RTTimeType timerate, Matrix4* ogm, Matrix4* oigm) const;
+        
+        virtual void initialize(int maxslice, const BVH::BuildOption& bvhopt) = 0;
         virtual void clearSlice() = 0;
         virtual void updateSlice(int sliceId) = 0;
         virtual void updateFinished() = 0;
         virtual RTFloat intersection(const Ray& ray, RTFloat nearhit, RTFloat farhit, RTTimeType timerate, MeshIntersection* oisect) const = 0;
+        virtual bool occluded(const Ray& ray, RTFloat nearhit, RTFloat farhit, RTTimeType timerate) const = 0;
         virtual void intersectionDetail(const Ray& ray, RTFloat hitt, RTTimeType timerate, const MeshIntersection& isect, IntersectionDetail* odetail) const = 0;
     };
     
     //
     class StaticMeshStructure : public TracableStructure {
     public:
-        std::unique_ptr<MeshCache> cache;
-
-        Matrix4 globalMatrix;
-        
-        StaticMeshStructure(Node* owner, Mesh* m) : TracableStructure(owner, m) {};
+        StaticMeshStructure(Node* owner, Mesh* m, int store = 0) : TracableStructure(owner, m, store) {};
         ~StaticMeshStructure() {};
         
-        void initialize(int maxslice) override;
+        void initialize(int maxslice, const BVH::BuildOption& bvhopt) override;
         void clearSlice() override;
         void updateSlice(int sliceId) override;
         void updateFinished() override;
         RTFloat intersection(const Ray& ray, RTFloat nearhit, RTFloat farhit, RTTimeType timerate, MeshIntersection* oisect) const override;
+        bool occluded(const Ray& ray, RTFloat nearhit, RTFloat farhit, RTTimeType timerate) const override;
         void intersectionDetail(const Ray& ray, RTFloat hitt, RTTimeType timerate, const MeshIntersection& isect, IntersectionDetail* odetail) const override;
     };
     
@@ -59,14 +84,15 @@ namespace Petals {
         std::vector<Matrix4> jointMatrices;
         std::vector<Matrix4> jointInvTransMatrices;
         
-        SkinMeshStructure(Node* owner, Mesh* m, Skin* s) : TracableStructure(owner, m), skin(s) {};
+        SkinMeshStructure(Node* owner, Mesh* m, Skin* s, int store = 0) : TracableStructure(owner, m, store), skin(s) {};
         ~SkinMeshStructure() {};
         
-        void initialize(int maxslice) override;
+        void initialize(int maxslice, const BVH::BuildOption& bvhopt) override;
         void clearSlice() override;
         void updateSlice(int sliceId) override;
         void updateFinished() override;
         RTFloat intersection(const Ray& ray, RTFloat nearhit, RTFloat farhit, RTTimeType timerate, MeshIntersection* oisect) const override;
+        bool occluded(const Ray& ray, RTFloat nearhit, RTFloat farhit, RTTimeType timerate) const override;
         void intersectionDetail(const Ray& ray, RTFloat hitt, RTTimeType timerate, const MeshIntersection& isect, IntersectionDetail* odetail) const override;
     };
 }
@@ -20,6 +20,14 @@ namespace Petals {
     typedef linearalgebra::Matrix4<RTFloat> Matrix4;
     typedef linearalgebra::Quaternion<RTFloat> Quaterion;
 
+    // geometry storage (triangles, BVH bounds). hit distances are returned in RTFloat
+#ifdef PETALS_GEOMETRY_FLOAT
+    typedef float RTGeomFloat;
+#else
+    typedef double RTGeomFloat;
+#endif
+    typedef linearalgebra::Vector3<RTGeomFloat> GeomVector3;
+
     union IntVec3 {
         struct { int x, y, z; };
         struct { int i, j, k; };
@@ -424,6 +424,18 @@ TEST_CASE("Matrix4 transforms [Matrix4]") {
         m.m11 = 1.0;
         m.m22 = 1.0;
         Matrix4RequireIdentity(m);
+        
+        // same as scalar version. scales columns after rotation
+        Matrix4 mr = Matrix4::makeRotation(M_PI / 3.0, 0.0, 0.0, 1.0);
+        Matrix4 ms = mr;
+        Matrix4 mv = mr;
+        ms.scale(3.0, 2.0, 0.5);
+        mv.scale(Vector3(3.0, 2.0, 0.5));
+        for(int i = 0; i < 16; i++) {
+            REQUIRE( mv.m[i] == ms.m[i] );
+        }
+        Vector3 v = Matrix4::transformV3(mv, Vector3(1.0, 0.0, 0.0));
+        REQUIRE( v.length() == doctest::Approx(3.0).epsilon(kTestEPS) );
     }
 }
 
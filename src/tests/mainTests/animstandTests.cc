@@ -0,0 +1,182 @@
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <cstdlib>
+#include <chrono>
+#include <doctest.h>
+#include "../testsupport.h"
+
+#include <petals/types.h>
+#include <petals/sceneloader.h>
+#include <petals/animstand.h>
+
+#include <stb/stb_image.h>
+#include <stb/stb_image_write.h>
+
+using namespace Petals;
+
+namespace {
+    const int kCelValue = 128;
+
+    std::string TestOutputDir() {
+        return std::string(PETALS_TEST_OUTPUT_DIR) + "/animstandTest";
+    }
+
+    std::string TestOutputPath(const std::string& name) {
+        return TestOutputDir() + "/" + name;
+    }
+
+    // one cut of a flat opaque cel under the top light. every pixel renders to the cel value
+    AnimationStand* LoadFlatCelStand(const std::string& name, int frames, int sampleCount) {
+        CheckTestOutputDir("animstandTest");
+
+        std::vector<unsigned char> cel(64 * 64 * 4, static_cast<unsigned char>(kCelValue));
+        for (size_t i = 3; i < cel.size(); i += 4) {
+            cel[i] = 255;
+        }
+        if (stbi_write_png(TestOutputPath("flatcel.png").c_str(), 64, 64, 4, cel.data(), 0) == 0) {
+            return nullptr;
+        }
+
+        std::stringstream ss;
+        ss << R"({
+    "animstand": {"major_version": 1, "minor_version": 0},
+    "movie": {
+        "sequence": ["cut1"],
+        "output": {"width": 192, "height": 128, "film_size": "35mm"}
+    },
+    "cut_list": [{
+        "name": "cut1",
+        "cut": {
+            "last_frame": )" << frames << R"(,
+            "bank": [{"name": "1", "source": "flatcel.png"}],
+            "timesheet": {"A": ["1"]},
+            "animation": {},
+            "plane_setup": [{"name": "top_plane", "plates": [{"item": "A"}]}],
+            "shot": [{
+                "camera": {
+                    "height": 2.0, "exposure": 1.0, "F": 2.0, "focal_length": 100.0, "focus": "top",
+                    "render": {"mode": "rgb", "sample_count": )" << sampleCount << R"(, "sample_strategy": "stratify"}
+                },
+                "stand": {
+                    "lights": {"top": {"enable": true, "power": 1.0}},
+                    "planes": [{"id": "top", "item": "top_plane", "height": 0.4}]
+                }
+            }]
+        }
+    }]
+})";
+        const auto scenepath = TestOutputPath(name + ".json");
+        {
+            std::ofstream ofs(scenepath);
+            ofs << ss.str();
+        }
+
+        auto* animstand = SceneLoader::loadAnimStand(scenepath);
+        if (animstand != nullptr) {
+            animstand->outconf.directory = TestOutputDir();
+            animstand->outconf.baseName = name + "_";
+            animstand->limitSec = -1.0;
+        }
+        return animstand;
+    }
+
+    std::string FramePath(const std::string& name, int frame) {
+        std::stringstream ss;
+        ss << TestOutputDir() << "/" << name << "_" << std::setfill('0') << std::setw(3) << frame << ".png";
+        return ss.str();
+    }
+}
+
+TEST_CASE("AnimationStand tile jobs test [AnimStand]") {
+    const int frames = 5;
+    const int tilesPerFrame = 3 * 2; // 192x128 in 64 pixel tiles
+    AnimationStand* animstand = LoadFlatCelStand("tilejobs", frames, 2);
+    REQUIRE(animstand != nullptr);
+
+    // workers share the tiles of open frames
+    animstand->maxThreads = 3;
+    REQUIRE(animstand->render());
+
+    auto stats = animstand->getStats();
+    REQUIRE_EQ(stats.frames, frames);
+    REQUIRE_EQ(stats.renderedTiles, frames * tilesPerFrame);
+    REQUIRE_EQ(stats.finishedFrames, frames);
+    REQUIRE_EQ(stats.writtenFrames, frames);
+
+    // a tile rendered twice doubles its pixels, a skipped one stays black
+    for (int ifrm = 0; ifrm < frames; ifrm++) {
+        int w, h, c;
+        unsigned char* img = stbi_load(FramePath("tilejobs", ifrm).c_str(), &w, &h, &c, 3);
+        REQUIRE(img != nullptr);
+        REQUIRE_EQ(w, 192);
+        REQUIRE_EQ(h, 128);
+        int badpixels = 0;
+        for (int i = 0; i < w * h * 3; i++) {
+            badpixels += (std::abs(img[i] - kCelValue) > 2) ? 1 : 0;
+        }
+        stbi_image_free(img);
+        REQUIRE_EQ(badpixels, 0);
+    }
+
+    delete animstand;
+}
+
+TEST_CASE("AnimationStand sample budget test [AnimStand]") {
+    // cheap enough for the limit. samples are kept
+    {
+        AnimationStand* animstand = LoadFlatCelStand("budgetfits", 1, 1);
+        REQUIRE(animstand != nullptr);
+        animstand->maxThreads = 1;
+        animstand->limitSec = 100.0;
+        animstand->limitMargin = 1.0;
+        REQUIRE(animstand->render());
+
+        auto stats = animstand->getStats();
+        REQUIRE_EQ(stats.sampleScale, 1.0);
+        REQUIRE_EQ(stats.writtenFrames, 1);
+        delete animstand;
+    }
+
+    // far over the limit at full samples. the probe scales them down so every frame is written in time
+    {
+        const int frames = 3;
+        AnimationStand* animstand = LoadFlatCelStand("budgetscaled", frames, 2000);
+        REQUIRE(animstand != nullptr);
+        animstand->maxThreads = 1;
+        animstand->limitSec = 2.0;
+        animstand->limitMargin = 0.5;
+        auto starttime = std::chrono::steady_clock::now();
+        REQUIRE(animstand->render());
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - starttime).count();
+
+        auto stats = animstand->getStats();
+        REQUIRE(stats.sampleScale > 0.0);
+        REQUIRE(stats.sampleScale < 1.0);
+        REQUIRE_EQ(stats.writtenFrames, frames);
+        REQUIRE_EQ(stats.cancelledFrames, 0);
+        REQUIRE(elapsed < animstand->limitSec);
+        delete animstand;
+    }
+}
+
+TEST_CASE("AnimationStand cancel test [AnimStand]") {
+    // no time left after the margin. cancelled as soon as the workers start
+    const int frames = 40;
+    AnimationStand* animstand = LoadFlatCelStand("cancel", frames, 1);
+    REQUIRE(animstand != nullptr);
+    animstand->maxThreads = 2;
+    animstand->limitSec = 0.5;
+    animstand->limitMargin = 0.5;
+    REQUIRE(animstand->render());
+
+    auto stats = animstand->getStats();
+    REQUIRE_EQ(stats.frames, frames);
+    REQUIRE(stats.writtenFrames < frames);
+    // frames taken by workers are either written or reported as cancelled part way
+    REQUIRE_EQ(stats.finishedFrames, stats.writtenFrames + stats.cancelledFrames);
+    REQUIRE(stats.renderedTiles < frames * 3 * 2);
+    delete animstand;
+}
@@ -1,4 +1,7 @@
 #include <cmath>
+#include <chrono>
+#include <limits>
+#include <iostream>
 #include <doctest.h>
 #include "../testsupport.h"
 
@@ -6,10 +9,45 @@
 #include <petals/bvh.h>
 #include <petals/ray.h>
 #include <petals/aabb.h>
+#include <petals/random.h>
+#include <petals/jobsystem.h>
 
 using namespace Petals;
 
 namespace {
+	void MakeRandomBounds(std::vector<AABB>& bounds, int num, Random& rng) {
+		bounds.resize(num);
+		for (int i = 0; i < num; i++) {
+			Vector3 c(rng.nextDoubleCO() * 20.0 - 10.0, rng.nextDoubleCO() * 20.0 - 10.0, rng.nextDoubleCO() * 20.0 - 10.0);
+			Vector3 e(rng.nextDoubleCO() * 0.5 + 0.01, rng.nextDoubleCO() * 0.5 + 0.01, rng.nextDoubleCO() * 0.5 + 0.01);
+			bounds[i].clear();
+			bounds[i].expand(c - e);
+			bounds[i].expand(c + e);
+			bounds[i].dataId = i;
+		}
+	}
+
+	Ray MakeRandomRay(Random& rng) {
+		Vector3 o(rng.nextDoubleCO() * 30.0 - 15.0, rng.nextDoubleCO() * 30.0 - 15.0, rng.nextDoubleCO() * 30.0 - 15.0);
+		Vector3 t(rng.nextDoubleCO() * 10.0 - 5.0, rng.nextDoubleCO() * 10.0 - 5.0, rng.nextDoubleCO() * 10.0 - 5.0);
+		return Ray(o, Vector3::normalized(t - o));
+	}
+
+	RTFloat BoxHitDistance(const Ray& ray, RTFloat tnear, RTFloat tfar, const AABB* bnd) {
+		RTFloat t = bnd->intersectDistance(ray);
+		return (t >= tnear && t <= tfar) ? t : -1.0;
+	}
+
+	RTFloat BruteForceHit(const std::vector<AABB>& bounds, const Ray& ray, RTFloat tnear, RTFloat tfar) {
+		RTFloat mint = -1.0;
+		for (const auto& bnd : bounds) {
+			RTFloat t = BoxHitDistance(ray, tnear, tfar, &bnd);
+			if (t >= 0.0 && (mint < 0.0 || t < mint)) {
+				mint = t;
+			}
+		}
+		return mint;
+	}
 }
 
 TEST_CASE("BVH basic test [BVH]") {
@@ -31,3 +69,470 @@ TEST_CASE("BVH basic test [BVH]") {
 
 	REQUIRE(true);
 }
+
+TEST_CASE("BVH builder test [BVH]") {
+	const int NUM = 2000;
+	Random rng(1234);
+	std::vector<AABB> bounds;
+	MakeRandomBounds(bounds, NUM, rng);
+
+	BVH::BuildOption medianopt;
+	medianopt.type = BVH::BuildType::kMedian;
+	BVH::BuildOption sahopt;
+	sahopt.type = BVH::BuildType::kSAH;
+	sahopt.maxLeafSize = 4;
+
+	BVH medianbvh(NUM, medianopt);
+	BVH sahbvh(NUM, sahopt);
+	for (int i = 0; i < NUM; i++) {
+		medianbvh.appendLeaf(&bounds[i]);
+		sahbvh.appendLeaf(&bounds[i]);
+	}
+	medianbvh.build();
+	sahbvh.build();
+
+	auto medianstats = medianbvh.computeStatistics();
+	auto sahstats = sahbvh.computeStatistics();
+	REQUIRE_EQ(medianstats.primitiveCount, NUM);
+	REQUIRE_EQ(sahstats.primitiveCount, NUM);
+	REQUIRE_EQ(medianstats.maxLeafSize, 1);
+	REQUIRE(sahstats.maxLeafSize <= sahopt.maxLeafSize);
+	REQUIRE(sahstats.sahCost < medianstats.sahCost);
+
+	for (int i = 0; i < 1000; i++) {
+		Ray ray = MakeRandomRay(rng);
+		RTFloat expect = BruteForceHit(bounds, ray, 0.0, 1e8);
+		RTFloat tm = medianbvh.intersect(ray, 0.0, 1e8, BoxHitDistance);
+		RTFloat ts = sahbvh.intersect(ray, 0.0, 1e8, BoxHitDistance);
+		REQUIRE(tm == doctest::Approx(expect));
+		REQUIRE(ts == doctest::Approx(expect));
+	}
+
+	// rebuild with same leaves
+	sahbvh.updateAllLeafBounds();
+	sahbvh.build();
+	REQUIRE(sahbvh.computeStatistics().sahCost == doctest::Approx(sahstats.sahCost));
+}
+
+TEST_CASE("BVH front to back traverse test [BVH]") {
+	// boxes in a row along +x. nearest hit must cull all farther boxes.
+	const int NUM = 64;
+	std::vector<AABB> bounds(NUM);
+	for (int i = 0; i < NUM; i++) {
+		RTFloat x = i * 2.0 + 1.0;
+		bounds[i].clear();
+		bounds[i].expand(Vector3(x, -0.5, -0.5));
+		bounds[i].expand(Vector3(x + 1.0, 0.5, 0.5));
+		bounds[i].dataId = i;
+	}
+
+	for (int itype = 0; itype < 2; itype++) {
+		BVH::BuildOption opt;
+		opt.type = (itype == 0) ? BVH::BuildType::kMedian : BVH::BuildType::kSAH;
+		opt.maxLeafSize = 1;
+		BVH bvh(NUM, opt);
+		for (int i = 0; i < NUM; i++) {
+			bvh.appendLeaf(&bounds[i]);
+		}
+		bvh.build();
+
+		for (int idir = 0; idir < 2; idir++) {
+			Ray ray;
+			int expectId;
+			if (idir == 0) {
+				ray = Ray(Vector3(0.0, 0.0, 0.0), Vector3(1.0, 0.0, 0.0));
+				expectId = 0;
+			} else {
+				ray = Ray(Vector3(NUM * 2.0 + 1.0, 0.0, 0.0), Vector3(-1.0, 0.0, 0.0));
+				expectId = NUM - 1;
+			}
+
+			int visitCount = 0;
+			int hitId = -1;
+			RTFloat t = bvh.intersect(ray, 0.0, 1e8, [&](const Ray& r, RTFloat tnear, RTFloat tfar, const AABB* bnd) {
+				visitCount += 1;
+				RTFloat bt = BoxHitDistance(r, tnear, tfar, bnd);
+				if (bt >= 0.0) {
+					hitId = bnd->dataId;
+				}
+				return bt;
+			});
+
+			REQUIRE(t == doctest::Approx(1.0));
+			REQUIRE_EQ(hitId, expectId);
+			REQUIRE_EQ(visitCount, 1);
+		}
+	}
+}
+
+TEST_CASE("BVH occluded test [BVH]") {
+	const int NUM = 2000;
+	Random rng(5678);
+	std::vector<AABB> bounds;
+	MakeRandomBounds(bounds, NUM, rng);
+
+	BVH bvh(NUM, BVH::BuildOption());
+	for (int i = 0; i < NUM; i++) {
+		bvh.appendLeaf(&bounds[i]);
+	}
+	bvh.build();
+
+	auto anyhit = [](const Ray& ray, RTFloat tnear, RTFloat tfar, const AABB* bnd) {
+		return BoxHitDistance(ray, tnear, tfar, bnd) >= 0.0;
+	};
+
+	int hitCount = 0;
+	for (int i = 0; i < 1000; i++) {
+		Ray ray = MakeRandomRay(rng);
+		RTFloat tfar = rng.nextDoubleCO() * 20.0;
+		bool expect = BruteForceHit(bounds, ray, 0.0, tfar) >= 0.0;
+		REQUIRE_EQ(bvh.occluded(ray, 0.0, tfar, anyhit), expect);
+		REQUIRE_EQ(bvh.occluded(ray, 0.0, tfar, BVH::AnyHitCallback(anyhit)), expect);
+		hitCount += expect ? 1 : 0;
+	}
+	// both cases must be exercised
+	REQUIRE(hitCount > 0);
+	REQUIRE(hitCount < 1000);
+
+	// empty tree
+	BVH emptybvh;
+	REQUIRE_FALSE(emptybvh.occluded(MakeRandomRay(rng), 0.0, 1e8, anyhit));
+}
+
+TEST_CASE("BVH refit test [BVH]") {
+	const int NUM = 2000;
+	Random rng(2468);
+	std::vector<AABB> bounds;
+	MakeRandomBounds(bounds, NUM, rng);
+
+	BVH bvh(NUM, BVH::BuildOption());
+	for (int i = 0; i < NUM; i++) {
+		bvh.appendLeaf(&bounds[i]);
+	}
+	bvh.build();
+
+	auto checkHits = [&]() {
+		for (int i = 0; i < 200; i++) {
+			Ray ray = MakeRandomRay(rng);
+			RTFloat expect = BruteForceHit(bounds, ray, 0.0, 1e8);
+			REQUIRE(bvh.intersect(ray, 0.0, 1e8, BoxHitDistance) == doctest::Approx(expect));
+		}
+	};
+
+	// small motion keeps topology
+	for (int i = 0; i < NUM; i++) {
+		Vector3 d(rng.nextDoubleCO() * 0.1, rng.nextDoubleCO() * 0.1, rng.nextDoubleCO() * 0.1);
+		bounds[i].min += d;
+		bounds[i].max += d;
+	}
+	REQUIRE_FALSE(bvh.update());
+	checkHits();
+
+	// scattered. refitted tree is too loose, rebuilt
+	std::vector<AABB> scattered;
+	MakeRandomBounds(scattered, NUM, rng);
+	for (int i = 0; i < NUM; i++) {
+		bounds[i].min = scattered[i].min;
+		bounds[i].max = scattered[i].max;
+	}
+	REQUIRE(bvh.refit() > BVH::BuildOption().refitThreshold);
+	REQUIRE(bvh.update());
+	REQUIRE(bvh.refit() == doctest::Approx(1.0));
+	checkHits();
+}
+
+TEST_CASE("BVH parallel build test [BVH]") {
+	const int NUM = 20000;
+	Random rng(97531);
+	std::vector<AABB> bounds;
+	MakeRandomBounds(bounds, NUM, rng);
+
+	// force worker threads regardless of core count. the shared pool is left alone
+	JobSystem jobs(3);
+
+	for (auto type : { BVH::BuildType::kSAH, BVH::BuildType::kMedian }) {
+		BVH::BuildOption serialopt;
+		serialopt.type = type;
+		serialopt.parallelThreshold = 0;
+		BVH::BuildOption parallelopt = serialopt;
+		parallelopt.parallelThreshold = 64;
+		parallelopt.jobSystem = &jobs;
+
+		BVH serialbvh(NUM, serialopt);
+		BVH parallelbvh(NUM, parallelopt);
+		for (int i = 0; i < NUM; i++) {
+			serialbvh.appendLeaf(&bounds[i]);
+			parallelbvh.appendLeaf(&bounds[i]);
+		}
+		serialbvh.build();
+		parallelbvh.build();
+
+		// same tree
+		auto serialstats = serialbvh.computeStatistics();
+		auto parallelstats = parallelbvh.computeStatistics();
+		REQUIRE_EQ(parallelstats.primitiveCount, NUM);
+		REQUIRE_EQ(parallelstats.leafCount, serialstats.leafCount);
+		REQUIRE_EQ(parallelstats.wideNodeCount, serialstats.wideNodeCount);
+		REQUIRE(parallelstats.sahCost == doctest::Approx(serialstats.sahCost));
+		for (int i = 0; i < NUM; i++) {
+			REQUIRE_EQ(parallelbvh.primitiveAt(i), serialbvh.primitiveAt(i));
+		}
+
+		for (int i = 0; i < 200; i++) {
+			Ray ray = MakeRandomRay(rng);
+			RTFloat expect = BruteForceHit(bounds, ray, 0.0, 1e8);
+			REQUIRE(parallelbvh.intersect(ray, 0.0, 1e8, BoxHitDistance) == doctest::Approx(expect));
+		}
+
+		// rebuild reuses the node pool
+		parallelbvh.updateAllLeafBounds();
+		parallelbvh.build();
+		REQUIRE(parallelbvh.computeStatistics().sahCost == doctest::Approx(serialstats.sahCost));
+	}
+
+	// concurrent builds of independent BVHs
+	const int NUMBVH = 6;
+	std::vector<std::unique_ptr<BVH> > bvhs;
+	for (int ib = 0; ib < NUMBVH; ib++) {
+		BVH::BuildOption opt;
+		opt.parallelThreshold = 1024;
+		opt.jobSystem = &jobs;
+		bvhs.push_back(std::unique_ptr<BVH>(new BVH(NUM, opt)));
+		for (int i = 0; i < NUM; i++) {
+			bvhs[ib]->appendLeaf(&bounds[i]);
+		}
+	}
+	jobs.parallelFor(NUMBVH, [&bvhs](int i) {
+		bvhs[i]->build();
+	});
+	for (int ib = 1; ib < NUMBVH; ib++) {
+		REQUIRE(bvhs[ib]->computeStatistics().sahCost == doctest::Approx(bvhs[0]->computeStatistics().sahCost));
+		REQUIRE_EQ(bvhs[ib]->primitiveAt(NUM / 2), bvhs[0]->primitiveAt(NUM / 2));
+	}
+}
+
+TEST_CASE("BVH motion bounds test [BVH]") {
+	const int NUM = 5000;
+	const int SLICE = 4;
+	Random rng(24680);
+	std::vector<AABB> bounds;
+	MakeRandomBounds(bounds, NUM, rng);
+
+	// boxes move a long way across the exposure
+	std::vector<AABB> slicebounds(NUM * SLICE);
+	std::vector<AABB> unionbounds(NUM);
+	for (int i = 0; i < NUM; i++) {
+		Vector3 move(rng.nextDoubleCO() * 8.0 - 4.0, rng.nextDoubleCO() * 8.0 - 4.0, rng.nextDoubleCO() * 8.0 - 4.0);
+		unionbounds[i].clear();
+		unionbounds[i].dataId = i;
+		for (int s = 0; s < SLICE; s++) {
+			RTFloat t = static_cast<RTFloat>(s) / (SLICE - 1);
+			AABB& bnd = slicebounds[i * SLICE + s];
+			bnd.clear();
+			bnd.expand(bounds[i].min + move * t);
+			bnd.expand(bounds[i].max + move * t);
+			unionbounds[i].expand(bnd);
+		}
+	}
+
+	BVH bvh(NUM);
+	bvh.setMotionSliceCount(SLICE);
+	for (int i = 0; i < NUM; i++) {
+		bvh.appendLeaf(&unionbounds[i], &slicebounds[i * SLICE]);
+	}
+	bvh.build();
+	REQUIRE_EQ(bvh.getMotionSliceCount(), SLICE);
+
+	auto boxAt = [&](int i, RTTimeType timerate) {
+		RTFloat ft = timerate * (SLICE - 1);
+		int s = std::min(static_cast<int>(ft), SLICE - 2);
+		RTFloat w = ft - s;
+		const AABB& b0 = slicebounds[i * SLICE + s];
+		const AABB& b1 = slicebounds[i * SLICE + s + 1];
+		AABB bnd;
+		bnd.expand(b0.min * (1.0 - w) + b1.min * w);
+		bnd.expand(b0.max * (1.0 - w) + b1.max * w);
+		return bnd;
+	};
+
+	size_t motionvisits = 0;
+	size_t unionvisits = 0;
+	for (int r = 0; r < 300; r++) {
+		Ray ray = MakeRandomRay(rng);
+		RTTimeType timerate = (r < 3) ? r * 0.5 : rng.nextDoubleCO();
+
+		RTFloat expect = -1.0;
+		bool expectoccluded = false;
+		for (int i = 0; i < NUM; i++) {
+			AABB bnd = boxAt(i, timerate);
+			RTFloat t = BoxHitDistance(ray, 0.0, 1e8, &bnd);
+			if (t >= 0.0 && (expect < 0.0 || t < expect)) {
+				expect = t;
+			}
+			expectoccluded = expectoccluded || (t >= 0.0);
+		}
+
+		auto motionhit = [&](const Ray& ray, RTFloat tnear, RTFloat tfar, const AABB* bnd) {
+			motionvisits += 1;
+			AABB movedbnd = boxAt(bnd->dataId, timerate);
+			return BoxHitDistance(ray, tnear, tfar, &movedbnd);
+		};
+		RTFloat t = bvh.intersect(ray, 0.0, 1e8, timerate, motionhit);
+		REQUIRE(t == doctest::Approx(expect));
+		bool isoccluded = bvh.occluded(ray, 0.0, 1e8, timerate, [&](const Ray& ray, RTFloat tnear, RTFloat tfar, const AABB* bnd) {
+			return motionhit(ray, tnear, tfar, bnd) >= 0.0;
+		});
+		REQUIRE_EQ(isoccluded, expectoccluded);
+
+		// union bounds find the same hit with more leaf tests
+		RTFloat ut = bvh.intersect(ray, 0.0, 1e8, [&](const Ray& ray, RTFloat tnear, RTFloat tfar, const AABB* bnd) {
+			unionvisits += 1;
+			AABB movedbnd = boxAt(bnd->dataId, timerate);
+			return BoxHitDistance(ray, tnear, tfar, &movedbnd);
+		});
+		REQUIRE(ut == doctest::Approx(expect));
+	}
+	REQUIRE(motionvisits < unionvisits);
+
+	// refit keeps motion bounds in sync
+	for (auto& bnd : slicebounds) {
+		bnd.min += Vector3(0.0, 0.0, 100.0);
+		bnd.max += Vector3(0.0, 0.0, 100.0);
+	}
+	for (int i = 0; i < NUM; i++) {
+		unionbounds[i].min += Vector3(0.0, 0.0, 100.0);
+		unionbounds[i].max += Vector3(0.0, 0.0, 100.0);
+	}
+	bvh.refit();
+	Ray upray(Vector3(0.0, 0.0, 50.0), Vector3(0.0, 0.0, 1.0));
+	RTFloat expect = -1.0;
+	for (int i = 0; i < NUM; i++) {
+		AABB bnd = boxAt(i, 0.5);
+		RTFloat t = BoxHitDistance(upray, 0.0, 1e8, &bnd);
+		if (t >= 0.0 && (expect < 0.0 || t < expect)) {
+			expect = t;
+		}
+	}
+	RTFloat t = bvh.intersect(upray, 0.0, 1e8, 0.5, [&](const Ray& ray, RTFloat tnear, RTFloat tfar, const AABB* bnd) {
+		AABB movedbnd = boxAt(bnd->dataId, 0.5);
+		return BoxHitDistance(ray, tnear, tfar, &movedbnd);
+	});
+	REQUIRE(t == doctest::Approx(expect));
+}
+
+TEST_CASE("BVH wide node slab test [BVH]") {
+	Random rng(4321);
+	std::vector<AABB> bounds;
+	MakeRandomBounds(bounds, BVH::kWideNodeWidth * 500, rng);
+
+	int hitCount = 0;
+	for (int n = 0; n < 500; n++) {
+		BVH::WideNode node;
+		for (int i = 0; i < BVH::kWideNodeWidth; i++) {
+			const AABB& bnd = bounds[n * BVH::kWideNodeWidth + i];
+			for (int a = 0; a < 3; a++) {
+				node.bounds[0][a][i] = static_cast<RTGeomFloat>(bnd.min.v[a]);
+				node.bounds[1][a][i] = static_cast<RTGeomFloat>(bnd.max.v[a]);
+			}
+		}
+
+		for (int r = 0; r < 8; r++) {
+			Ray ray = MakeRandomRay(rng);
+			if (r == 0) {
+				// axis parallel
+				ray.direction = Vector3(0.0, 0.0, (n % 2 == 0) ? 1.0 : -1.0);
+			}
+			RTFloat tnear = 0.0;
+			RTFloat tfar = rng.nextDoubleCO() * 30.0;
+			InvDirRay iray(ray);
+
+			RTGeomFloat simdt[BVH::kWideNodeWidth];
+			RTGeomFloat scalart[BVH::kWideNodeWidth];
+			int simdmask = BVH::intersectWideNode(node, iray, tnear, tfar, simdt);
+			int scalarmask = BVH::intersectWideNodeScalar(node, iray, tnear, tfar, scalart);
+
+			for (int i = 0; i < BVH::kWideNodeWidth; i++) {
+				RTFloat tmin, tmax;
+				bool ishit = bounds[n * BVH::kWideNodeWidth + i].testIntersect(ray, &tmin, &tmax);
+				ishit = ishit && std::max(tmin, tnear) <= std::min(tmax, tfar);
+
+				if (sizeof(RTGeomFloat) == sizeof(RTFloat)) {
+					REQUIRE_EQ((simdmask & (1 << i)) != 0, ishit);
+					REQUIRE_EQ((scalarmask & (1 << i)) != 0, ishit);
+				} else if (ishit) {
+					// float bounds are conservative
+					REQUIRE((simdmask & (1 << i)) != 0);
+					REQUIRE((scalarmask & (1 << i)) != 0);
+				}
+				if (ishit) {
+					REQUIRE(simdt[i] == doctest::Approx(std::max(tmin, tnear)).epsilon(1e-4));
+					REQUIRE(scalart[i] == doctest::Approx(std::max(tmin, tnear)).epsilon(1e-4));
+					hitCount += 1;
+				}
+			}
+		}
+	}
+	REQUIRE(hitCount > 0);
+
+	// empty slot never hits
+	BVH::WideNode emptynode;
+	for (int i = 0; i < BVH::kWideNodeWidth; i++) {
+		for (int a = 0; a < 3; a++) {
+			emptynode.bounds[0][a][i] = std::numeric_limits<RTGeomFloat>::max();
+			emptynode.bounds[1][a][i] = -std::numeric_limits<RTGeomFloat>::max();
+		}
+	}
+	RTGeomFloat tmins[BVH::kWideNodeWidth];
+	Ray axisray(Vector3(0.0, 0.0, 0.0), Vector3(1.0, 0.0, 0.0));
+	REQUIRE_EQ(BVH::intersectWideNode(emptynode, InvDirRay(axisray), 0.0, 1e8, tmins), 0);
+	REQUIRE_EQ(BVH::intersectWideNodeScalar(emptynode, InvDirRay(axisray), 0.0, 1e8, tmins), 0);
+}
+
+TEST_CASE("BVH callback dispatch benchmark [BVH]" * doctest::skip()) {
+	// run with --no-skip
+	const int NUM = 100000;
+	const int RAYS = 200000;
+	Random rng(5678);
+	std::vector<AABB> bounds;
+	MakeRandomBounds(bounds, NUM, rng);
+
+	BVH bvh(NUM);
+	for (int i = 0; i < NUM; i++) {
+		bvh.appendLeaf(&bounds[i]);
+	}
+	bvh.build();
+
+	std::vector<Ray> rays(RAYS);
+	for (int i = 0; i < RAYS; i++) {
+		rays[i] = MakeRandomRay(rng);
+	}
+
+	int hitcount = 0;
+	auto lambdafunc = [&hitcount](const Ray& ray, RTFloat tnear, RTFloat tfar, const AABB* bnd) {
+		RTFloat t = BoxHitDistance(ray, tnear, tfar, bnd);
+		hitcount += (t >= 0.0) ? 1 : 0;
+		return t;
+	};
+
+	// std::function
+	RTFloat sumfunc = 0.0;
+	auto start = std::chrono::steady_clock::now();
+	for (const auto& ray : rays) {
+		sumfunc += bvh.intersect(ray, 0.0, 1e8, BVH::HitCallback(lambdafunc));
+	}
+	std::chrono::duration<double> funcsec = std::chrono::steady_clock::now() - start;
+
+	// template
+	RTFloat sumtmpl = 0.0;
+	start = std::chrono::steady_clock::now();
+	for (const auto& ray : rays) {
+		sumtmpl += bvh.intersect(ray, 0.0, 1e8, lambdafunc);
+	}
+	std::chrono::duration<double> tmplsec = std::chrono::steady_clock::now() - start;
+
+	std::cout << "BVH dispatch " << RAYS << " rays, " << NUM << " boxes" << std::endl;
+	std::cout << "  std::function: " << funcsec.count() << " [sec]" << std::endl;
+	std::cout << "  template     : " << tmplsec.count() << " [sec]" << std::endl;
+
+	REQUIRE(sumfunc == doctest::Approx(sumtmpl));
+}
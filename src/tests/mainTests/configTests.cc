@@ -6,6 +6,7 @@
 
 #include <petals/types.h>
 #include <petals/config.h>
+#include <petals/cputopology.h>
 
 using namespace Petals;
 
@@ -27,6 +28,10 @@ TEST_CASE("Load test [Config]") {
     
     REQUIRE_EQ(config.samplesPerPixel, 16);
     REQUIRE_EQ(config.pixelSubSamples, 4);
+    REQUIRE(config.adaptiveNoiseTarget == doctest::Approx(0.02));
+    REQUIRE_EQ(config.adaptiveMinSamples, 32);
+    REQUIRE_EQ(config.adaptivePassSamples, 8);
+    REQUIRE_EQ(config.adaptiveMaxSamples, 2048);
     
     REQUIRE_EQ(config.minDepth, 2);
     REQUIRE_EQ(config.maxDepth, 8);
@@ -35,14 +40,23 @@ TEST_CASE("Load test [Config]") {
     REQUIRE_EQ(config.framebufferStockCount, 5);
     REQUIRE_EQ(config.tileSize, 256);
     REQUIRE_EQ(config.scrambleTile, false);
+    REQUIRE_EQ(config.pipelineFrames, false);
+    REQUIRE_EQ(config.celCacheMB, 512);
     
     REQUIRE(config.limitSec == doctest::Approx(300.0).epsilon(0.01));
     REQUIRE(config.progressIntervalSec == doctest::Approx(2.0).epsilon(0.01));
     REQUIRE_EQ(config.maxThreads, 32);
+    REQUIRE_EQ(config.pinThreads, true);
+    REQUIRE_EQ(config.numaAware, true);
     
     REQUIRE_EQ(config.quietProgress, true);
     REQUIRE_EQ(config.waitUntilFinish, false);
     
+    REQUIRE_EQ(config.bvhBuilder, std::string("median"));
+    REQUIRE_EQ(config.bvhMaxLeafSize, 8);
+    REQUIRE(config.bvhRefitThreshold == doctest::Approx(2.0));
+    REQUIRE_EQ(config.bvhReport, true);
+    
     REQUIRE_EQ(config.inputFile, std::string("testinput.gltf"));
     REQUIRE_EQ(config.outputDir, std::string("output"));
     REQUIRE_EQ(config.outputName, std::string("testoutput"));
@@ -62,7 +76,11 @@ TEST_CASE("Option test [Config]") {
         "-f", "300",
         "-fps", "29.98",
         "-s", "128",
-        "-ss", "5"
+        "-ss", "5",
+        "-pin",
+        "-pipe",
+        "-cache", "256",
+        "-nt", "0.05"
     };
     int argc = sizeof(argv) / sizeof(argv[0]);
     
@@ -81,5 +99,36 @@ TEST_CASE("Option test [Config]") {
     REQUIRE_EQ(config.framesPerSecond, doctest::Approx(29.98).epsilon(0.001));
     REQUIRE_EQ(config.samplesPerPixel, 128);
     REQUIRE_EQ(config.pixelSubSamples, 5);
+    REQUIRE_EQ(config.pinThreads, true);
+    REQUIRE_EQ(config.numaAware, false);
+    REQUIRE_EQ(config.pipelineFrames, true);
+    REQUIRE_EQ(config.celCacheMB, 256);
+    REQUIRE(config.adaptiveNoiseTarget == doctest::Approx(0.05));
+}
+
+TEST_CASE("CpuTopology test [Config]") {
+    auto cpus = CpuTopology::parseCpuList("0-3,8,10-11\n");
+    REQUIRE_EQ(cpus, std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+    REQUIRE(CpuTopology::parseCpuList("").empty());
+    
+    CpuTopology topology;
+    REQUIRE(topology.getNodeCount() >= 1);
+    REQUIRE(topology.getCpuCount() >= 1);
+    
+    // two sockets. workers split in halves, each worker on its own cpu
+    topology.nodeCpus = { {0, 1, 2, 3}, {4, 5, 6, 7} };
+    std::vector<int> used(8, 0);
+    for (int i = 0; i < 8; i++) {
+        int node = topology.nodeForWorker(i, 8);
+        int cpu = topology.cpuForWorker(i, 8);
+        REQUIRE_EQ(node, i / 4);
+        REQUIRE_EQ(cpu / 4, node);
+        used[cpu] += 1;
+    }
+    REQUIRE_EQ(used, std::vector<int>(8, 1));
     
+    // more workers than cpus wrap inside the node
+    for (int i = 0; i < 12; i++) {
+        REQUIRE_EQ(topology.cpuForWorker(i, 12) / 4, topology.nodeForWorker(i, 12));
+    }
 }
@@ -1,11 +1,16 @@
 #include <iostream>
+#include <algorithm>
 #include <sstream>
+#include <thread>
+#include <atomic>
+#include <filesystem>
 
 #include <doctest.h>
 #include "../testsupport.h"
 
 #include <petals/types.h>
 #include <petals/framebuffer.h>
+#include <petals/imagewriter.h>
 
 #include <stb/stb_image_write.h>
 
@@ -27,6 +32,147 @@ namespace {
     }
 }
 
+TEST_CASE("FrameBuffer deferred initialize test [FrameBuffer]") {
+    // tiles touched by different threads
+    FrameBuffer fb(300, 250, 64, true);
+    int numtiles = fb.getNumTiles();
+    std::thread th0([&fb, numtiles] { fb.initializeTiles(0, numtiles / 2); });
+    std::thread th1([&fb, numtiles] { fb.initializeTiles(numtiles / 2, numtiles); });
+    th0.join();
+    th1.join();
+    
+    for(int iy = 0; iy < fb.getHeight(); iy++) {
+        for(int ix = 0; ix < fb.getWidth(); ix++) {
+            REQUIRE_EQ(fb.getPixel(ix, iy).sampleCount, 0);
+            fb.accumulate(ix, iy, Color(1.0, 0.5, 0.25));
+        }
+    }
+    Color c = fb.getColor(299, 249);
+    REQUIRE((c.r == 1.0 && c.g == 0.5 && c.b == 0.25));
+}
+
+TEST_CASE("FrameBuffer pixel variance test [FrameBuffer]") {
+    FrameBuffer::Pixel pixel;
+    pixel.clear();
+    REQUIRE(pixel.getRelativeError() >= kINF);
+    
+    // flat pixel converges at once
+    for(int i = 0; i < 8; i++) {
+        pixel.accumulate(Color(0.5, 0.5, 0.5));
+    }
+    REQUIRE(pixel.getRelativeError() == doctest::Approx(0.0));
+    
+    // alternating 0 and 1: stddev 0.5 (population), mean 0.5
+    pixel.clear();
+    RTFloat preverr = kINF;
+    for(int n = 2; n <= 512; n *= 2) {
+        while(pixel.sampleCount < n) {
+            RTFloat v = (pixel.sampleCount % 2 == 0) ? 0.0 : 1.0;
+            pixel.accumulate(Color(v, v, v));
+        }
+        RTFloat err = pixel.getRelativeError();
+        RTFloat expect = std::sqrt(0.25 * n / (n - 1.0) / n) / 0.5;
+        REQUIRE(err == doctest::Approx(expect));
+        REQUIRE(err < preverr);
+        preverr = err;
+    }
+    
+    // dark pixels are not chased
+    pixel.clear();
+    for(int i = 0; i < 64; i++) {
+        RTFloat v = (i % 2 == 0) ? 0.0 : 1e-4;
+        pixel.accumulate(Color(v, v, v));
+    }
+    REQUIRE(pixel.getRelativeError() < 0.01);
+}
+
+TEST_CASE("CompactFrameBuffer test [FrameBuffer]") {
+    CompactFrameBuffer fb(300, 250, 64);
+    REQUIRE_EQ(fb.getNumTiles(), 5 * 4);
+    REQUIRE_EQ(sizeof(CompactFrameBuffer::Pixel), 12);
+    REQUIRE_EQ(fb.getBufferBytes(), 300 * 250 * 12);
+    
+    // tiles cover the image once
+    std::vector<int> covered(300 * 250, 0);
+    for(int i = 0; i < fb.getNumTiles(); i++) {
+        const auto& tile = fb.getTile(i);
+        for(int iy = tile.starty; iy < tile.endy; iy++) {
+            for(int ix = tile.startx; ix < tile.endx; ix++) {
+                covered[ix + iy * 300] += 1;
+                fb.accumulate(ix, iy, Color(0.25, 0.5, ix * 0.001));
+                fb.accumulate(ix, iy, Color(0.25, 0.5, iy * 0.001));
+            }
+        }
+    }
+    REQUIRE(std::all_of(covered.begin(), covered.end(), [](int c) { return c == 1; }));
+    
+    Color c = fb.getColor(299, 249);
+    REQUIRE(c.r == doctest::Approx(0.5));
+    REQUIRE(c.g == doctest::Approx(1.0));
+    REQUIRE(c.b == doctest::Approx(0.548).epsilon(1e-6));
+    
+    fb.clear();
+    c = fb.getColor(299, 249);
+    REQUIRE((c.r == 0.0 && c.g == 0.0 && c.b == 0.0));
+}
+
+TEST_CASE("ImageWriter test [FrameBuffer]") {
+    // bottom row of the framebuffer is the last row of the image
+    FrameBuffer fb(4, 2, 64);
+    fb.clear();
+    for(int ix = 0; ix < 4; ix++) {
+        fb.accumulate(ix, 0, Color(1.0, 0.0, 0.0));
+        fb.accumulate(ix, 1, Color(0.0, 0.0, 1.0));
+    }
+    ImageWriter::Request req;
+    ImageWriter::encodeRGB8(fb, 1.0, &req);
+    REQUIRE_EQ(req.rgb8.size(), 4 * 2 * 3);
+    REQUIRE_EQ(req.rgb8[2], 255);
+    REQUIRE_EQ(req.rgb8[4 * 3], 255);
+    
+    std::string outdir = "framebufferTest";
+    CheckTestOutputDir(outdir);
+    
+    // odd images are encoded by the writer. submit does not wait for any of them
+    const int NUMIMAGES = 6;
+    std::atomic<int> savedcount(0);
+    std::atomic<int> encodedcount(0);
+    std::atomic<int> callerencodes(0);
+    const auto callerid = std::this_thread::get_id();
+    std::vector<std::string> paths;
+    {
+        ImageWriter writer;
+        for(int i = 0; i < NUMIMAGES; i++) {
+            std::stringstream ss;
+            ss << PETALS_TEST_OUTPUT_DIR << "/" << outdir << "/imagewriter" << i << ((i % 2 == 0) ? ".png" : ".jpg");
+            paths.push_back(ss.str());
+            std::filesystem::remove(paths.back());
+            
+            ImageWriter::Request wreq = req;
+            wreq.path = paths.back();
+            if(i % 2 == 1) {
+                wreq.rgb8.clear();
+                wreq.encode = [&](ImageWriter::Request* oreq) {
+                    ImageWriter::encodeRGB8(fb, 1.0, oreq);
+                    encodedcount += 1;
+                    callerencodes += (std::this_thread::get_id() == callerid) ? 1 : 0;
+                };
+            }
+            wreq.onFinished = [&savedcount](bool saved) {
+                savedcount += saved ? 1 : 0;
+            };
+            writer.submit(std::move(wreq));
+        }
+        writer.flush();
+        REQUIRE_EQ(savedcount.load(), NUMIMAGES);
+        REQUIRE_EQ(encodedcount.load(), NUMIMAGES / 2);
+        REQUIRE_EQ(callerencodes.load(), 0);
+    }
+    for(const auto& path : paths) {
+        REQUIRE(std::filesystem::exists(path));
+    }
+}
+
 TEST_CASE("FrameBuffer basic test [FrameBuffer]") {
     FrameBuffer fb(300, 250, 64);
     
@@ -1,4 +1,6 @@
 #include <cmath>
+#include <cstring>
+#include <vector>
 #include <doctest.h>
 #include "../testsupport.h"
 
@@ -34,11 +36,10 @@ TEST_CASE("Ray transform test [Ray]") {
 }
 
 TEST_CASE("Ray triangle test [Ray]") {
-    Mesh::Triangle tri;
     Vector3 va(0.0, 0.0, 0.0);
     Vector3 vb(1.0, 0.0, 0.0);
     Vector3 vc(0.0, 1.0, 0.0);
-    tri.initialize(va, vb, vc);
+    Mesh::TriangleVertices tri(va, vb, vc);
 
     Ray ray(Vector3(0.0, 0.0, 1.0), Vector3(0.0, 0.0, -1.0));
 
@@ -63,6 +64,87 @@ TEST_CASE("Ray triangle test [Ray]") {
     REQUIRE_EQ(bc, doctest::Approx(1.0));
 }
 
+TEST_CASE("Ray triangle watertight test [Ray]") {
+    // quad split on its diagonal. rays through the shared edge must not slip between
+    Vector3 v0(0.1, 0.3, -2.7);
+    Vector3 v1(1.3, 0.2, -2.1);
+    Vector3 v2(1.7, 1.9, -2.9);
+    Vector3 v3(0.3, 1.1, -3.3);
+    Mesh::TriangleVertices tri0(v0, v1, v2);
+    Mesh::TriangleVertices tri1(v0, v2, v3);
+
+    Random rng(1234);
+    for (int i = 0; i < 10000; i++) {
+        Vector3 p = v0 + (v2 - v0) * rng.nextDoubleCO();
+        Vector3 d(rng.nextDoubleCO() - 0.5, rng.nextDoubleCO() - 0.5, -1.0);
+        d.normalize();
+        Ray ray(p - d * 5.0, d);
+
+        RTFloat t0 = tri0.intersection(ray, 0.0, 10.0, nullptr, nullptr);
+        RTFloat t1 = tri1.intersection(ray, 0.0, 10.0, nullptr, nullptr);
+        REQUIRE((t0 >= 0.0 || t1 >= 0.0));
+    }
+}
+
+TEST_CASE("Ray triangle packet test [Ray]") {
+    const int W = Mesh::kTrianglePacketWidth;
+    Random rng(5678);
+
+    int hitCount = 0;
+    for (int n = 0; n < 200; n++) {
+        std::vector<Mesh::TriangleVertices> tris;
+        Mesh::TrianglePacket pkt;
+        // unused lanes are zero, same as Mesh::preprocess
+        memset(&pkt, 0, sizeof(pkt));
+        pkt.count = (n % W) + 1;
+        for (int i = 0; i < pkt.count; i++) {
+            Vector3 c(rng.nextDoubleCO() * 2.0 - 1.0, rng.nextDoubleCO() * 2.0 - 1.0, rng.nextDoubleCO() * 2.0 - 1.0);
+            Vector3 v[3];
+            for (int k = 0; k < 3; k++) {
+                v[k] = c + Vector3(rng.nextDoubleCO() - 0.5, rng.nextDoubleCO() - 0.5, rng.nextDoubleCO() - 0.5);
+            }
+            tris.emplace_back(v[0], v[1], v[2]);
+            pkt.setTriangle(i, 0, i, tris[i]);
+        }
+
+        for (int r = 0; r < 50; r++) {
+            Vector3 o(rng.nextDoubleCO() * 6.0 - 3.0, rng.nextDoubleCO() * 6.0 - 3.0, rng.nextDoubleCO() * 6.0 - 3.0);
+            Vector3 t(rng.nextDoubleCO() - 0.5, rng.nextDoubleCO() - 0.5, rng.nextDoubleCO() - 0.5);
+            Ray ray(o, Vector3::normalized(t - o));
+            Mesh::ShearedRay sray(ray);
+
+            RTFloat expectt = -1.0;
+            int expecti = -1;
+            RTFloat expectb = 0.0, expectc = 0.0;
+            for (int i = 0; i < pkt.count; i++) {
+                RTFloat b, c;
+                RTFloat ht = tris[i].intersection(sray, 0.0, 100.0, &b, &c);
+                if (ht >= 0.0 && (expectt < 0.0 || ht < expectt)) {
+                    expectt = ht;
+                    expecti = i;
+                    expectb = b;
+                    expectc = c;
+                }
+            }
+
+            int lane = -1;
+            RTFloat b, c;
+            RTFloat ht = pkt.intersection(sray, 0.0, 100.0, &lane, &b, &c);
+            REQUIRE_EQ(pkt.occluded(sray, 0.0, 100.0), expectt >= 0.0);
+            if (expectt < 0.0) {
+                REQUIRE(ht < 0.0);
+            } else {
+                REQUIRE(ht == doctest::Approx(expectt).epsilon(1e-4));
+                REQUIRE_EQ(pkt.triangleId[lane], expecti);
+                REQUIRE(b == doctest::Approx(expectb).epsilon(1e-3));
+                REQUIRE(c == doctest::Approx(expectc).epsilon(1e-3));
+                hitCount += 1;
+            }
+        }
+    }
+    REQUIRE(hitCount > 0);
+}
+
 TEST_CASE("Ray generate test [Ray] [Camera]") {
     Camera camera;
 
@@ -0,0 +1,141 @@
+#include <memory>
+#include <vector>
+#include <doctest.h>
+#include "../testsupport.h"
+
+#include <petals/types.h>
+#include <petals/config.h>
+#include <petals/node.h>
+#include <petals/camera.h>
+#include <petals/scene.h>
+#include <petals/texture.h>
+#include <petals/assetlibrary.h>
+#include <petals/framebuffer.h>
+#include <petals/renderer.h>
+#include <petals/random.h>
+
+using namespace Petals;
+
+namespace {
+    // camera only scene. every ray hits the background
+    Scene* MakeBackgroundScene(AssetLibrary* assetlib, bool noisy) {
+        const int W = 256;
+        const int H = 128;
+        std::vector<float> img(W * H * 3);
+        Random rng(4321);
+        for (size_t i = 0; i < img.size(); i += 3) {
+            float v = noisy ? static_cast<float>(rng.nextDoubleCO()) : 0.5f;
+            img[i] = img[i + 1] = img[i + 2] = v;
+        }
+        auto* bg = new ImageTexture(W, H);
+        bg->initWithFpImage(img.data(), 3, 1.0);
+        assetlib->backgroundTex = std::shared_ptr<Texture>(bg);
+
+        auto* cam = new Camera();
+        cam->initWithType(Camera::kPerspectiveCamera);
+        cam->perspective.aspect = 1.0;
+        cam->perspective.yfov = 1.0;
+        cam->perspective.znear = 0.1;
+        cam->perspective.zfar = 100.0;
+        assetlib->cameras.push_back(std::shared_ptr<Camera>(cam));
+
+        auto* node = new Node(0);
+        node->contentType = Node::kContentTypeCamera;
+        node->content.camera = cam;
+        node->initialTransform.makeMatrix();
+        assetlib->nodes.push_back(std::shared_ptr<Node>(node));
+
+        auto* scene = new Scene(assetlib);
+        scene->topLevelNodes.push_back(node);
+        assetlib->scenes.push_back(std::shared_ptr<Scene>(scene));
+        return scene;
+    }
+
+    Config MakeAdaptiveConfig(int threads) {
+        std::string outdir = "rendererTest";
+        CheckTestOutputDir(outdir);
+
+        Config config;
+        config.width = 32;
+        config.height = 32;
+        config.tileSize = 8;
+        config.frames = 1;
+        config.maxThreads = threads;
+        config.pipelineFrames = false;
+        config.outputDir = std::string(PETALS_TEST_OUTPUT_DIR) + "/" + outdir;
+        config.adaptiveMinSamples = 8;
+        config.adaptivePassSamples = 4;
+        config.adaptiveMaxSamples = 40;
+        return config;
+    }
+}
+
+TEST_CASE("Renderer adaptive max samples test [Renderer]") {
+    // serial, and workers requeueing tiles on their own deques
+    for (int threads : { 1, 3 }) {
+        AssetLibrary assetlib;
+        Scene* scene = MakeBackgroundScene(&assetlib, true);
+        Config config = MakeAdaptiveConfig(threads);
+        // out of reach. requeueing stops at max samples
+        config.adaptiveNoiseTarget = 1e-6;
+        REQUIRE(scene->preprocess(&config));
+
+        Renderer renderer(config, scene);
+        renderer.render();
+
+        const auto* fb = renderer.framebuffers[0].get();
+        for (int i = 0; i < config.width * config.height; i++) {
+            const auto& pixel = fb->getPixel(i);
+            REQUIRE_EQ(pixel.sampleCount, config.adaptiveMaxSamples);
+            REQUIRE(pixel.getRelativeError() > config.adaptiveNoiseTarget);
+        }
+    }
+}
+
+TEST_CASE("Renderer adaptive noise target test [Renderer]") {
+    for (int threads : { 1, 3 }) {
+        AssetLibrary assetlib;
+        Scene* scene = MakeBackgroundScene(&assetlib, true);
+        Config config = MakeAdaptiveConfig(threads);
+        config.adaptiveNoiseTarget = 0.05;
+        REQUIRE(scene->preprocess(&config));
+
+        Renderer renderer(config, scene);
+        renderer.render();
+
+        const auto* fb = renderer.framebuffers[0].get();
+        int requeued = 0;
+        int converged = 0;
+        for (int i = 0; i < config.width * config.height; i++) {
+            const auto& pixel = fb->getPixel(i);
+            REQUIRE(pixel.sampleCount >= config.adaptiveMinSamples);
+            REQUIRE(pixel.sampleCount <= config.adaptiveMaxSamples);
+            // below max only when the target is reached
+            if (pixel.sampleCount < config.adaptiveMaxSamples) {
+                REQUIRE(pixel.getRelativeError() <= config.adaptiveNoiseTarget);
+                converged += 1;
+            }
+            requeued += (pixel.sampleCount > config.adaptiveMinSamples) ? 1 : 0;
+        }
+        // the first pass alone does not reach the target, later passes do
+        REQUIRE(requeued > 0);
+        REQUIRE(converged > 0);
+    }
+}
+
+TEST_CASE("Renderer adaptive converged test [Renderer]") {
+    // flat background has no variance. tiles drop out after the first pass
+    AssetLibrary assetlib;
+    Scene* scene = MakeBackgroundScene(&assetlib, false);
+    Config config = MakeAdaptiveConfig(3);
+    config.adaptiveNoiseTarget = 0.01;
+    REQUIRE(scene->preprocess(&config));
+
+    Renderer renderer(config, scene);
+    renderer.render();
+
+    const auto* fb = renderer.framebuffers[0].get();
+    for (int i = 0; i < config.width * config.height; i++) {
+        REQUIRE_EQ(fb->getPixel(i).sampleCount, config.adaptiveMinSamples);
+    }
+}
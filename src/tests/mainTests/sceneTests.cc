@@ -0,0 +1,215 @@
+#include <cmath>
+#include <map>
+#include <memory>
+#include <doctest.h>
+#include "../testsupport.h"
+
+#include <petals/types.h>
+#include <petals/ray.h>
+#include <petals/mesh.h>
+#include <petals/node.h>
+#include <petals/scene.h>
+#include <petals/config.h>
+#include <petals/assetlibrary.h>
+#include <petals/tracablestructure.h>
+#include <petals/bvh.h>
+#include <petals/animation.h>
+#include <petals/keyframesampler.h>
+
+using namespace Petals;
+
+namespace {
+    // unit quad on XY plane
+    Mesh* MakeQuadMesh(AssetLibrary* assetlib) {
+        auto* mesh = new Mesh();
+        mesh->assetId = static_cast<int>(assetlib->meshes.size());
+        mesh->name = "quad";
+
+        std::map<Mesh::AttributeId, int> attrdesc;
+        auto* cluster = new Mesh::Cluster(4, 2, attrdesc);
+        cluster->vertices[0].set(-0.5, -0.5, 0.0);
+        cluster->vertices[1].set(0.5, -0.5, 0.0);
+        cluster->vertices[2].set(0.5, 0.5, 0.0);
+        cluster->vertices[3].set(-0.5, 0.5, 0.0);
+        cluster->triangles[0].a = 0;
+        cluster->triangles[0].b = 1;
+        cluster->triangles[0].c = 2;
+        cluster->triangles[1].a = 0;
+        cluster->triangles[1].b = 2;
+        cluster->triangles[1].c = 3;
+        mesh->clusters.push_back(std::shared_ptr<Mesh::Cluster>(cluster));
+        mesh->totalVertices = 4;
+        mesh->totalTriangles = 2;
+
+        assetlib->meshes.push_back(std::shared_ptr<Mesh>(mesh));
+        return mesh;
+    }
+
+    // grid of quad instances. node i is at (x * 2, y * 2, 0)
+    Scene* MakeInstancedScene(AssetLibrary* assetlib, int gridsize, Mesh* mesh) {
+        auto* scene = new Scene(assetlib);
+        for (int y = 0; y < gridsize; y++) {
+            for (int x = 0; x < gridsize; x++) {
+                auto* node = new Node(static_cast<int>(assetlib->nodes.size()));
+                node->name = "quad" + std::to_string(node->index);
+                node->contentType = Node::kContentTypeMesh;
+                node->content.mesh = mesh;
+                node->initialTransform.translate.set(x * 2.0, y * 2.0, 0.0);
+                node->initialTransform.makeMatrix();
+                assetlib->nodes.push_back(std::shared_ptr<Node>(node));
+                scene->topLevelNodes.push_back(node);
+            }
+        }
+        assetlib->scenes.push_back(std::shared_ptr<Scene>(scene));
+        return scene;
+    }
+}
+
+TEST_CASE("Scene instancing test [Scene]") {
+    const int GRID = 16;
+    AssetLibrary assetlib;
+    Mesh* mesh = MakeQuadMesh(&assetlib);
+    Scene* scene = MakeInstancedScene(&assetlib, GRID, mesh);
+
+    // one instance moves. without exposure slices it uses cached matrix too
+    auto* movingnode = scene->topLevelNodes[GRID + 1];
+    movingnode->animatedFlag = Node::kAnimatedDirect;
+
+    Config config;
+    scene->preprocess(&config);
+    scene->seekTime(0.0, 0.0, config.exposureSlice, 0);
+
+    // one bottom level BVH for all instances
+    REQUIRE_EQ(scene->tracables.size(), GRID * GRID);
+    REQUIRE_EQ(scene->meshes.size(), 1);
+    for (auto* node : scene->tracables) {
+        const auto* trc = node->getTracable(0);
+        REQUIRE_EQ(trc->mesh, mesh);
+        REQUIRE_EQ(trc->instance.meshId, mesh->assetId);
+        REQUIRE_EQ(trc->sliceInstances.size(), config.exposureSlice);
+        REQUIRE(trc->instance.isDecomposed);
+    }
+
+    for (int i = 0; i < GRID * GRID; i++) {
+        RTFloat x = (i % GRID) * 2.0 + 0.25;
+        RTFloat y = (i / GRID) * 2.0 - 0.25;
+        Ray ray(Vector3(x, y, 3.0), Vector3(0.0, 0.0, -1.0));
+
+        SceneIntersection isect;
+        RTFloat t = scene->intersection(ray, kRayOffset, kFarAway, 0.0, &isect);
+        REQUIRE(t == doctest::Approx(3.0));
+        REQUIRE_EQ(scene->tracables[isect.tracableId], scene->topLevelNodes[i]);
+        REQUIRE_EQ(isect.meshIntersect.meshId, mesh->assetId);
+        REQUIRE(scene->occluded(ray, kRayOffset, kFarAway, 0.0));
+
+        // between instances
+        Ray missray(Vector3(x + 1.0, y, 3.0), Vector3(0.0, 0.0, -1.0));
+        REQUIRE(scene->intersection(missray, kRayOffset, kFarAway, 0.0, nullptr) < 0.0);
+        REQUIRE_FALSE(scene->occluded(missray, kRayOffset, kFarAway, 0.0));
+    }
+}
+
+TEST_CASE("Scene instance motion interpolation test [Scene]") {
+    const int SLICE = 3;
+    AssetLibrary assetlib;
+    Mesh* mesh = MakeQuadMesh(&assetlib);
+    Node node(0);
+    node.contentType = Node::kContentTypeMesh;
+    node.content.mesh = mesh;
+    node.animatedFlag = Node::kAnimatedDirect;
+    node.transformCache.assign(1, std::vector<Node::Transform>(SLICE));
+
+    StaticMeshStructure trc(&node, mesh);
+    trc.initialize(SLICE, BVH::BuildOption());
+
+    // rotate 0, 30, 60 degrees around z while moving and scaling
+    for (int i = 0; i < SLICE; i++) {
+        auto& tf = node.currentTransform;
+        tf.translate.set(i * 1.0, 2.0, -i * 0.5);
+        tf.rotation = Quaterion::makeRotation(M_PI / 6.0 * i, 0.0, 0.0, 1.0);
+        tf.scale.set(1.0 + i, 2.0, 0.5);
+        tf.makeMatrix();
+        tf.globalMatrix = tf.matrix;
+        node.currentInverseGlobal = Matrix4::inverted(tf.globalMatrix, nullptr);
+        node.transformCache[0][i] = tf;
+        trc.updateSlice(i);
+        REQUIRE(trc.sliceInstances[i].isDecomposed);
+    }
+
+    auto checkTransform = [&](RTTimeType timerate, const Node::Transform& expect) {
+        Matrix4 gm, igm;
+        trc.instanceTransform(timerate, &gm, &igm);
+        Matrix4 identity = gm * igm;
+        for (int k = 0; k < 16; k++) {
+            REQUIRE(gm.m[k] == doctest::Approx(expect.matrix.m[k]).epsilon(kTestEPS));
+            REQUIRE(identity.m[k] == doctest::Approx((k % 5 == 0) ? 1.0 : 0.0).epsilon(kTestEPS));
+        }
+    };
+
+    // on slices
+    for (int i = 0; i < SLICE; i++) {
+        checkTransform(static_cast<RTTimeType>(i) / (SLICE - 1), node.transformCache[0][i]);
+    }
+
+    // halfway of slice 0 and 1
+    Node::Transform half;
+    half.translate.set(0.5, 2.0, -0.25);
+    half.rotation = Quaterion::makeRotation(M_PI / 12.0, 0.0, 0.0, 1.0);
+    half.scale.set(1.5, 2.0, 0.5);
+    half.makeMatrix();
+    checkTransform(0.25, half);
+
+    // shear is not decomposable
+    MeshInstance sheared;
+    Matrix4 shm = Matrix4::makeScale(1.0, 3.0, 1.0) * Quaterion::makeRotation(M_PI / 4.0, 0.0, 0.0, 1.0).getMatrix();
+    sheared.setMatrix(shm, Matrix4::inverted(shm, nullptr));
+    REQUIRE_FALSE(sheared.isDecomposed);
+}
+
+TEST_CASE("Scene store double buffering test [Scene]") {
+    AssetLibrary assetlib;
+    Mesh* mesh = MakeQuadMesh(&assetlib);
+    Scene* scene = MakeInstancedScene(&assetlib, 1, mesh);
+    auto* node = scene->topLevelNodes[0];
+    node->animatedFlag = Node::kAnimatedDirect;
+    
+    // x moves 0 -> 10 in 1 sec
+    auto* sampler = new KeyframeSampler();
+    sampler->timeStamps = { 0.0, 1.0 };
+    sampler->sampleBuffer = { 0.0, 0.0, 0.0, 10.0, 0.0, 0.0 };
+    sampler->sampleComponents = 3;
+    auto* anim = new Animation();
+    anim->samplers.push_back(std::shared_ptr<KeyframeSampler>(sampler));
+    anim->targets.push_back({ sampler, node, Animation::kTranslation });
+    assetlib.animations.push_back(std::shared_ptr<Animation>(anim));
+    
+    Config config;
+    config.pipelineFrames = true;
+    scene->preprocess(&config);
+    REQUIRE_EQ(scene->getStoreCount(), 2);
+    REQUIRE_NE(node->getTracable(0), node->getTracable(1));
+    REQUIRE_EQ(node->getTracable(1)->storeId, 1);
+    
+    // the next frame is set up while the current one is traced
+    scene->seekTime(0.0, 0.0, config.exposureSlice, 0);
+    scene->seekTime(1.0, 1.0, config.exposureSlice, 1);
+    
+    Ray ray0(Vector3(0.0, 0.0, 3.0), Vector3(0.0, 0.0, -1.0));
+    Ray ray1(Vector3(10.0, 0.0, 3.0), Vector3(0.0, 0.0, -1.0));
+    SceneIntersection isect;
+    REQUIRE(scene->intersection(ray0, kRayOffset, kFarAway, 0.0, &isect, 0) == doctest::Approx(3.0));
+    REQUIRE_EQ(isect.storeId, 0);
+    REQUIRE(scene->intersection(ray0, kRayOffset, kFarAway, 0.0, nullptr, 1) < 0.0);
+    REQUIRE(scene->intersection(ray1, kRayOffset, kFarAway, 0.0, &isect, 1) == doctest::Approx(3.0));
+    REQUIRE_EQ(isect.storeId, 1);
+    REQUIRE(scene->occluded(ray0, kRayOffset, kFarAway, 0.0, 0));
+    REQUIRE_FALSE(scene->occluded(ray1, kRayOffset, kFarAway, 0.0, 0));
+    REQUIRE(scene->occluded(ray1, kRayOffset, kFarAway, 0.0, 1));
+    REQUIRE(node->computeGlobalMatrix(0.0, 0).m30 == doctest::Approx(0.0));
+    REQUIRE(node->computeGlobalMatrix(0.0, 1).m30 == doctest::Approx(10.0));
+    
+    // rewriting store 0 keeps store 1
+    scene->seekTime(0.5, 0.5, config.exposureSlice, 0);
+    REQUIRE(scene->intersection(ray1, kRayOffset, kFarAway, 0.0, nullptr, 1) == doctest::Approx(3.0));
+    REQUIRE(node->computeGlobalMatrix(0.0, 0).m30 == doctest::Approx(5.0));
+}
@@ -1,5 +1,8 @@
 #include <string>
 #include <sstream>
+#include <fstream>
+#include <iostream>
+#include <vector>
 
 #include <doctest.h>
 #include "../testsupport.h"
@@ -11,6 +14,8 @@
 #include <petals/sceneloader.h>
 #include <petals/animstand.h>
 
+#include <stb/stb_image_write.h>
+
 using namespace Petals;
 
 namespace {
@@ -22,6 +27,35 @@ namespace {
         ss << name << ".gltf";
         return ss.str();
     }
+
+    // animstand scene of two cuts in the output directory, banks given as "name":"source" pairs
+    std::string WriteAnimStandScene(const std::string& name, const std::string& bank1, const std::string& bank2) {
+        std::stringstream ss;
+        ss << R"({
+    "animstand": {"major_version": 1, "minor_version": 0},
+    "movie": {"sequence": ["cut1", "cut2"], "output": {"width": 64, "height": 64}},
+    "cut_list": [)";
+        const std::string banks[] = { bank1, bank2 };
+        for (int i = 0; i < 2; i++) {
+            ss << ((i > 0) ? "," : "") << R"({
+        "name": "cut)" << (i + 1) << R"(",
+        "cut": {
+            "last_frame": 1,
+            "bank": [)" << banks[i] << R"(],
+            "timesheet": {},
+            "animation": {},
+            "plane_setup": [],
+            "shot": []
+        }
+    })";
+        }
+        ss << "]\n}\n";
+
+        std::string path = std::string(PETALS_TEST_OUTPUT_DIR) + "/sceneloaderTest/" + name + ".json";
+        std::ofstream ofs(path);
+        ofs << ss.str();
+        return path;
+    }
 }
 
 TEST_CASE("Scene loader test [SceneLoader] [glTF]") {
@@ -64,8 +98,51 @@ TEST_CASE("Cell stage scene test 01 [SceneLoader] [AnimStand]") {
     AnimationStand* animstand = SceneLoader::loadAnimStand(path);
     REQUIRE(animstand != nullptr);
 
+    // cel paths are resolved from the cut file. missing images do not fail the load
+    for (const auto& cutite : animstand->cutList) {
+        for (const auto& celite : cutite.second->bank) {
+            REQUIRE(celite.second->path.find(PETALS_TEST_DATA_DIR) == 0);
+        }
+    }
+
     //animstand->outconf.directory = PETALS_TEST_OUTPUT_DIR;
     //animstand->render();
 
     // delete animstand;
 }
+
+TEST_CASE("Cell stage missing image test [SceneLoader] [AnimStand]") {
+    std::string outdir = "sceneloaderTest";
+    CheckTestOutputDir(outdir);
+    std::string dirpath = std::string(PETALS_TEST_OUTPUT_DIR) + "/" + outdir;
+
+    std::vector<unsigned char> img(4 * 4 * 4, 255);
+    REQUIRE(stbi_write_png((dirpath + "/valid.png").c_str(), 4, 4, 4, img.data(), 0) != 0);
+    {
+        std::ofstream ofs(dirpath + "/broken.png");
+        ofs << "not an image";
+    }
+
+    // cut2 shares the missing file with cut1. each bank entry is reported
+    std::string path = WriteAnimStandScene("missing_images",
+        R"({"name": "b", "source": "nothing.png"}, {"name": "a", "source": "valid.png"}, {"name": "c", "source": "broken.png"})",
+        R"({"name": "x", "source": "nothing.png"}, {"name": "y", "source": "valid.png"})");
+
+    std::stringstream errs;
+    auto* cerrbuf = std::cerr.rdbuf(errs.rdbuf());
+    AnimationStand* animstand = SceneLoader::loadAnimStand(path);
+    std::cerr.rdbuf(cerrbuf);
+
+    // missing and unreadable images do not fail the load
+    REQUIRE(animstand != nullptr);
+    REQUIRE_EQ(animstand->cutList.size(), 2);
+
+    // cut and cel name order, whatever order the jobs ran in
+    std::stringstream expected;
+    expected << "cel image load failed:[cut1][b] " << dirpath << "/nothing.png\n";
+    expected << "cel image load failed:[cut1][c] " << dirpath << "/broken.png\n";
+    expected << "cel image load failed:[cut2][x] " << dirpath << "/nothing.png\n";
+    REQUIRE_EQ(errs.str(), expected.str());
+
+    delete animstand;
+}
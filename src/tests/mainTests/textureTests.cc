@@ -7,6 +7,9 @@
 
 #include <petals/types.h>
 #include <petals/texture.h>
+#include <petals/celstack.h>
+#include <petals/celcache.h>
+#include <petals/random.h>
 
 #include <stb/stb_image.h>
 #include <stb/stb_image_write.h>
@@ -133,3 +136,193 @@ TEST_CASE("ImageTexture load test [Texture]") {
     
     REQUIRE(true);
 }
+
+TEST_CASE("Cel stack kernel test [Texture]") {
+    // front cel: half transparent gradient, back cel: opaque gray
+    const int w = 37;
+    const int h = 21;
+    std::vector<unsigned char> front(w * h * 4);
+    std::vector<unsigned char> back(w * h * 4, 128);
+    for (int i = 0; i < w * h; i++) {
+        front[i * 4 + 0] = static_cast<unsigned char>((i % w) * 255 / (w - 1));
+        front[i * 4 + 1] = static_cast<unsigned char>((i / w) * 255 / (h - 1));
+        front[i * 4 + 2] = 64;
+        front[i * 4 + 3] = 128;
+        back[i * 4 + 3] = 255;
+    }
+    ImageTexture fronttex(w, h);
+    fronttex.initWith8BPPImage(front.data(), 4, 2.2);
+    ImageTexture backtex(w, h);
+    backtex.initWith8BPPImage(back.data(), 4, 2.2);
+
+    CelTexels frontcel, backcel;
+    frontcel.initWithTexture(fronttex);
+    backcel.initWithTexture(backtex);
+    REQUIRE(frontcel.decodeTable[64] == doctest::Approx(std::pow(64.0 / 255.0, 2.2)));
+    REQUIRE_EQ(frontcel.texels, fronttex.getRGBA8Data());
+
+    // 0.254 x 0.142875 [m] cels
+    CelStackKernel::Plane planes[2];
+    planes[0] = { &frontcel, -0.5f, 1.0f / 0.254f, 1.0f / 0.142875f };
+    planes[1] = { &backcel, -0.6f, 1.0f / 0.254f, 1.0f / 0.142875f };
+
+    // constant cel color
+    {
+        CelStackKernel::RayBatch batch;
+        CelStackKernel::Result result;
+        batch.set(0, Ray(Vector3(0.0, 0.0, 0.0), Vector3(0.0, 0.0, -1.0)));
+        batch.count = 1;
+        CelStackKernel::composite(&planes[1], 1, batch, &result);
+        REQUIRE(result.r[0] == doctest::Approx(std::pow(128.0 / 255.0, 2.2)).epsilon(1e-5));
+        REQUIRE(result.alpha[0] == doctest::Approx(0.0));
+    }
+
+    // default builds are AVX. composite must not fall back to the per ray path there
+#if defined(__AVX2__)
+    REQUIRE(CelStackKernel::getPath() == CelStackKernel::Path::kAVX2);
+#elif defined(__AVX__)
+    REQUIRE(CelStackKernel::getPath() == CelStackKernel::Path::kAVX);
+#else
+    WARN(CelStackKernel::getPath() != CelStackKernel::Path::kScalar);
+#endif
+
+    // batches including partial ones match the per ray path
+    Random rng(1234);
+    for (int count = 1; count <= CelStackKernel::kBatchSize; count++) {
+        CelStackKernel::RayBatch batch;
+        for (int i = 0; i < CelStackKernel::kBatchSize; i++) {
+            // some rays miss the cels and clamp
+            Vector3 dir(rng.nextDoubleCC() - 0.5, rng.nextDoubleCC() - 0.5, -1.0);
+            dir.normalize();
+            batch.set(i, Ray(Vector3(rng.nextDoubleCC() * 0.01, 0.0, 0.0), dir));
+        }
+        batch.count = count;
+
+        CelStackKernel::Result simd, scalar;
+        CelStackKernel::composite(planes, 2, batch, &simd);
+        CelStackKernel::compositeScalar(planes, 2, batch, &scalar);
+        for (int i = 0; i < count; i++) {
+            REQUIRE(simd.r[i] == doctest::Approx(scalar.r[i]).epsilon(1e-5));
+            REQUIRE(simd.g[i] == doctest::Approx(scalar.g[i]).epsilon(1e-5));
+            REQUIRE(simd.b[i] == doctest::Approx(scalar.b[i]).epsilon(1e-5));
+            REQUIRE(simd.alpha[i] == doctest::Approx(0.0));
+        }
+    }
+}
+
+TEST_CASE("ImageTexture linear storage test [Texture]") {
+    const unsigned char src8[4] = { 0, 64, 128, 255 };
+    const unsigned short src16[4] = { 0, 16384, 32768, 65535 };
+    const float srcfp[4] = { 0.0f, 0.25f, 0.5f, 1.0f };
+
+    // half storage keeps 11 bits
+    auto check = [](ImageTexture& tex, ImageTexture& datatex, double eps) {
+        tex.sampleType = ImageTexture::kNearest;
+        datatex.sampleType = ImageTexture::kNearest;
+        REQUIRE(tex.isLinear);
+        REQUIRE_FALSE(datatex.isLinear);
+        for (int i = 0; i < 4; i++) {
+            RTFloat u = (i + 0.5) / 4.0;
+            auto raw = datatex.sample(u, 0.5, false);
+            auto lin = tex.sample(u, 0.5, true);
+            // decoded once at load, same as the per sample decode of data textures
+            REQUIRE(lin.rgb.r == doctest::Approx(std::pow(raw.rgb.r, 2.2)).epsilon(eps));
+            REQUIRE(datatex.sample(u, 0.5, true).rgb.g == doctest::Approx(lin.rgb.g).epsilon(eps));
+            // stored values are returned without gamma correction
+            REQUIRE(tex.sample(u, 0.5, false).rgb.b == doctest::Approx(lin.rgb.b).epsilon(kTestEPS));
+        }
+    };
+
+    ImageTexture tex8(4, 1), data8(4, 1);
+    tex8.initWith8BPPImage(src8, 1, 2.2);
+    data8.initWith8BPPImage(src8, 1, 2.2, false);
+    REQUIRE_EQ(tex8.getFormat(), ImageTexture::kRGBA8);
+    REQUIRE_EQ(tex8.getTexelBytes(), 4 * 4);
+    check(tex8, data8, kTestEPS);
+
+    ImageTexture tex16(4, 1), data16(4, 1);
+    tex16.initWith16BPPImage(src16, 1, 2.2);
+    data16.initWith16BPPImage(src16, 1, 2.2, false);
+    REQUIRE_EQ(tex16.getFormat(), ImageTexture::kRGBA16F);
+    check(tex16, data16, 2e-3);
+
+    ImageTexture texfp(4, 1), datafp(4, 1);
+    texfp.initWithFpImage(srcfp, 1, 2.2);
+    datafp.initWithFpImage(srcfp, 1, 2.2, false);
+    REQUIRE_EQ(texfp.getFormat(), ImageTexture::kRGBA16F);
+    check(texfp, datafp, 2e-3);
+
+    // out of half range
+    const float hdr[4] = { 0.0f, 1.0f, 1e5f, 0.5f };
+    ImageTexture texhdr(4, 1);
+    texhdr.initWithFpImage(hdr, 1, 1.0);
+    texhdr.sampleType = ImageTexture::kNearest;
+    REQUIRE_EQ(texhdr.getFormat(), ImageTexture::kRGBA32F);
+    REQUIRE(texhdr.sample(2.5 / 4.0, 0.5, true).rgb.r == doctest::Approx(1e5));
+
+    // half conversion round trip
+    const float values[] = { 0.0f, 1.0f, -2.5f, 1.0f / 3.0f, 1e-6f, 65504.0f, 0.001f };
+    for (float v : values) {
+        ImageTexture tex(1, 1);
+        tex.initWithFpImage(&v, 1, 1.0);
+        // relative to 11 bits, or the denormal step
+        REQUIRE(std::abs(tex.getTexel(0, 0).rgb.r - v) <= std::abs(v) * 1e-3 + 6e-8);
+    }
+}
+
+TEST_CASE("CelCache test [Texture]") {
+    std::string outdir = "textureTest";
+    CheckTestOutputDir(outdir);
+
+    // 3 images of 64x64 RGBA8, 16KB each
+    const int w = 64;
+    std::vector<std::string> paths;
+    for (int i = 0; i < 3; i++) {
+        std::vector<unsigned char> buf(w * w * 4, static_cast<unsigned char>(i * 100));
+        std::stringstream ss;
+        ss << PETALS_TEST_OUTPUT_DIR << "/" << outdir << "/cel" << i << ".png";
+        paths.push_back(ss.str());
+        REQUIRE(stbi_write_png(paths.back().c_str(), w, w, 4, buf.data(), 0) != 0);
+    }
+    const size_t imagebytes = w * w * 4;
+
+    CelCache cache(imagebytes * 2);
+    {
+        auto img0 = cache.acquire(paths[0]);
+        REQUIRE(img0 != nullptr);
+        REQUIRE_EQ(img0->texture->getFormat(), ImageTexture::kRGBA8);
+        REQUIRE_EQ(cache.acquire(paths[0]), img0);
+        REQUIRE_EQ(cache.getStats().decoded, 1);
+        REQUIRE_EQ(cache.getStats().hits, 1);
+
+        // img0 is in use, so img1 goes over the budget instead
+        cache.acquire(paths[1]);
+        cache.acquire(paths[2]);
+        REQUIRE_EQ(cache.getStats().evicted, 1);
+        REQUIRE_EQ(cache.getResidentBytes(), imagebytes * 2);
+        REQUIRE_EQ(cache.acquire(paths[0]), img0);
+        REQUIRE_EQ(cache.getStats().decoded, 3);
+    }
+
+    // least recently used is 2
+    cache.acquire(paths[1]);
+    REQUIRE_EQ(cache.getStats().decoded, 4);
+    REQUIRE_EQ(cache.getStats().evicted, 2);
+    cache.acquire(paths[0]);
+    REQUIRE_EQ(cache.getStats().decoded, 4);
+
+    // prefetched image is decoded once
+    cache.prefetch(paths[2]);
+    auto img2 = cache.acquire(paths[2]);
+    REQUIRE(img2 != nullptr);
+    REQUIRE(img2->texels.decodeTable[200] == doctest::Approx(std::pow(200.0 / 255.0, 2.2)));
+    REQUIRE_EQ(cache.getStats().decoded, 5);
+
+    // failed files are remembered
+    REQUIRE(cache.acquire(paths[0] + ".missing") == nullptr);
+    REQUIRE(cache.acquire(paths[0] + ".missing") == nullptr);
+    REQUIRE_EQ(cache.getStats().decoded, 5);
+
+    cache.clear();
+    REQUIRE_EQ(cache.getResidentBytes(), imagebytes);
+}
@@ -1,6 +1,7 @@
 #ifndef LINEARALGEBRA_TESTSUPPORT_H
 #define LINEARALGEBRA_TESTSUPPORT_H
 
+#include <string>
 #include "testconfig.h"
 
 namespace Petals {